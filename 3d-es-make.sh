@@ -354,6 +354,9 @@ do
     # Only compile the patch files that have been installed.
     if [[ $file == *ArduinoCorePatches* ]]; then continue; fi
 
+    # The host tests are built separately (see Tests/Makefile).
+    if [[ $file == */Tests/* ]]; then continue; fi
+
     # Intermediate build output.
     D=${BUILD}/$(basename $file).d
     O=${BUILD}/$(basename $file).o
@@ -374,6 +377,9 @@ do
     # Only compile the patch files that have been installed.
     if [[ $file == *ArduinoCorePatches* ]]; then continue; fi
 
+    # The host tests are built separately (see Tests/Makefile).
+    if [[ $file == */Tests/* ]]; then continue; fi
+
     # Intermediate build output.
     D=${BUILD}/$(basename $file).d
     O=${BUILD}/$(basename $file).o
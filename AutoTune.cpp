@@ -0,0 +1,106 @@
+/****************************************************************************************************
+
+RepRapFirmware - AutoTune
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include <math.h>
+#include "Configuration.h"
+#include "AutoTune.h"
+
+static const float pi = 3.14159265358979;
+
+void RelayTuner::Start(float t, float p, unsigned int cycles, float temperature, float now)
+{
+	target = t;
+	power = p;
+	cyclesWanted = (uint8_t)cycles;
+	cyclesDone = 0;
+	startTime = switchOnTime = switchOffTime = highTime = now;
+	heaterOn = true;
+	low = high = startTemperature = temperature;
+	heatUpTime = 0.0;
+	periodSum = amplitudeSum = dutySum = delaySum = 0.0;
+}
+
+bool RelayTuner::Sample(float temperature, float now)
+{
+	if (heaterOn)
+	{
+		if (temperature < low)
+		{
+			low = temperature;
+		}
+		if (temperature >= target + AUTO_TUNE_HYSTERESIS)
+		{
+			heaterOn = false;
+			switchOffTime = highTime = now;
+			if (cyclesDone == 0)
+			{
+				heatUpTime = now - startTime;
+			}
+			high = temperature;
+		}
+	}
+	else
+	{
+		if (temperature > high)
+		{
+			high = temperature;
+			highTime = now;
+		}
+		if (temperature <= target - AUTO_TUNE_HYSTERESIS)
+		{
+			// One oscillation is complete. Accumulate it unless it is the heat-up.
+			if (cyclesDone != 0)
+			{
+				const float period = now - switchOnTime;
+				periodSum += period;
+				amplitudeSum += (high - low) * 0.5;
+				dutySum += (switchOffTime - switchOnTime)/period;
+				delaySum += highTime - switchOffTime;
+			}
+			++cyclesDone;
+			if (cyclesDone > cyclesWanted)
+			{
+				return true;
+			}
+			heaterOn = true;
+			switchOnTime = now;
+			low = temperature;
+		}
+	}
+	return false;
+}
+
+// The amplitude and period of the oscillation give the ultimate gain and period of the loop. The average duty cycle
+// gives the steady-state gain of the heater, and the time from switching off to the peak temperature gives the dead time.
+// The heat-up from the starting temperature, less the dead time, then gives the time constant.
+bool RelayTuner::Fit(RelayTuneResult& result) const
+{
+	const float cycles = (float)cyclesWanted;
+	const float amplitude = amplitudeSum/cycles;
+	const float duty = dutySum/cycles;
+	result.tu = periodSum/cycles;
+	if (amplitude <= AUTO_TUNE_HYSTERESIS || result.tu <= 0.0 || duty <= 0.0)
+	{
+		return false;
+	}
+
+	result.ku = (2.0 * power)/(pi * sqrt(amplitude * amplitude - AUTO_TUNE_HYSTERESIS * AUTO_TUNE_HYSTERESIS));
+	result.deadTime = delaySum/cycles;
+
+	const float finalRise = (target - 25.0)/duty;		// where the heat-up was heading, relative to ambient
+	result.gain = finalRise/power;
+	const float remaining = (25.0 + finalRise - (target + AUTO_TUNE_HYSTERESIS))/(25.0 + finalRise - startTemperature);
+	result.timeConstant = (remaining > 0.0 && remaining < 1.0 && heatUpTime > result.deadTime)
+							? (heatUpTime - result.deadTime)/-log(remaining)
+							: 0.0;
+	return true;
+}
+
+// End
@@ -0,0 +1,88 @@
+/****************************************************************************************************
+
+RepRapFirmware - AutoTune
+
+Relay auto tuning of heaters. The relay is switched fully on below the target temperature and off above it,
+with a little hysteresis, and the temperature oscillation that results is measured. The measurements are fitted
+to a first-order-plus-dead-time model of the heater. Nothing in here depends on the hardware, so that it can
+also be built and tested on the host against a simulated heater (see Tests).
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <stdint.h>
+
+// The result of a relay auto tune. Gains are per unit of heater PWM, and temperatures are relative to an ambient of 25C.
+
+struct RelayTuneResult
+{
+	float ku;								// Ultimate gain of the loop, PWM per degree C
+	float tu;								// Ultimate period of the loop, seconds
+	float gain;								// Steady-state temperature rise above ambient at full PWM, degrees C
+	float timeConstant;						// Time constant of the heater, seconds, or 0 if it couldn't be fitted
+	float deadTime;							// Delay between a change of power and the temperature starting to respond, seconds
+};
+
+class RelayTuner
+{
+  public:
+	void Start(float target, float power, unsigned int cycles, float startTemperature, float now);
+	bool Sample(float temperature, float now);		// Record a temperature sample; returns true when enough oscillations have been measured
+	bool Fit(RelayTuneResult& result) const;		// Fit the model to the measurements; returns false if they are unusable
+	float Pwm() const;								// The PWM the relay is asking for
+	float Target() const;
+	float Elapsed(float now) const;					// Seconds since we started
+	unsigned int CyclesWanted() const;
+	unsigned int CyclesMeasured() const;			// Complete oscillations measured so far, not counting the heat-up
+
+  private:
+	bool heaterOn;									// Is the relay currently on?
+	uint8_t cyclesWanted;							// Number of oscillations to measure
+	uint8_t cyclesDone;								// Number of complete oscillations so far, including the heat-up
+	float target;									// Temperature the relay switches around
+	float power;									// Heater PWM when the relay is on
+	float startTime;								// When we started
+	float switchOnTime;								// When the relay last switched on
+	float switchOffTime;							// When the relay last switched off
+	float low, high;								// Lowest temperature while on and highest while off in this oscillation
+	float highTime;									// When we saw high
+	float startTemperature;							// Temperature when we started
+	float heatUpTime;								// Time taken to first reach the upper switching temperature
+	float periodSum;								// Sums over the measured oscillations
+	float amplitudeSum;
+	float dutySum;
+	float delaySum;
+};
+
+inline float RelayTuner::Pwm() const
+{
+	return (heaterOn) ? power : 0.0;
+}
+
+inline float RelayTuner::Target() const
+{
+	return target;
+}
+
+inline float RelayTuner::Elapsed(float now) const
+{
+	return now - startTime;
+}
+
+inline unsigned int RelayTuner::CyclesWanted() const
+{
+	return cyclesWanted;
+}
+
+inline unsigned int RelayTuner::CyclesMeasured() const
+{
+	return (cyclesDone == 0) ? 0 : cyclesDone - 1;
+}
+
+#endif
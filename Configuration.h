@@ -59,6 +59,38 @@ enum Compatibility
 #define HOT_ENOUGH_TO_RETRACT (90.0)			// Celsius
 #define TIME_TO_HOT (150.0)						// Seconds
 
+// Heating rate fault detection (M570). The temperature rise over each period is compared with the rise that the
+// applied power should have produced, and too little rise over consecutive periods is a fault.
+
+#define HEATING_FAULT_PERIOD (5.0)				// Seconds over which the temperature rise is measured
+#define BED_HEATING_FAULT_PERIOD (30.0)			// The same for the bed, which responds much more slowly
+#define HEATING_FAULT_FRACTION (0.3)			// Fault if the rise is less than this fraction of the expected rise...
+#define HEATING_FAULT_PERIODS 2					// ...for this many periods in a row, which allows for the dead time
+#define HEATING_FAULT_MIN_RISE (3.0)			// Celsius; periods in which we expect less rise than this are not judged
+#define HEATING_FAULT_RATE (2.0)				// Celsius/sec expected at full power when there is no thermal model
+#define BED_HEATING_FAULT_RATE (0.3)			// The same for the bed
+#define HEATING_FAULT_TAPER (20.0)				// Celsius; without a model the expected rate falls to zero over this margin below the target
+
+// Heater scheduling (M309). Slow heaters such as beds and chambers can run their control loop less often, and are
+// switched on one at a time so that several high-power heaters don't all draw full current together.
+
+#define BED_SAMPLE_MULTIPLE 2					// The bed is controlled every this many heat sample times
+#define MAX_SAMPLE_MULTIPLE 20					// The longest sample period allowed, in heat sample times
+#define HEATER_STAGGER_TIME (2.0)				// Seconds between switching on successive slow heaters
+
+// Temperature history served by rr_history
+
+#define HEAT_HISTORY_INTERVAL (1.0)				// Seconds between samples
+#define HEAT_HISTORY_LENGTH 600					// Samples kept for each heater, which must be a multiple of HEAT_HISTORY_BLOCK
+#define HEAT_HISTORY_BLOCK 60					// Samples between absolute temperatures
+
+// PID auto tuning (M303)
+
+#define AUTO_TUNE_HYSTERESIS (1.0)				// Celsius either side of the target temperature at which the relay switches
+#define AUTO_TUNE_CYCLES 5						// Default number of oscillations measured, not counting the initial heat-up
+#define AUTO_TUNE_MAX_CYCLES 20					// Largest number of oscillations that may be requested
+#define AUTO_TUNE_MAX_TIME (1800.0)				// Seconds before an unfinished auto tune is abandoned
+
 #define DEFAULT_IDLE_CURRENT_FACTOR (0.3)		// Proportion of normal motor current that we use for idle hold
 
 // If temperatures fall outside this range, something nasty has happened.
@@ -75,6 +107,11 @@ enum Compatibility
 
 #define SILLY_Z_VALUE -9999.0
 
+// G-Code input scheduling
+
+#define GCODE_SPIN_BYTE_BUDGET 256				// Maximum number of bytes read from all G-Code sources in one call to GCodes::Spin
+#define GCODE_SPIN_LINE_BUDGET 4				// Maximum number of codes started from all G-Code sources in one call to GCodes::Spin
+
 // String lengths
 
 #define STRING_LENGTH 1024
@@ -88,6 +125,7 @@ enum Compatibility
 #define MAX_LAYER_SAMPLES 5						// Number of layer samples (except for first layer)
 #define ESTIMATION_MIN_FILAMENT_USAGE 0.025		// Minimum per cent for filament usage estimation
 #define FIRST_LAYER_SPEED_FACTOR 0.25			// First layer speed compared to others (only for layer-based estimation)
+#define MAX_CACHED_FILE_INFO 4					// Number of uploaded files whose G-code file info is remembered
 
 // Webserver stuff
 
@@ -0,0 +1,31 @@
+/****************************************************************************************************
+
+RepRapFirmware - FeedForward
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include "FeedForward.h"
+
+void ThermalModel::Init()
+{
+	heatingRate = coolingRate = fanFactor = extrusionFactor = 0.0;
+	enabled = false;
+}
+
+bool ThermalModel::IsValid() const
+{
+	return heatingRate > 0.0 && coolingRate > 0.0 && fanFactor >= 0.0 && extrusionFactor >= 0.0;
+}
+
+// Return the PWM that balances the heat losses at the target temperature, assuming an ambient temperature of 25C
+float ThermalModel::FeedForwardPwm(float targetTemperature, float fan, float filamentRate) const
+{
+	const float pwm = (coolingRate * (targetTemperature - 25.0) * (1.0 + fanFactor * fan) + extrusionFactor * filamentRate)/heatingRate;
+	return (pwm < 0.0) ? 0.0 : (pwm > 1.0) ? 1.0 : pwm;
+}
+
+// End
@@ -0,0 +1,98 @@
+/****************************************************************************************************
+
+RepRapFirmware - FeedForward
+
+The thermal model that the heaters use for feed-forward, and the running totals of planned extrusion
+that tell them how much filament is about to go through. Nothing in here depends on the hardware, so
+that it can also be built and tested on the host (see Tests).
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef FEEDFORWARD_H
+#define FEEDFORWARD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A simple thermal model of a heater, used to add feed-forward to the PID output.
+ * dT/dt = heatingRate * pwm - coolingRate * (T - ambient) * (1 + fanFactor * fan) - extrusionFactor * filamentRate
+ */
+
+class ThermalModel
+{
+  public:
+    float heatingRate;								// Rate of temperature rise at full PWM, C/sec, ignoring losses
+    float coolingRate;								// Rate of temperature fall per degree above ambient, 1/sec, fan off
+    float fanFactor;								// Fraction by which the cooling rate increases with the fan at full speed
+    float extrusionFactor;							// Temperature drop per mm of filament extruded, C/mm
+    bool enabled;									// Use the model for feed-forward?
+
+    void Init();
+    bool IsValid() const;
+    float FeedForwardPwm(float targetTemperature, float fan, float filamentRate) const;	// PWM needed to hold the target temperature
+};
+
+/**
+ * Running totals of the time and forward extruder steps of the moves that are queued or executing. The main loop
+ * only writes the added totals and the step interrupt only writes the removed ones, so they can be read without
+ * locking. The totals are allowed to wrap: only their differences matter.
+ */
+
+template<size_t extruders> class PlannedExtrusion
+{
+  public:
+    void Init();
+    void Add(uint32_t micros, const uint32_t steps[]);		// A move has been queued (main loop)
+    void Remove(uint32_t micros, const uint32_t steps[]);	// A move has finished or been cancelled (step interrupt)
+    float Rate(size_t extruder, float stepsPerMm) const;	// Filament feed rate in mm/sec over the planned moves
+
+  private:
+    uint32_t microsAdded;
+    uint32_t stepsAdded[extruders];
+    volatile uint32_t microsRemoved;
+    volatile uint32_t stepsRemoved[extruders];
+};
+
+template<size_t extruders> void PlannedExtrusion<extruders>::Init()
+{
+	microsAdded = microsRemoved = 0;
+	for (size_t extruder = 0; extruder < extruders; extruder++)
+	{
+		stepsAdded[extruder] = stepsRemoved[extruder] = 0;
+	}
+}
+
+template<size_t extruders> void PlannedExtrusion<extruders>::Add(uint32_t micros, const uint32_t steps[])
+{
+	microsAdded += micros;
+	for (size_t extruder = 0; extruder < extruders; extruder++)
+	{
+		stepsAdded[extruder] += steps[extruder];
+	}
+}
+
+template<size_t extruders> void PlannedExtrusion<extruders>::Remove(uint32_t micros, const uint32_t steps[])
+{
+	microsRemoved += micros;
+	for (size_t extruder = 0; extruder < extruders; extruder++)
+	{
+		stepsRemoved[extruder] += steps[extruder];
+	}
+}
+
+template<size_t extruders> float PlannedExtrusion<extruders>::Rate(size_t extruder, float stepsPerMm) const
+{
+	// Read the removed totals first, so that an interrupt in between can't make the differences negative
+	const uint32_t microsGone = microsRemoved;
+	const uint32_t stepsGone = stepsRemoved[extruder];
+	const uint32_t micros = microsAdded - microsGone;
+	const uint32_t steps = stepsAdded[extruder] - stepsGone;
+	return (micros != 0) ? (steps*1000000.0)/(micros*stepsPerMm) : 0.0;
+}
+
+#endif
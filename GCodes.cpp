@@ -39,6 +39,7 @@ GCodes::GCodes(Platform* p, Webserver* w)
 	auxGCode = new GCodeBuffer(platform, "aux: ");
 	fileMacroGCode = new GCodeBuffer(platform, "macro: ");
 	queuedGCode = new GCodeBuffer(platform, "queued: ");
+	codeQueue = new CodeQueue();
 }
 
 void GCodes::Exit()
@@ -76,11 +77,18 @@ void GCodes::Init()
 	toolChangeSequence = 0;
 	coolingInverted = false;
 	lastFanValue = 0.0;
-	internalCodeQueue = NULL;
-	releasedQueueItems = NULL;
-	for(uint8_t i=0; i<codeQueueLength; i++)
+	codeQueue->Init();
+	firstInputChannel = 0;
+	for (size_t channel = 0; channel < NumInputChannels; channel++)
 	{
-		releasedQueueItems = new CodeQueueItem(releasedQueueItems);
+		channelStats[channel].lines = 0;
+		channelStats[channel].waitingSince = channelStats[channel].totalWaitTime = channelStats[channel].maxWaitTime = 0.0;
+	}
+	lastChannelStatsTime = longWait;
+	for (size_t i = 0; i < numMacroSources; i++)
+	{
+		macroStats[i].count = 0;
+		macroStats[i].totalTime = macroStats[i].maxTime = 0.0;
 	}
 }
 
@@ -129,7 +137,9 @@ void GCodes::Spin()
 		}
 		else
 		{
-			// Process more of the macro file
+			// Process more of the macro file. The time spent reading it is recorded separately from acting on the code.
+			const uint32_t readStartTime = micros();
+			bool gotCode = false;
 			size_t i = 0;
 			do
 			{
@@ -138,22 +148,17 @@ void GCodes::Spin()
 				{
 					if (fileMacroGCode->Put(b))
 					{
-						fileMacroGCode->SetFinished(ActOnCode(fileMacroGCode, true));
+						gotCode = true;
 						break;
 					}
 				}
 				else
 				{
-					if (!fileMacroGCode->IsEmpty())
+					if (!fileMacroGCode->IsEmpty() && fileMacroGCode->Put('\n')) // In case there wasn't one ending the file
 					{
-						if (fileMacroGCode->Put('\n')) // In case there wasn't one ending the file
-						{
-							fileMacroGCode->SetFinished(ActOnCode(fileMacroGCode, true));
-							break;
-						}
+						gotCode = true;
 					}
-
-					if (!fileMacroGCode->Active())
+					else if (!fileMacroGCode->Active())
 					{
 						fileBeingPrinted.Close();
 						returningFromMacro = true;
@@ -163,6 +168,12 @@ void GCodes::Spin()
 				}
 				++i;
 			} while (i < GCODE_LENGTH);
+
+			macroFileTime[stackPointer - 1] += micros() - readStartTime;
+			if (gotCode)
+			{
+				fileMacroGCode->SetFinished(ActOnCode(fileMacroGCode, true));
+			}
 		}
 
 		platform->ClassReport(longWait);
@@ -172,176 +183,58 @@ void GCodes::Spin()
 	// Check each of the sources of G Codes (web, aux, serial, queued and file) to
 	// see if they are finished in order to feed them new codes.
 	//
-	// Note the order establishes a priority: web, aux, serial, queued, file.
-	// If file weren't last, then the others would never get a look in when
-	// a file was being printed.
+	// Each call may read up to GCODE_SPIN_BYTE_BUDGET bytes and start up to GCODE_SPIN_LINE_BUDGET codes
+	// from all the sources together. If the look-ahead can take another move, the file is served first
+	// so that the moves don't run dry. After that every source gets a turn, starting with a different
+	// one each time so that a busy source can't starve the others.
 
-	if (!webGCode->Active() && webserver->GCodeAvailable())
+	size_t bytesLeft = GCODE_SPIN_BYTE_BUDGET;
+	unsigned int linesLeft = GCODE_SPIN_LINE_BUDGET;
+	bool serviced[NumInputChannels];
+	for (size_t channel = 0; channel < NumInputChannels; channel++)
 	{
-		uint8_t i = 0;
-		do
-		{
-			char b = webserver->ReadGCode();
-			if (webGCode->Put(b))
-			{
-				// we have a complete gcode
-				if (webGCode->WritingFileDirectory() != NULL)
-				{
-					WriteGCodeToFile(webGCode);
-					webGCode->SetFinished(true);
-				}
-				else
-				{
-					webGCode->SetFinished(ActOnCode(webGCode, true));
-				}
-				break;	// stop after receiving a complete gcode in case we haven't finished processing it
-			}
-			++i;
-		} while (i < GCODE_LENGTH && webserver->GCodeAvailable());
-		platform->ClassReport(longWait);
-		return;
+		serviced[channel] = false;
 	}
 
-	// Now the serial interfaces.
-
-	if (!auxGCode->Active() && (platform->GetAux()->Status() & byteAvailable))
+	if (!moveAvailable)
 	{
-		uint8_t i = 0;
-		do
-		{
-			char b;
-			platform->GetAux()->Read(b);
-			if (auxGCode->Put(b))	// add char to buffer and test whether the gcode is complete
-			{
-				auxDetected = true;
-				auxGCode->SetFinished(ActOnCode(auxGCode, true));
-				break;	// stop after receiving a complete gcode in case we haven't finished processing it
-			}
-			++i;
-		} while (i < GCODE_LENGTH && (platform->GetAux()->Status() & byteAvailable));
-		platform->ClassReport(longWait);
-		return;
+		serviced[FileChannel] = ServiceInputChannel(FileChannel, bytesLeft, linesLeft);
 	}
 
-	if (platform->GetLine()->Status() & byteAvailable)
+	for (size_t n = 0; n < NumInputChannels && bytesLeft != 0 && linesLeft != 0; n++)
 	{
-		// First check the special case of uploading the reprap.htm file
-		if (serialGCode->WritingFileDirectory() == platform->GetWebDir())
+		const size_t channel = (firstInputChannel + n) % NumInputChannels;
+		if (!serviced[channel])
 		{
-			char b;
-			platform->GetLine()->Read(b);
-			WriteHTMLToFile(b, serialGCode);
-
-			platform->ClassReport(longWait);
-			return;
-		}
-		// Otherwise just deal in general with incoming bytes from the serial interface
-		else if (!serialGCode->Active())
-		{
-			// Read several bytes instead of just one. This approximately doubles the speed of file uploading.
-			uint8_t i = 0;
-			do
-			{
-				char b;
-				platform->GetLine()->Read(b);
-				if (serialGCode->Put(b))	// add char to buffer and test whether the gcode is complete
-				{
-					// we have a complete gcode
-					if (serialGCode->WritingFileDirectory() != NULL)
-					{
-						WriteGCodeToFile(serialGCode);
-						serialGCode->SetFinished(true);
-					}
-					else
-					{
-						serialGCode->SetFinished(ActOnCode(serialGCode, reprap.GetMove()->IsPaused()));
-					}
-					break;	// stop after receiving a complete gcode in case we haven't finished processing it
-				}
-				++i;
-			} while (i < GCODE_LENGTH && (platform->GetLine()->Status() & byteAvailable));
-
-			platform->ClassReport(longWait);
-			return;
+			serviced[channel] = ServiceInputChannel((InputChannel)channel, bytesLeft, linesLeft);
 		}
 	}
+	firstInputChannel = (firstInputChannel + 1) % NumInputChannels;
 
-	// Then check if there are any queued codes left to be executed in-time
-
-	if (internalCodeQueue != NULL)
+	// Keep track of how long each source has had input waiting for us to read it
+	const float now = platform->Time();
+	for (size_t channel = 0; channel < NumInputChannels; channel++)
 	{
-		if (!queuedGCode->Active() && reprap.GetMove()->IsRunning())
+		InputChannelStats& stats = channelStats[channel];
+		if (serviced[channel])
 		{
-			// Check if the last queued code is complete and remove its entry
-			if (internalCodeQueue->IsExecuting())
-			{
-				CodeQueueItem *temp = internalCodeQueue;
-				internalCodeQueue = internalCodeQueue->Next();
-				temp->SetNext(releasedQueueItems);
-				releasedQueueItems = temp;
-
-				platform->ClassReport(longWait);
-				return;
-			}
-
-			// Check if a new code can be executed
-			else if (internalCodeQueue->ExecuteAtMove() <= movesCompleted)
+			if (stats.waitingSince > 0.0)
 			{
-				internalCodeQueue->Execute();
-				if (queuedGCode->Put(internalCodeQueue->GetCommand(), internalCodeQueue->GetCommandLength()))
+				const float waitTime = now - stats.waitingSince;
+				stats.totalWaitTime += waitTime;
+				if (waitTime > stats.maxWaitTime)
 				{
-					queuedGCode->SetFinished(ActOnCode(queuedGCode, true));
+					stats.maxWaitTime = waitTime;
 				}
-
-				platform->ClassReport(longWait);
-				return;
+				stats.waitingSince = 0.0;
 			}
 		}
-	}
-	else if (totalMoves == movesCompleted != 0)
-	{
-		// If we don't have any queued codes left and all moves are complete, we can safely reset our counters here
-		totalMoves = 0;
-		movesCompleted = 0;
-	}
-
-	// At last, see if we can read some more bytes from the the file being printed
-
-	if (!fileGCode->Active() && reprap.GetMove()->IsRunning() && fileBeingPrinted.IsLive())
-	{
-		uint8_t i = 0;
-		do
+		else if (stats.waitingSince == 0.0 && InputWaiting((InputChannel)channel))
 		{
-			char b;
-			if (fileBeingPrinted.Read(b))
-			{
-				if (fileGCode->Put(b))
-				{
-					fileGCode->SetFinished(ActOnCode(fileGCode));
-					break;
-				}
-			}
-			else
-			{
-				if (fileGCode->Put('\n')) // In case there wasn't one ending the file
-				{
-					fileGCode->SetFinished(ActOnCode(fileGCode));
-				}
-				if (!fileGCode->Active() && AllMovesAreFinishedAndMoveBufferIsLoaded())
-				{
-					fileBeingPrinted.Close();
-					reprap.GetPrintMonitor()->StoppedPrint();
-				}
-				break;
-			}
-			++i;
-		} while (i < GCODE_LENGTH);
-
-		platform->ClassReport(longWait);
-		return;
+			stats.waitingSince = now;
+		}
 	}
 
-
 	// Now run the G-Code buffers. It's important to fill up the G-Code buffers before we do this,
 	// otherwise we wouldn't have a chance to pause/cancel running prints.
 
@@ -372,22 +265,247 @@ void GCodes::Spin()
 	platform->ClassReport(longWait);
 }
 
+// Return true if the specified channel has input that we could read now, i.e. its G Code buffer is free
+bool GCodes::InputWaiting(InputChannel channel) const
+{
+	switch (channel)
+	{
+		case WebChannel:
+			return !webGCode->Active() && webserver->GCodeAvailable();
+
+		case AuxChannel:
+			return !auxGCode->Active() && (platform->GetAux()->Status() & byteAvailable) != 0;
+
+		case SerialChannel:
+			return !serialGCode->Active() && (platform->GetLine()->Status() & byteAvailable) != 0;
+
+		case QueuedChannel:
+			return !queuedGCode->Active() && !codeQueue->IsEmpty() && reprap.GetMove()->IsRunning()
+					&& (codeQueue->First()->IsExecuting() || codeQueue->First()->ExecuteAtMove() <= movesCompleted);
+
+		case FileChannel:
+			return !fileGCode->Active() && reprap.GetMove()->IsRunning() && fileBeingPrinted.IsLive();
+
+		default:
+			return false;
+	}
+}
+
+// Read from one source of G Codes, using up some of the byte and line budget of this Spin.
+// Returns true if we did something.
+bool GCodes::ServiceInputChannel(InputChannel channel, size_t& bytesLeft, unsigned int& linesLeft)
+{
+	bool serviced = false;
+	switch (channel)
+	{
+		case WebChannel:
+			if (!webGCode->Active())
+			{
+				while (bytesLeft != 0 && webserver->GCodeAvailable())
+				{
+					char b = webserver->ReadGCode();
+					--bytesLeft;
+					serviced = true;
+					if (webGCode->Put(b))
+					{
+						// we have a complete gcode
+						if (webGCode->WritingFileDirectory() != NULL)
+						{
+							WriteGCodeToFile(webGCode);
+							webGCode->SetFinished(true);
+						}
+						else
+						{
+							webGCode->SetFinished(ActOnCode(webGCode, true));
+						}
+						--linesLeft;
+						++channelStats[channel].lines;
+						break;	// stop after receiving a complete gcode in case we haven't finished processing it
+					}
+				}
+			}
+			break;
+
+		case AuxChannel:
+			if (!auxGCode->Active())
+			{
+				while (bytesLeft != 0 && (platform->GetAux()->Status() & byteAvailable))
+				{
+					char b;
+					platform->GetAux()->Read(b);
+					--bytesLeft;
+					serviced = true;
+					if (auxGCode->Put(b))	// add char to buffer and test whether the gcode is complete
+					{
+						auxDetected = true;
+						auxGCode->SetFinished(ActOnCode(auxGCode, true));
+						--linesLeft;
+						++channelStats[channel].lines;
+						break;	// stop after receiving a complete gcode in case we haven't finished processing it
+					}
+				}
+			}
+			break;
+
+		case SerialChannel:
+			if (platform->GetLine()->Status() & byteAvailable)
+			{
+				// First check the special case of uploading the reprap.htm file
+				if (serialGCode->WritingFileDirectory() == platform->GetWebDir())
+				{
+					char b;
+					platform->GetLine()->Read(b);
+					WriteHTMLToFile(b, serialGCode);
+					--bytesLeft;
+					serviced = true;
+				}
+				// Otherwise just deal in general with incoming bytes from the serial interface
+				else if (!serialGCode->Active())
+				{
+					// Read several bytes instead of just one. This approximately doubles the speed of file uploading.
+					while (bytesLeft != 0 && (platform->GetLine()->Status() & byteAvailable))
+					{
+						char b;
+						platform->GetLine()->Read(b);
+						--bytesLeft;
+						serviced = true;
+						if (serialGCode->Put(b))	// add char to buffer and test whether the gcode is complete
+						{
+							// we have a complete gcode
+							if (serialGCode->WritingFileDirectory() != NULL)
+							{
+								WriteGCodeToFile(serialGCode);
+								serialGCode->SetFinished(true);
+							}
+							else
+							{
+								serialGCode->SetFinished(ActOnCode(serialGCode, reprap.GetMove()->IsPaused()));
+							}
+							--linesLeft;
+							++channelStats[channel].lines;
+							break;	// stop after receiving a complete gcode in case we haven't finished processing it
+						}
+					}
+				}
+			}
+			break;
+
+		case QueuedChannel:
+			// Check if there are any queued codes left to be executed in-time
+			if (!codeQueue->IsEmpty())
+			{
+				if (!queuedGCode->Active() && reprap.GetMove()->IsRunning())
+				{
+					// Check if the last queued code is complete and remove its entry
+					CodeQueueItem *item = codeQueue->First();
+					if (item->IsExecuting())
+					{
+						codeQueue->RemoveFirst();
+						serviced = true;
+					}
+
+					// Check if a new code can be executed
+					else if (item->ExecuteAtMove() <= movesCompleted)
+					{
+						StartQueuedCode(item);
+						--linesLeft;
+						++channelStats[channel].lines;
+						serviced = true;
+					}
+				}
+			}
+			else if (totalMoves == movesCompleted != 0)
+			{
+				// If we don't have any queued codes left and all moves are complete, we can safely reset our counters here
+				totalMoves = 0;
+				movesCompleted = 0;
+			}
+			break;
+
+		case FileChannel:
+			// See if we can read some more bytes from the the file being printed
+			if (!fileGCode->Active() && reprap.GetMove()->IsRunning() && fileBeingPrinted.IsLive())
+			{
+				while (bytesLeft != 0)
+				{
+					char b;
+					serviced = true;
+					if (fileBeingPrinted.Read(b))
+					{
+						--bytesLeft;
+						if (fileGCode->Put(b))
+						{
+							fileGCode->SetFinished(ActOnCode(fileGCode));
+							--linesLeft;
+							++channelStats[channel].lines;
+							break;
+						}
+					}
+					else
+					{
+						if (fileGCode->Put('\n')) // In case there wasn't one ending the file
+						{
+							fileGCode->SetFinished(ActOnCode(fileGCode));
+							--linesLeft;
+							++channelStats[channel].lines;
+						}
+						if (!fileGCode->Active() && AllMovesAreFinishedAndMoveBufferIsLoaded())
+						{
+							fileBeingPrinted.Close();
+							reprap.GetPrintMonitor()->StoppedPrint();
+						}
+						break;
+					}
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	return serviced;
+}
+
 void GCodes::Diagnostics()
 {
 	platform->AppendMessage(BOTH_MESSAGE, "GCodes Diagnostics:\n");
 	platform->AppendMessage(BOTH_MESSAGE, "Move available? %s\n", moveAvailable ? "yes" : "no");
-	platform->AppendMessage(BOTH_MESSAGE, "Internal code queue is %s\n", (internalCodeQueue == NULL) ? "empty." :"not empty:");
-	if (internalCodeQueue != NULL)
+	platform->AppendMessage(BOTH_MESSAGE, "Internal code queue is %s\n", (codeQueue->IsEmpty()) ? "empty." :"not empty:");
+	if (!codeQueue->IsEmpty())
 	{
 		platform->AppendMessage(BOTH_MESSAGE, "Total moves: %d, moves completed: %d\n", totalMoves, movesCompleted);
-		unsigned int count = 0;
-		CodeQueueItem *item = internalCodeQueue;
-		do {
-			count++;
+		for (const CodeQueueItem *item = codeQueue->First(); item != NULL; item = codeQueue->Next(item))
+		{
 			platform->AppendMessage(BOTH_MESSAGE, "Queued '%s' for move %d\n", item->GetCommand(), item->ExecuteAtMove());
-		} while ((item = item->Next()) != NULL);
-		platform->AppendMessage(BOTH_MESSAGE, "%d codes have been queued.\n", count);
+		}
+		platform->AppendMessage(BOTH_MESSAGE, "%d codes have been queued.\n", codeQueue->GetItemCount());
+	}
+	platform->AppendMessage(BOTH_MESSAGE, "Code queue usage: %u of %u bytes, maximum %u bytes (%u codes)\n",
+			codeQueue->GetBytesUsed(), codeQueueArenaSize, codeQueue->GetMaxBytesUsed(), codeQueue->GetMaxItemCount());
+
+	// Report the time spent opening and reading macro files with and without the macro cache
+	static const char * const macroSourceNames[numMacroSources] = { "from SD card", "filling cache", "from cache" };
+	for (size_t i = 0; i < numMacroSources; i++)
+	{
+		const MacroStats& stats = macroStats[i];
+		platform->AppendMessage(BOTH_MESSAGE, "Macros read %s: %u, average file time %.2fms, longest %.2fms\n", macroSourceNames[i],
+				stats.count, (stats.count == 0) ? 0.0 : stats.totalTime * 1000.0/stats.count, stats.maxTime * 1000.0);
 	}
+
+	// Report the throughput and waiting time of each source of G Codes since the last time we were called
+	static const char * const channelNames[NumInputChannels] = { "web", "aux", "serial", "queued", "file" };
+	const float now = platform->Time();
+	const float interval = now - lastChannelStatsTime;
+	for (size_t channel = 0; channel < NumInputChannels; channel++)
+	{
+		InputChannelStats& stats = channelStats[channel];
+		platform->AppendMessage(BOTH_MESSAGE, "Input %s: %.1f lines/s, total wait %.2fs, longest wait %.1fms\n", channelNames[channel],
+				(interval > 0.0) ? stats.lines/interval : 0.0, stats.totalWaitTime, stats.maxWaitTime * 1000.0);
+		stats.lines = 0;
+		stats.totalWaitTime = stats.maxWaitTime = 0.0;
+	}
+	lastChannelStatsTime = now;
 }
 
 // The wait till everything's done function.  If you need the machine to
@@ -696,6 +814,16 @@ bool GCodes::DoFileMacro(const char* fileName)
 
 	if (returningFromMacro)
 	{
+		// Record how long it took to open and read the macro file, so we can see what the macro cache buys us
+		const float macroTime = (float)macroFileTime[stackPointer - 1] * 1.0e-6;
+		MacroStats& stats = macroStats[macroSource[stackPointer - 1]];
+		++stats.count;
+		stats.totalTime += macroTime;
+		if (macroTime > stats.maxTime)
+		{
+			stats.maxTime = macroTime;
+		}
+
 		if (!Pop())
 		{
 			return false;
@@ -714,7 +842,9 @@ bool GCodes::DoFileMacro(const char* fileName)
 
 	// Then see if we can open the file
 
-	FileStore *f = platform->GetFileStore((fileName[0] == '/') ? "0:" : platform->GetSysDir(), fileName, false);
+	const uint32_t startTime = micros();
+	bool filledCache;
+	FileStore *f = platform->GetMacroFileStore((fileName[0] == '/') ? "0:" : platform->GetSysDir(), fileName, filledCache);
 	if (f == NULL)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Macro file %s not found.\n", fileName);
@@ -724,6 +854,8 @@ bool GCodes::DoFileMacro(const char* fileName)
 		}
 		return true;
 	}
+	macroFileTime[stackPointer - 1] = micros() - startTime;
+	macroSource[stackPointer - 1] = (f->IsCached()) ? macroFromCache : (filledCache) ? macroFillingCache : macroFromSD;
 	fileBeingPrinted.Set(f);
 
 	// Deal with nested macros (rewind back to the position before the last code so it is called again later)
@@ -1301,6 +1433,9 @@ bool GCodes::OpenFileToWrite(const char* directory, const char* fileName, GCodeB
 	}
 	else
 	{
+		// Don't preallocate: these files are written a few bytes at a time, and FatFs would have to read each sector
+		// of the preallocated space before writing part of it. Writing at the end of the file avoids that.
+		reprap.GetPrintMonitor()->ForgetFileInfo(directory, fileName);
 		gb->SetWritingFileDirectory(directory);
 		return true;
 	}
@@ -1767,9 +1902,9 @@ void GCodes::HandleReply(bool error, const char* reply, char gMOrT, int code, bo
 	{
 		gb = serialGCode;
 	}
-	else if (internalCodeQueue->IsExecuting())
+	else if (!codeQueue->IsEmpty() && codeQueue->First()->IsExecuting())
 	{
-		gb = internalCodeQueue->GetSource();
+		gb = codeQueue->First()->GetSource();
 	}
 	else
 	{
@@ -1927,6 +2062,7 @@ void GCodes::SetPidParameters(GCodeBuffer *gb, int heater, StringRef& reply)
 		if (seen)
 		{
 			platform->SetPidParameters(heater, pp);
+			reprap.GetHeat()->UpdateParameters(heater);
 		}
 		else
 		{
@@ -2002,14 +2138,30 @@ void GCodes::SetHeaterParameters(GCodeBuffer *gb, StringRef& reply)
 				seen = true;
 			}
 
+			if (gb->Seen('F'))
+			{
+				float freq = gb->GetFValue();
+				if (freq >= minHeaterPwmFrequency && freq <= maxHeaterPwmFrequency)
+				{
+					platform->SetHeaterPwmFrequency(heater, freq);
+				}
+				else
+				{
+					platform->Message(BOTH_ERROR_MESSAGE, "Heater PWM frequency must be between %.2f and %.0fHz\n", minHeaterPwmFrequency, maxHeaterPwmFrequency);
+				}
+				seen = true;
+			}
+
 			if (seen)
 			{
 				platform->SetPidParameters(heater, pp);
+				reprap.GetHeat()->UpdateParameters(heater);
 			}
 			else
 			{
-				reply.printf("T:%.1f B:%.1f R:%.1f L:%.1f H:%.1f X:%d\n",
-						r25, beta, pp.thermistorSeriesR, pp.adcLowOffset, pp.adcHighOffset, platform->GetThermistorNumber(heater));
+				reply.printf("T:%.1f B:%.1f R:%.1f L:%.1f H:%.1f X:%d F:%.1f\n",
+						r25, beta, pp.thermistorSeriesR, pp.adcLowOffset, pp.adcHighOffset, platform->GetThermistorNumber(heater),
+						platform->GetHeaterPwmFrequency(heater));
 			}
 		}
 		else
@@ -2123,38 +2275,26 @@ bool GCodes::ActOnCode(GCodeBuffer *gb, bool executeImmediately)
 	}
 	else
 	{
-		// Run the next code immediately and wait for it if there is no free item available
-		if (releasedQueueItems == NULL)
+		// Append the code to the queue so it's executed once all moves before it have finished
+		if (codeQueue->Add(gb, totalMoves) == NULL)
 		{
-			internalCodeQueue->Execute();
-			if (queuedGCode->Put(internalCodeQueue->GetCommand(), internalCodeQueue->GetCommandLength()))
+			// There is no room left, so run the next code immediately and wait for it
+			if (!queuedGCode->Active())
 			{
-				queuedGCode->SetFinished(ActOnCode(queuedGCode, true));
+				CodeQueueItem *item = codeQueue->First();
+				if (item->IsExecuting())
+				{
+					codeQueue->RemoveFirst();
+				}
+				else
+				{
+					StartQueuedCode(item);
+				}
 			}
 
 			return false;
 		}
 
-		// Set up a new queue item
-		CodeQueueItem *newItem = releasedQueueItems;
-		releasedQueueItems = releasedQueueItems->Next();
-		newItem->Init(gb, totalMoves);
-
-		// And append it to the queue so it's executed once all moves have finished
-		if (internalCodeQueue == NULL)
-		{
-			internalCodeQueue = newItem;
-		}
-		else
-		{
-			CodeQueueItem *lastItem = internalCodeQueue;
-			while (lastItem->Next() != NULL)
-			{
-				lastItem = lastItem->Next();
-			}
-			lastItem->SetNext(newItem);
-		}
-
 		// Queued G-Codes will send their own replies later
 		return true;
 	}
@@ -2164,6 +2304,17 @@ bool GCodes::ActOnCode(GCodeBuffer *gb, bool executeImmediately)
 	return true;
 }
 
+// Start executing a queued code. We load the decoded code into queuedGCode instead of feeding it through Put() again,
+// so that it is executed by the same code as live codes without being parsed a second time.
+void GCodes::StartQueuedCode(CodeQueueItem *item)
+{
+	item->Execute();
+	if (queuedGCode->Load(item))
+	{
+		queuedGCode->SetFinished(ActOnCode(queuedGCode, true));
+	}
+}
+
 bool GCodes::HandleGcode(GCodeBuffer* gb)
 {
 	bool result = true;
@@ -2483,7 +2634,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		// no break otherwise
 
 	case 24: // Print/resume-printing the selected file
-		if (!fileToPrint.IsLive() && internalCodeQueue == NULL)
+		if (!fileToPrint.IsLive() && codeQueue->IsEmpty())
 		{
 			reply.copy("Cannot resume print, because no print is in progress!\n");
 			error = true;
@@ -3059,6 +3210,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		if(gb->Seen('S'))
 		{
 			platform->SetHeatSampleTime(gb->GetFValue() * 0.001);  // Value is in milliseconds; we want seconds
+			reprap.GetHeat()->UpdateAllParameters();
 		}
 		else
 		{
@@ -3436,6 +3588,29 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		}
 		break;
 
+	case 303: // Auto tune a heater, e.g. M303 H1 S200 [P0.8] [C5] [U1]
+		{
+			int heater = (gb->Seen('H')) ? gb->GetIValue() : 1;
+			if (heater < 0 || heater >= HEATERS)
+			{
+				reply.printf("Invalid heater number: %d\n", heater);
+				error = true;
+			}
+			else if (gb->Seen('S'))
+			{
+				float target = gb->GetFValue();
+				float power = (gb->Seen('P')) ? gb->GetFValue() : 0.0;
+				unsigned int cycles = (gb->Seen('C')) ? (unsigned int)max<int>(gb->GetIValue(), 1) : AUTO_TUNE_CYCLES;
+				bool apply = gb->Seen('U') && gb->GetIValue() > 0;
+				error = !reprap.GetHeat()->StartAutoTune(heater, target, power, cycles, apply);
+			}
+			else
+			{
+				reply.printf("Heater %d is %sbeing auto tuned\n", heater, (reprap.GetHeat()->AutoTuning(heater)) ? "" : "not ");
+			}
+		}
+		break;
+
 	case 304: // Set/report heated bed PID values
 #if HOT_BED != -1
 		SetPidParameters(gb, HOT_BED, reply);
@@ -3449,6 +3624,158 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		SetHeaterParameters(gb, reply);
 		break;
 
+	case 307: // Set/report heater thermal model, e.g. M307 H1 A2.5 C0.008 F0.3 E1.5 S1
+		{
+			int heater = (gb->Seen('H')) ? gb->GetIValue() : 1;
+			ThermalModel *model = reprap.GetHeat()->GetModel(heater);
+			if (model == NULL)
+			{
+				reply.printf("Invalid heater number: %d\n", heater);
+				error = true;
+				break;
+			}
+
+			bool seen = false;
+			if (gb->Seen('A'))
+			{
+				model->heatingRate = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('C'))
+			{
+				model->coolingRate = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('F'))
+			{
+				model->fanFactor = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('E'))
+			{
+				model->extrusionFactor = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('S'))
+			{
+				model->enabled = (gb->GetIValue() > 0);
+				seen = true;
+			}
+
+			if (model->enabled && !model->IsValid())
+			{
+				model->enabled = false;
+				reply.printf("Thermal model of heater %d is incomplete, feed-forward disabled\n", heater);
+				error = true;
+			}
+			else if (!seen)
+			{
+				reply.printf("Heater %d model: heating %.3fC/s, cooling %.5f/s, fan %.2f, extrusion %.2fC/mm, feed-forward %s\n",
+						heater, model->heatingRate, model->coolingRate, model->fanFactor, model->extrusionFactor,
+						(model->enabled) ? "on" : "off");
+			}
+		}
+		break;
+
+	case 309: // Configure heater zones and scheduling, e.g. M309 H2 Z0 P1.0 makes heater 2 a zone of the bed controlled every second
+		{
+			int heater = (gb->Seen('H')) ? gb->GetIValue() : HOT_BED;
+			if (heater < 0 || heater >= HEATERS)
+			{
+				reply.printf("Invalid heater number: %d\n", heater);
+				error = true;
+				break;
+			}
+
+			bool seen = false;
+			if (gb->Seen('Z'))
+			{
+				int leader = gb->GetIValue();
+				if (leader < 0 || leader == heater)
+				{
+					// A heater that stops being a zone goes back to the fault detection defaults for its index
+					if (platform->GetHeaterZoneLeader(heater) >= 0)
+					{
+						platform->SetHeaterZoneLeader(heater, -1);
+						platform->SetDefaultHeaterFaultParameters(heater, heater == HOT_BED || heater == reprap.GetChamberHeater());
+					}
+				}
+				else if (leader >= HEATERS || platform->GetHeaterZoneLeader(leader) >= 0)
+				{
+					reply.printf("Heater %d can't lead a zone\n", leader);
+					error = true;
+					break;
+				}
+				else
+				{
+					for (size_t h = 0; h < HEATERS; ++h)
+					{
+						if (platform->GetHeaterZoneLeader(h) == heater)
+						{
+							reply.printf("Heater %d already has zones\n", heater);
+							error = true;
+							break;
+						}
+					}
+					if (error)
+					{
+						break;
+					}
+
+					// The zone starts off switched off and with its leader's sample period and fault detection, until the leader is next set
+					reprap.GetHeat()->SwitchOff(heater);
+					platform->SetHeaterZoneLeader(heater, leader);
+					platform->SetHeaterSampleMultiple(heater, platform->GetHeaterSampleMultiple(leader));
+					platform->SetHeaterFaultParameters(heater, platform->GetHeaterFaultParameters(leader));
+				}
+				seen = true;
+			}
+			if (gb->Seen('P'))
+			{
+				// Round the sample period to a whole number of heat sample times, and apply it to any zones as well
+				const unsigned int multiple = (unsigned int)max<float>(1.0, gb->GetFValue()/platform->HeatSampleTime() + 0.5);
+				for (size_t h = 0; h < HEATERS; ++h)
+				{
+					if ((int)h == heater || platform->GetHeaterZoneLeader(h) == heater)
+					{
+						platform->SetHeaterSampleMultiple(h, multiple);
+					}
+				}
+				seen = true;
+			}
+			if (gb->Seen('S'))
+			{
+				platform->SetHeaterStaggerTime(max<float>(0.0, gb->GetFValue()));
+				seen = true;
+			}
+
+			if (seen)
+			{
+				reprap.GetHeat()->UpdateAllParameters();
+			}
+			else
+			{
+				reply.printf("Heater %d: sample period %.1fs", heater, platform->GetHeaterSampleMultiple(heater) * platform->HeatSampleTime());
+				const int8_t leader = platform->GetHeaterZoneLeader(heater);
+				if (leader >= 0)
+				{
+					reply.catf(", zone of heater %d", leader);
+				}
+				else
+				{
+					for (size_t h = 0; h < HEATERS; ++h)
+					{
+						if (platform->GetHeaterZoneLeader(h) == heater)
+						{
+							reply.catf(", zone %u", h);
+						}
+					}
+				}
+				reply.catf(", slow heaters switch on %.1fs apart\n", platform->GetHeaterStaggerTime());
+			}
+		}
+		break;
+
 	case 400: // Wait for current moves to finish
 		if (!AllMovesAreFinishedAndMoveBufferIsLoaded())
 			return false;
@@ -3491,6 +3818,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 
 	case 501: // Load parameters from EEPROM
 		platform->ReadNvData();
+		reprap.GetHeat()->UpdateAllParameters();
 		if (gb->Seen('S'))
 		{
 			platform->SetAutoSave(gb->GetIValue() > 0);
@@ -3499,6 +3827,7 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 
 	case 502: // Revert to default "factory settings"
 		platform->ResetNvData();
+		reprap.GetHeat()->UpdateAllParameters();
 		break;
 
 	case 503: // List variable settings
@@ -3857,8 +4186,51 @@ bool GCodes::HandleMcode(GCodeBuffer* gb)
 		}
 		break;
 
-	case 570: // Set/report heater timeout
-		if(gb->Seen('S'))
+	case 570: // Set/report heater timeout and heating fault detection, e.g. M570 H1 P5 F0.3 R2
+		if (gb->Seen('H'))
+		{
+			int heater = gb->GetIValue();
+			if (heater < 0 || heater >= HEATERS)
+			{
+				reply.printf("Invalid heater number: %d\n", heater);
+				error = true;
+				break;
+			}
+
+			HeaterFaultParameters fp = platform->GetHeaterFaultParameters(heater);
+			bool seen = false;
+			if (gb->Seen('P'))
+			{
+				fp.period = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('F'))
+			{
+				fp.fraction = gb->GetFValue();
+				seen = true;
+			}
+			if (gb->Seen('R'))
+			{
+				fp.rate = gb->GetFValue();
+				seen = true;
+			}
+
+			if (seen)
+			{
+				platform->SetHeaterFaultParameters(heater, fp);
+				reprap.GetHeat()->UpdateParameters(heater);
+			}
+			else if (fp.period <= 0.0)
+			{
+				reply.printf("Heater %d heating fault detection is disabled\n", heater);
+			}
+			else
+			{
+				reply.printf("Heater %d heating fault if rise over %.1f seconds is less than %.2f of expected, %.2fC/s at full power without a model\n",
+						heater, fp.period, fp.fraction, fp.rate);
+			}
+		}
+		else if(gb->Seen('S'))
 		{
 			platform->SetTimeToHot(gb->GetFValue());
 		}
@@ -4154,13 +4526,7 @@ bool GCodes::ChangeTool(int newToolNumber)
 // Cancel the current SD card print
 void GCodes::CancelPrint()
 {
-	while (internalCodeQueue != NULL)
-	{
-		CodeQueueItem *item = internalCodeQueue;
-		internalCodeQueue = item->Next();
-		item->SetNext(releasedQueueItems);
-		releasedQueueItems = item;
-	}
+	codeQueue->Clear();
 
 	totalMoves = movesCompleted = 0;
 	moveAvailable = isPausing = isResuming = false;
@@ -4225,75 +4591,130 @@ bool GCodes::IsResuming() const
 
 // This class is used to ensure commands are executed in the right order and independently from the look-ahead queue.
 
-CodeQueueItem::CodeQueueItem(CodeQueueItem *n) : next(n), commandLength(0), source(NULL)
+CodeQueue::CodeQueue()
 {
-	command[0] = 0;
+	Init();
 }
 
-void CodeQueueItem::Init(GCodeBuffer *gb, unsigned int executeAtMove)
+void CodeQueue::Init()
 {
-	moveToExecute = executeAtMove;
-	next = NULL;
-	executing = false;
-
-	commandLength = strlen(gb->Buffer());
-	if (commandLength >= ARRAY_SIZE(command))
-	{
-		reprap.GetPlatform()->Message(BOTH_ERROR_MESSAGE, "Invalid string passed to code queue initializer\n");
-		command[0] = 0;
-		commandLength = 0;
-		source = NULL;
-	}
-	else
-	{
-		strncpy(command, gb->Buffer(), commandLength);
-		command[commandLength] = 0;
-		source = gb;
-	}
+	Clear();
+	maxItemCount = 0;
+	maxBytesUsed = 0;
 }
 
-void CodeQueueItem::SetNext(CodeQueueItem *n)
+void CodeQueue::Clear()
 {
-	next = n;
+	head = tail = 0;
+	wrapPoint = codeQueueArenaSize;
+	wrapped = false;
+	itemCount = 0;
+	bytesUsed = 0;
 }
 
-CodeQueueItem *CodeQueueItem::Next() const
+// Append the code in the specified buffer to the queue. This is O(1) because we only need to look at the tail offset.
+CodeQueueItem *CodeQueue::Add(GCodeBuffer *gb, unsigned int executeAtMove)
 {
-	return next;
-}
+	size_t commandLength = strlen(gb->Buffer());
+	if (commandLength >= GCODE_LENGTH)
+	{
+		reprap.GetPlatform()->Message(BOTH_ERROR_MESSAGE, "Invalid string passed to code queue\n");
+		return NULL;
+	}
 
-unsigned int CodeQueueItem::ExecuteAtMove() const
-{
-	return moveToExecute;
-}
+	// Work out how much space we need, rounded up to keep the next item aligned
+	const unsigned int parameterCount = gb->GetParameterCount();
+	const size_t itemSize = (offsetof(CodeQueueItem, data) + 2 * parameterCount + commandLength + 1 + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
 
-const char *CodeQueueItem::GetCommand() const
-{
-	return command;
-}
+	// Find a contiguous block of free space in the arena, wrapping around to the start if necessary
+	size_t offset;
+	if (itemCount == 0)
+	{
+		Clear();
+		offset = 0;
+	}
+	else if (!wrapped && tail + itemSize <= codeQueueArenaSize)
+	{
+		offset = tail;
+	}
+	else if (!wrapped && itemSize <= head)
+	{
+		wrapPoint = tail;
+		wrapped = true;
+		offset = 0;
+	}
+	else if (wrapped && tail + itemSize <= head)
+	{
+		offset = tail;
+	}
+	else
+	{
+		return NULL;
+	}
 
-size_t CodeQueueItem::GetCommandLength() const
-{
-	return commandLength;
-}
+	CodeQueueItem *item = ItemAt(offset);
+	item->source = gb;
+	item->moveToExecute = executeAtMove;
+	item->itemSize = itemSize;
+	item->commandLength = commandLength;
+	item->parameterCount = parameterCount;
+	item->executing = false;
+	gb->GetParameters(reinterpret_cast<uint8_t*>(item->data));
+	char *command = item->data + 2 * parameterCount;
+	memcpy(command, gb->Buffer(), commandLength);
+	command[commandLength] = 0;
 
-GCodeBuffer *CodeQueueItem::GetSource() const
-{
-	return source;
-}
+	tail = offset + itemSize;
+	++itemCount;
+	bytesUsed += itemSize;
 
+	if (itemCount > maxItemCount)
+	{
+		maxItemCount = itemCount;
+	}
+	if (bytesUsed > maxBytesUsed)
+	{
+		maxBytesUsed = bytesUsed;
+	}
+	return item;
+}
 
-void CodeQueueItem::Execute()
+void CodeQueue::RemoveFirst()
 {
-	executing = true;
+	if (itemCount != 0)
+	{
+		const CodeQueueItem *item = ItemAt(head);
+		bytesUsed -= item->itemSize;
+		head += item->itemSize;
+		--itemCount;
+
+		if (itemCount == 0)
+		{
+			Clear();
+		}
+		else if (wrapped && head == wrapPoint)
+		{
+			head = 0;
+			wrapPoint = codeQueueArenaSize;
+			wrapped = false;
+		}
+	}
 }
 
-bool CodeQueueItem::IsExecuting() const
+CodeQueueItem *CodeQueue::Next(const CodeQueueItem *item) const
 {
-	return executing;
+	size_t offset = (reinterpret_cast<const char*>(item) - reinterpret_cast<const char*>(arena)) + item->itemSize;
+	if (offset == tail)
+	{
+		return NULL;
+	}
+	if (wrapped && offset == wrapPoint)
+	{
+		offset = 0;
+	}
+	return ItemAt(offset);
 }
 
-
 //*************************************************************************************
 
 // This class stores a single G Code and provides functions to allow it to be parsed
@@ -4305,6 +4726,7 @@ GCodeBuffer::GCodeBuffer(Platform* p, const char* id)
 	writingFileDirectory = NULL; // Has to be done here as Init() is called every line.
 	toolNumberAdjust = 0;
 	checksumRequired = false;
+	decoded = false;
 }
 
 void GCodeBuffer::Init()
@@ -4338,6 +4760,7 @@ bool GCodeBuffer::Put(char c)
 	}
 
 	gcodeBuffer[gcodePointer] = c;
+	decoded = false;
 
 	if (c == ';')
 	{
@@ -4363,6 +4786,7 @@ bool GCodeBuffer::Put(char c)
 			{
 				snprintf(gcodeBuffer, GCODE_LENGTH, "M998 P%d", GetIValue());
 				Init();
+				DecodeParameters();
 				return true;
 			}
 
@@ -4404,6 +4828,7 @@ bool GCodeBuffer::Put(char c)
 
 		Init();
 		state = executing;
+		DecodeParameters();
 		return true;
 	}
 	else if (!inComment || writingFileDirectory)
@@ -4433,6 +4858,81 @@ bool GCodeBuffer::Put(const char *str, size_t len)
 	return false;
 }
 
+// Set up a queued code that has already been decoded, so it can be executed without parsing it again
+
+bool GCodeBuffer::Load(const CodeQueueItem *item)
+{
+	size_t len = item->GetCommandLength();
+	if (len >= GCODE_LENGTH)
+	{
+		return false;
+	}
+
+	memcpy(gcodeBuffer, item->GetCommand(), len + 1);
+	Init();
+
+	parameterLetters = 0;
+	const uint8_t *params = item->GetParameters();
+	for(unsigned int i=0; i<item->GetParameterCount(); i++)
+	{
+		unsigned int letter = params[2 * i] - 'A';
+		parameterLetters |= (1u << letter);
+		parameterOffsets[letter] = params[2 * i + 1];
+	}
+	decoded = true;
+
+	if (reprap.Debug(moduleGcodes))
+	{
+		platform->Message(HOST_MESSAGE, "%s%s\n", identity, gcodeBuffer);
+	}
+
+	state = executing;
+	return true;
+}
+
+// Record the position of the first occurrence of each of the letters A-Z, so that Seen() need not search for them
+
+void GCodeBuffer::DecodeParameters()
+{
+	parameterLetters = 0;
+	for(size_t i=0; gcodeBuffer[i] != 0 && gcodeBuffer[i] != ';'; i++)
+	{
+		char c = gcodeBuffer[i];
+		if (c >= 'A' && c <= 'Z')
+		{
+			uint32_t bit = 1u << (c - 'A');
+			if ((parameterLetters & bit) == 0)
+			{
+				parameterLetters |= bit;
+				parameterOffsets[c - 'A'] = i;
+			}
+		}
+	}
+	decoded = true;
+}
+
+unsigned int GCodeBuffer::GetParameterCount() const
+{
+	unsigned int count = 0;
+	for(uint32_t letters = parameterLetters; letters != 0; letters &= letters - 1)
+	{
+		++count;
+	}
+	return count;
+}
+
+void GCodeBuffer::GetParameters(uint8_t *params) const
+{
+	for(unsigned int letter=0; letter<26; letter++)
+	{
+		if (parameterLetters & (1u << letter))
+		{
+			*params++ = 'A' + letter;
+			*params++ = parameterOffsets[letter];
+		}
+	}
+}
+
 // Does this buffer contain any code?
 
 bool GCodeBuffer::IsEmpty() const
@@ -4463,6 +4963,17 @@ unsigned int GCodeBuffer::Length() const
 
 bool GCodeBuffer::Seen(char c)
 {
+	if (decoded && c >= 'A' && c <= 'Z')
+	{
+		if (parameterLetters & (1u << (c - 'A')))
+		{
+			readPointer = parameterOffsets[c - 'A'];
+			return true;
+		}
+		readPointer = -1;
+		return false;
+	}
+
 	readPointer = 0;
 	for (;;)
 	{
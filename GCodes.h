@@ -32,6 +32,8 @@ Licence: GPL
 typedef uint16_t EndstopChecks;					// must be large enough to hold a bitmap of drive numbers or ZProbeActive
 
 
+class CodeQueueItem;
+
 // Small class to hold an individual GCode and provide functions to allow it to be parsed
 
 class GCodeBuffer
@@ -42,6 +44,7 @@ class GCodeBuffer
     void Init(); 										// Set it up
     bool Put(char c);									// Add a character to the end
     bool Put(const char *str, size_t len);				// Add an entire string
+    bool Load(const CodeQueueItem *item);				// Set up a code that has already been decoded
     bool IsEmpty() const;								// Does this buffer contain any code?
     unsigned int Length() const;						// How many bytes have been fed into this buffer?
     bool Seen(char c);									// Is a character present?
@@ -62,11 +65,14 @@ class GCodeBuffer
     int GetToolNumberAdjust() const { return toolNumberAdjust; }
     void SetToolNumberAdjust(int arg) { toolNumberAdjust = arg; }
     void SetCommsProperties(uint32_t arg) { checksumRequired = (arg & 1); }
+    unsigned int GetParameterCount() const;				// How many different parameter letters does the code have?
+    void GetParameters(uint8_t *params) const;			// Copy the letter/offset pairs of the parameters
 
   private:
 
     enum State { idle, executing, paused };
     int CheckSum();										// Compute the checksum (if any) at the end of the G Code
+    void DecodeParameters();							// Record where each parameter letter is found
     Platform* platform;									// Pointer to the RepRap's controlling class
     char gcodeBuffer[GCODE_LENGTH];						// The G Code
     const char* identity;								// Where we are from (web, file, serial line etc)
@@ -77,6 +83,9 @@ class GCodeBuffer
     State state;										// Idle, executing or paused
     const char* writingFileDirectory;					// If the G Code is going into a file, where that is
     int toolNumberAdjust;
+    bool decoded;										// Are parameterLetters and parameterOffsets valid?
+    uint32_t parameterLetters;							// Bitmap of the letters A-Z present in the code
+    uint8_t parameterOffsets[26];						// Index of the first occurrence of each letter
 };
 
 //****************************************************************************************************
@@ -86,20 +95,23 @@ class GCodeBuffer
 // We don't want some commands to be executed too early, so we should queue these codes and execute
 // them just in time in GCodes::Spin while regular moves are being fed into the look-ahead queue.
 
-const unsigned int codeQueueLength = 8;
+// Queued codes are packed into a ring arena according to their actual length, so short codes such as
+// M106 and M104 take up much less space than a full GCODE_LENGTH buffer each. Each code is stored together
+// with the positions of its parameter letters, so it need not be parsed again when it is executed.
+
+const size_t codeQueueArenaSize = 1024;			// bytes of storage shared by all queued codes, must be a multiple of 4
 
 class CodeQueueItem
 {
 	public:
 
-		CodeQueueItem(CodeQueueItem *n);
-		void Init(GCodeBuffer *gb, unsigned int executeAtMove);
-		void SetNext(CodeQueueItem *n);
-		CodeQueueItem *Next() const;
+		friend class CodeQueue;
 
 		unsigned int ExecuteAtMove() const;
 		const char *GetCommand() const;
 		size_t GetCommandLength() const;
+		unsigned int GetParameterCount() const;
+		const uint8_t *GetParameters() const;			// letter/offset pairs
 		GCodeBuffer *GetSource() const;
 
 		void Execute();
@@ -107,13 +119,43 @@ class CodeQueueItem
 
 	private:
 
-		char command[GCODE_LENGTH];
-		size_t commandLength;
-		unsigned int moveToExecute;
-
 		GCodeBuffer *source;
-		CodeQueueItem *next;
+		unsigned int moveToExecute;
+		uint16_t itemSize;						// total size of this item in the arena including the command text
+		uint8_t commandLength;
+		uint8_t parameterCount;
 		bool executing;
+		char data[3];							// parameter letter/offset pairs followed by the command text, the item extends beyond the end of this
+};
+
+class CodeQueue
+{
+	public:
+
+		CodeQueue();
+		void Init();													// Clear the queue and the statistics
+		void Clear();													// Remove all queued codes
+		CodeQueueItem *Add(GCodeBuffer *gb, unsigned int executeAtMove);	// Append a code, returns NULL if there is no room
+		void RemoveFirst();												// Remove the code at the head of the queue
+
+		bool IsEmpty() const;
+		CodeQueueItem *First() const;
+		CodeQueueItem *Next(const CodeQueueItem *item) const;			// Returns NULL after the last item
+		unsigned int GetItemCount() const;
+		size_t GetBytesUsed() const;
+		size_t GetMaxBytesUsed() const;									// High-water mark of the occupied arena space
+		unsigned int GetMaxItemCount() const;
+
+	private:
+
+		CodeQueueItem *ItemAt(size_t offset) const;
+
+		uint32_t arena[codeQueueArenaSize/sizeof(uint32_t)];			// uint32_t to keep the items aligned
+		size_t head, tail;												// offsets of the first item and of the free space after the last one
+		size_t wrapPoint;												// if the queue has wrapped, the offset at which the items before the wrap end
+		bool wrapped;
+		unsigned int itemCount, maxItemCount;
+		size_t bytesUsed, maxBytesUsed;
 };
 
 //****************************************************************************************************
@@ -150,11 +192,40 @@ class GCodes
     bool IsResuming() const;
 
   private:
-  
+
+    enum InputChannel { WebChannel, AuxChannel, SerialChannel, QueuedChannel, FileChannel, NumInputChannels };
+
+    struct InputChannelStats
+    {
+    	unsigned int lines;						// Number of codes started since the last diagnostics
+    	float waitingSince;						// When readable input was first left waiting, or zero
+    	float totalWaitTime;					// Accumulated time input has been waiting
+    	float maxWaitTime;						// Longest time input has been waiting
+    };
+
+    enum MacroSource
+    {
+    	macroFromSD,							// Macro file read from the SD card
+    	macroFillingCache,						// Read from the SD card into the macro cache
+    	macroFromCache,							// Read from the macro cache
+    	numMacroSources
+    };
+
+    struct MacroStats
+    {
+    	unsigned int count;						// Number of macros run
+    	float totalTime;						// Total time spent opening and reading the macro files
+    	float maxTime;							// Longest time for one macro
+    };
+
+    bool InputWaiting(InputChannel channel) const;						// Is there input we could read on this channel?
+    bool ServiceInputChannel(InputChannel channel,						// Read from one source of G Codes within the budget
+    		size_t& bytesLeft, unsigned int& linesLeft);
     void DoFilePrint(GCodeBuffer* gb);									// Get G Codes from a file and print them
     bool AllMovesAreFinishedAndMoveBufferIsLoaded();					// Wait for move queue to exhaust and the current position is loaded
     bool DoCannedCycleMove(EndstopChecks ce);							// Do a move from an internally programmed canned cycle
     bool DoFileMacro(const char* fileName);								// Run a GCode macro in a file
+    void StartQueuedCode(CodeQueueItem *item);							// Start executing a code from the code queue
     bool FileMacroCyclesReturn();										// End a macro
     bool CanQueueCode(GCodeBuffer *gb) const;							// Can we queue this code for delayed execution?
     bool ActOnCode(GCodeBuffer* gb, bool executeImmediately = false);	// Do a G, M or T Code
@@ -219,6 +290,9 @@ class GCodes
     float extruderPositionStack[STACK][DRIVES-AXES];	// For dealing with Push and Pop
     FileData fileStack[STACK];
     bool doingFileMacroStack[STACK];			// For dealing with Push and Pop
+    uint32_t macroFileTime[STACK];				// Microseconds spent opening and reading each macro file on the stack
+    MacroSource macroSource[STACK];				// Where each macro file on the stack is being read from
+    MacroStats macroStats[numMacroSources];		// File access times of the macros run from each source
     int8_t stackPointer;						// Push and Pop stack pointer
     char axisLetters[AXES]; 					// 'X', 'Y', 'Z'
     float lastExtruderPosition[DRIVES - AXES];	// Extruder position of the last move fed into the Move class
@@ -254,11 +328,13 @@ class GCodes
     bool coolingInverted;
     float lastFanValue;
     int8_t toolChangeSequence;					// Steps through the tool change procedure
-    CodeQueueItem *internalCodeQueue;			// Linked list of all the queued codes
-    CodeQueueItem *releasedQueueItems;			// Linked list of all released queue items
+    CodeQueue *codeQueue;						// Codes waiting to be executed in time with the moves
     unsigned int totalMoves;					// Total number of moves that have been fed into the look-ahead
     volatile unsigned int movesCompleted;		// Number of moves that have been completed (changed by ISR)
     bool auxDetected;							// Have we processed at least one G-Code from an AUX device?
+    size_t firstInputChannel;					// The source of G Codes that is served first in the next Spin
+    InputChannelStats channelStats[NumInputChannels];	// Throughput and waiting times of the G Code sources
+    float lastChannelStatsTime;					// When the channel statistics were last reported
 };
 
 //*****************************************************************************************************
@@ -270,6 +346,81 @@ inline int GCodeBuffer::GetIValue()
   return (int)GetLValue();
 }
 
+inline unsigned int CodeQueueItem::ExecuteAtMove() const
+{
+	return moveToExecute;
+}
+
+inline const char *CodeQueueItem::GetCommand() const
+{
+	return data + 2 * parameterCount;
+}
+
+inline size_t CodeQueueItem::GetCommandLength() const
+{
+	return commandLength;
+}
+
+inline unsigned int CodeQueueItem::GetParameterCount() const
+{
+	return parameterCount;
+}
+
+inline const uint8_t *CodeQueueItem::GetParameters() const
+{
+	return reinterpret_cast<const uint8_t*>(data);
+}
+
+inline GCodeBuffer *CodeQueueItem::GetSource() const
+{
+	return source;
+}
+
+inline void CodeQueueItem::Execute()
+{
+	executing = true;
+}
+
+inline bool CodeQueueItem::IsExecuting() const
+{
+	return executing;
+}
+
+inline bool CodeQueue::IsEmpty() const
+{
+	return itemCount == 0;
+}
+
+inline CodeQueueItem *CodeQueue::First() const
+{
+	return (itemCount == 0) ? NULL : ItemAt(head);
+}
+
+inline unsigned int CodeQueue::GetItemCount() const
+{
+	return itemCount;
+}
+
+inline size_t CodeQueue::GetBytesUsed() const
+{
+	return bytesUsed;
+}
+
+inline size_t CodeQueue::GetMaxBytesUsed() const
+{
+	return maxBytesUsed;
+}
+
+inline unsigned int CodeQueue::GetMaxItemCount() const
+{
+	return maxItemCount;
+}
+
+inline CodeQueueItem *CodeQueue::ItemAt(size_t offset) const
+{
+	return reinterpret_cast<CodeQueueItem*>(const_cast<uint32_t*>(arena) + offset/sizeof(uint32_t));
+}
+
 inline const char* GCodeBuffer::Buffer() const
 {
   return gcodeBuffer;
@@ -286,6 +437,7 @@ inline void GCodeBuffer::SetFinished(bool f)
 	{
 		state = idle;
 		gcodeBuffer[0] = 0;
+		decoded = false;
 	}
 	else
 	{
@@ -20,8 +20,6 @@ Licence: GPL
 
 #include "RepRapFirmware.h"
 
-const float invHeatPwmAverageCount = HEAT_SAMPLE_TIME/HEAT_PWM_AVERAGE_TIME;
-
 Heat::Heat(Platform* p, GCodes* g)
 {
 	platform = p;
@@ -41,6 +39,10 @@ void Heat::Init()
 	}
 	lastTime = platform->Time();
 	longWait = lastTime;
+	schedule.Init(lastTime);
+	lastHistoryTime = lastTime;
+	history.Init();
+	UpdateSchedule();
 	active = true;
 }
 
@@ -64,13 +66,64 @@ void Heat::Spin()
 		return;
 
 	lastTime = t;
+	schedule.NextSample();
 	for(size_t heater=0; heater < HEATERS; heater++)
 	{
+		const unsigned int multiple = platform->GetHeaterSampleMultiple(heater);
+		if (!schedule.Due(heater, multiple))
+		{
+			continue;
+		}
+
+		const bool on = !pids[heater]->SwitchedOff() && !pids[heater]->FaultOccurred();
+		float start;
+		if (schedule.Stagger(heater, multiple, on, t, platform->GetHeaterStaggerTime(), start))
+		{
+			pids[heater]->HoldOff(start);
+		}
+
+		if (pids[heater]->model.enabled)
+		{
+			pids[heater]->SetExtrusionRate(GetExtrusionRate(heater));
+		}
 		pids[heater]->Spin();
 	}
+
+	if (t - lastHistoryTime >= HEAT_HISTORY_INTERVAL)
+	{
+		lastHistoryTime = (t - lastHistoryTime < 2.0 * HEAT_HISTORY_INTERVAL) ? lastHistoryTime + HEAT_HISTORY_INTERVAL : t;
+		float temperatures[HEATERS], pwms[HEATERS];
+		for(size_t heater=0; heater < HEATERS; heater++)
+		{
+			temperatures[heater] = pids[heater]->temperature;
+			pwms[heater] = pids[heater]->lastPwm;
+		}
+		history.Record(temperatures, pwms);
+	}
+
+	// If any zone of a heater develops a fault, switch off the whole group
+	for(size_t heater=0; heater < HEATERS; heater++)
+	{
+		const int8_t leader = platform->GetHeaterZoneLeader(heater);
+		if (leader >= 0 && (pids[heater]->FaultOccurred() || pids[leader]->FaultOccurred()))
+		{
+			SwitchOff(leader);
+		}
+	}
 	platform->ClassReport(longWait);
 }
 
+// Give each heater a slot so that heaters with the same sample multiple are controlled in different samples
+void Heat::UpdateSchedule()
+{
+	uint8_t multiples[HEATERS];
+	for(size_t heater=0; heater < HEATERS; heater++)
+	{
+		multiples[heater] = (uint8_t)platform->GetHeaterSampleMultiple(heater);
+	}
+	schedule.Update(multiples);
+}
+
 void Heat::Diagnostics() 
 {
 	platform->AppendMessage(BOTH_MESSAGE, "Heat Diagnostics:\n");
@@ -80,9 +133,48 @@ void Heat::Diagnostics()
 		{
 			platform->AppendMessage(BOTH_MESSAGE, "Heater %d: I-accumulator = %.1f\n", heater, pids[heater]->temp_iState);
 		}
+		if (pids[heater]->model.enabled)
+		{
+			platform->AppendMessage(BOTH_MESSAGE, "Heater %d: feed-forward PWM = %.3f, extrusion rate = %.2fmm/s\n",
+					heater, pids[heater]->feedForward, pids[heater]->extrusionRate);
+		}
+		const int8_t leader = platform->GetHeaterZoneLeader(heater);
+		if (leader >= 0 || platform->GetHeaterSampleMultiple(heater) > 1)
+		{
+			platform->AppendMessage(BOTH_MESSAGE, "Heater %d: sample period %.1fs, slot %d", heater, pids[heater]->control.sampleInterval, schedule.Slot(heater));
+			if (leader >= 0)
+			{
+				platform->AppendMessage(BOTH_MESSAGE, ", zone of heater %d", leader);
+			}
+			platform->AppendMessage(BOTH_MESSAGE, "\n");
+		}
+		if (pids[heater]->tuning)
+		{
+			const RelayTuner& tuner = pids[heater]->tuner;
+			platform->AppendMessage(BOTH_MESSAGE, "Heater %d: auto tuning at %.1fC, %u of %u cycles done\n",
+					heater, tuner.Target(), tuner.CyclesMeasured(), tuner.CyclesWanted());
+		}
 	}
 }
 
+// Recalculate the constants that a heater's controller derives from its parameters. Call this after changing them.
+void Heat::UpdateParameters(int8_t heater)
+{
+	if (heater >= 0 && heater < HEATERS)
+	{
+		pids[heater]->UpdateParameters();
+	}
+}
+
+void Heat::UpdateAllParameters()
+{
+	for(size_t heater=0; heater < HEATERS; heater++)
+	{
+		pids[heater]->UpdateParameters();
+	}
+	UpdateSchedule();
+}
+
 bool Heat::AllHeatersAtSetTemperatures(bool includingBed) const
 {
 #if HOT_BED != -1
@@ -91,6 +183,10 @@ bool Heat::AllHeatersAtSetTemperatures(bool includingBed) const
 	for(size_t heater = E0_HEATER; heater < HEATERS; heater++)
 #endif
 	{
+		if (platform->GetHeaterZoneLeader(heater) >= 0)
+		{
+			continue;		// zones are checked along with their leader
+		}
 		if(!HeaterAtSetTemperature(heater))
 		{
 			return false;
@@ -99,16 +195,160 @@ bool Heat::AllHeatersAtSetTemperatures(bool includingBed) const
 	return true;
 }
 
+// Get the rate at which filament is about to be fed through a heater, which is zero unless it belongs to the current tool
+float Heat::GetExtrusionRate(int8_t heater) const
+{
+	Tool *tool = reprap.GetCurrentTool();
+	if (tool == NULL)
+	{
+		return 0.0;
+	}
+
+	for (int i = 0; i < tool->HeaterCount(); ++i)
+	{
+		if (tool->Heater(i) == heater)
+		{
+			float rate = 0.0;
+			for (int drive = 0; drive < tool->DriveCount(); ++drive)
+			{
+				rate += reprap.GetMove()->GetPlannedExtrusionRate(tool->Drive(drive));
+			}
+			return rate;
+		}
+	}
+	return 0.0;
+}
+
 //query an individual heater
 bool Heat::HeaterAtSetTemperature(int8_t heater) const
 {
-	// If it hasn't anything to do, it must be right wherever it is...
-	if (heater < 0 || pids[heater]->SwitchedOff() || pids[heater]->FaultOccurred())
+	if (heater < 0 || heater >= HEATERS)
 		return true;
 
-	float dt = GetTemperature(heater);
-	float target = (pids[heater]->Active()) ? GetActiveTemperature(heater) : GetStandbyTemperature(heater);
-	return (target < TEMPERATURE_LOW_SO_DONT_CARE) || (fabs(dt - target) <= TEMPERATURE_CLOSE_ENOUGH);
+	// A heater that has zones is only at temperature when all of them are
+	for (size_t h = 0; h < HEATERS; ++h)
+	{
+		if (InGroup(h, heater))
+		{
+			// If it hasn't anything to do, it must be right wherever it is...
+			const PID *pid = pids[h];
+			if (pid->SwitchedOff() || pid->FaultOccurred())
+				continue;
+
+			float dt = pid->GetTemperature();
+			float target = (pid->Active()) ? pid->GetActiveTemperature() : pid->GetStandbyTemperature();
+			if (target >= TEMPERATURE_LOW_SO_DONT_CARE && fabs(dt - target) > TEMPERATURE_CLOSE_ENOUGH)
+				return false;
+		}
+	}
+	return true;
+}
+
+//******************************************************************************************************
+
+void TemperatureHistory::Init()
+{
+	count = 0;
+}
+
+// Convert a temperature to the quarter degrees we store, limiting it to what an int16_t can hold
+static int16_t QuarterDegrees(float t)
+{
+	return (int16_t)floor(max<float>(-8000.0, min<float>(8000.0, t)) * 4.0 + 0.5);
+}
+
+void TemperatureHistory::Record(const float temperatures[], const float pwmValues[])
+{
+	if (count == 0)
+	{
+		// The very first sample has nothing to differ from, so start from its own temperatures
+		for (size_t heater = 0; heater < HEATERS; ++heater)
+		{
+			lastTemperatures[heater] = QuarterDegrees(temperatures[heater]);
+		}
+	}
+	if (count % HEAT_HISTORY_BLOCK == 0)
+	{
+		memcpy(blockTemperatures[(count/HEAT_HISTORY_BLOCK) % heatHistoryBlocks], lastTemperatures, sizeof(lastTemperatures));
+	}
+
+	// If the temperature changed by more than we can store, the difference saturates and the following samples catch up
+	const size_t slot = count % HEAT_HISTORY_LENGTH;
+	for (size_t heater = 0; heater < HEATERS; ++heater)
+	{
+		const int32_t difference = max<int32_t>(-127, min<int32_t>(127, QuarterDegrees(temperatures[heater]) - lastTemperatures[heater]));
+		differences[slot][heater] = (int8_t)difference;
+		lastTemperatures[heater] += (int16_t)difference;
+		pwms[slot][heater] = (uint8_t)(max<float>(0.0, min<float>(1.0, pwmValues[heater])) * 255.0 + 0.5);
+	}
+	++count;
+}
+
+int16_t TemperatureHistory::GetBase(size_t heater, uint32_t seq) const
+{
+	if (seq == count)
+	{
+		return lastTemperatures[heater];
+	}
+
+	const uint32_t block = seq/HEAT_HISTORY_BLOCK;
+	int16_t t = blockTemperatures[block % heatHistoryBlocks][heater];
+	for (uint32_t s = block * HEAT_HISTORY_BLOCK; s < seq; ++s)
+	{
+		t += differences[s % HEAT_HISTORY_LENGTH][heater];
+	}
+	return t;
+}
+
+// Report the samples starting at 'from' as hex strings, two digits per heater per sample, together with the temperatures
+// they start from. If 'from' is no longer available, or is in the future because we have restarted, start at the oldest.
+// "next" is what the client should ask for next time.
+void TemperatureHistory::GetResponse(StringRef& response, uint32_t from) const
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	// We only keep whole blocks, because the first samples of a partly overwritten block can't be decoded
+	const uint32_t oldest = (count > HEAT_HISTORY_LENGTH)
+							? ((count - HEAT_HISTORY_LENGTH + HEAT_HISTORY_BLOCK - 1)/HEAT_HISTORY_BLOCK) * HEAT_HISTORY_BLOCK
+							: 0;
+	if (from < oldest || from > count)
+	{
+		from = oldest;
+	}
+	const size_t maxSamples = (response.Length() - 80 - 10 * HEATERS)/(4 * HEATERS);
+	const uint32_t to = min<uint32_t>(count, from + maxSamples);
+
+	response.printf("{\"seq\":%u,\"next\":%u,\"interval\":%.1f,\"base\":[", (unsigned int)from, (unsigned int)to, HEAT_HISTORY_INTERVAL);
+	for (size_t heater = 0; heater < HEATERS; ++heater)
+	{
+		response.catf((heater == 0) ? "%.2f" : ",%.2f", (float)GetBase(heater, from) * 0.25);
+	}
+
+	char sample[2 * HEATERS + 1];
+	sample[2 * HEATERS] = 0;
+	response.cat("],\"temps\":\"");
+	for (uint32_t s = from; s < to; ++s)
+	{
+		for (size_t heater = 0; heater < HEATERS; ++heater)
+		{
+			const uint8_t b = (uint8_t)differences[s % HEAT_HISTORY_LENGTH][heater];
+			sample[2 * heater] = hexDigits[b >> 4];
+			sample[2 * heater + 1] = hexDigits[b & 0x0F];
+		}
+		response.cat(sample);
+	}
+	response.cat("\",\"pwm\":\"");
+	for (uint32_t s = from; s < to; ++s)
+	{
+		for (size_t heater = 0; heater < HEATERS; ++heater)
+		{
+			const uint8_t b = pwms[s % HEAT_HISTORY_LENGTH][heater];
+			sample[2 * heater] = hexDigits[b >> 4];
+			sample[2 * heater + 1] = hexDigits[b & 0x0F];
+		}
+		response.cat(sample);
+	}
+	response.cat("\"}");
 }
 
 //******************************************************************************************************
@@ -121,7 +361,8 @@ PID::PID(Platform* p, int8_t h)
 
 void PID::Init()
 {
-	  platform->SetHeater(heater, 0.0);
+	  UpdateParameters();
+	  SetHeater(0.0);
 	  temperature = platform->GetTemperature(heater);
 	  activeTemperature = ABS_ZERO;
 	  standbyTemperature = ABS_ZERO;
@@ -133,6 +374,23 @@ void PID::Init()
 	  switchedOff = true;
 	  heatingUp = false;
 	  averagePWM = 0.0;
+	  holdOffUntil = 0.0;
+	  ResetHeatingRateCheck();
+	  tuning = false;
+	  model.Init();
+	  extrusionRate = 0.0;
+	  feedForward = 0.0;
+}
+
+// Take a copy of our parameters and precalculate the scaled gains, so that Spin doesn't have to divide
+void PID::UpdateParameters()
+{
+	const PidParameters& pp = platform->GetPidParameters(heater);
+	const unsigned int multiple = platform->GetHeaterSampleMultiple(heater);
+	control.usePid = pp.UsePID();
+	control.SetGains(pp.kP, pp.kI, pp.kD, pp.kT, pp.kS, pp.fullBand, pp.pidMin, pp.pidMax, platform->HeatSampleTime() * multiple);
+	control.checkTimeToHot = heater != HOT_BED && heater != reprap.GetChamberHeater() && multiple == 1 && platform->GetHeaterZoneLeader(heater) < 0;
+	control.fault = platform->GetHeaterFaultParameters(heater);
 }
 
 void PID::SwitchOn()
@@ -159,8 +417,13 @@ void PID::Spin()
 
 	if (temperatureFault || switchedOff)
 	{
-		platform->SetHeater(heater, 0.0); // Make sure...
-		averagePWM *= (1.0 - invHeatPwmAverageCount);
+		if (tuning)
+		{
+			StopAutoTune("heater fault");
+		}
+		SetHeater(0.0); // Make sure...
+		averagePWM *= control.pwmAverageDecay;
+		ResetHeatingRateCheck();
 		return;
 	}
 
@@ -172,7 +435,7 @@ void PID::Spin()
 		badTemperatureCount++;
 		if (badTemperatureCount > MAX_BAD_TEMPERATURE_COUNT)
 		{
-			platform->SetHeater(heater, 0.0);
+			SetHeater(0.0);
 			temperatureFault = true;
 //			switchedOff = true;
 			platform->Message(BOTH_MESSAGE, "Temperature fault on heater %d, T = %.1f\n", heater, temperature);
@@ -184,9 +447,17 @@ void PID::Spin()
 		badTemperatureCount = 0;
 	}
 
-	// Now check how long it takes to warm up.  If too long, maybe the thermistor is not in contact with the heater
+	// Check that the heater is heating as fast as it should. If not, the thermistor may have come out of the heater block.
 
-	if (heatingUp && heater != HOT_BED) // FIXME - also check bed warmup time?
+	if (!temperatureFault)
+	{
+		CheckHeatingRate();
+	}
+
+	// Now check how long it takes to warm up. This is a backstop for the heating rate check, so it is still only
+	// applied to the hot ends because beds, bed zones and chambers may take much longer than TimeToHot.
+
+	if (heatingUp && control.checkTimeToHot)
 	{
 		float tmp = (active) ? activeTemperature : standbyTemperature;
 		if (temperature < tmp - TEMPERATURE_CLOSE_ENOUGH)
@@ -195,7 +466,7 @@ void PID::Spin()
 			float limit = platform->TimeToHot();
 			if (tim > platform->TimeToHot() && limit > 0.0)
 			{
-				platform->SetHeater(heater, 0.0);
+				SetHeater(0.0);
 				temperatureFault = true;
 //				switchedOff = true;
 				platform->Message(BOTH_MESSAGE, "Heating fault on heater %d, T = %.1f C; still not at temperature %.1f after %f seconds.\n",heater, temperature, tmp, tim);
@@ -208,87 +479,233 @@ void PID::Spin()
 		}
 	}
 
+	if (temperatureFault)
+	{
+		if (tuning)
+		{
+			StopAutoTune("heater fault");
+		}
+		return;
+	}
+
+	// Wait for our turn to switch on if we are a slow heater
+	if (platform->Time() < holdOffUntil)
+	{
+		SetHeater(0.0);
+		averagePWM *= control.pwmAverageDecay;
+		return;
+	}
+
+	if (tuning)
+	{
+		DoAutoTune();
+		return;
+	}
+
 	float targetTemperature = (active) ? activeTemperature : standbyTemperature;
 	float error = targetTemperature - temperature;
-	const PidParameters& pp = platform->GetPidParameters(heater);
 
-	if (!pp.UsePID())
+	if (!control.usePid)
 	{
-		platform->SetHeater(heater, (error > 0.0) ? pp.kS : 0.0);
 		if(error > 0.0)
 		{
-			platform->SetHeater(heater, pp.kS);
-			averagePWM = averagePWM * (1.0 - invHeatPwmAverageCount) + pp.kS;
+			SetHeater(control.kS);
+			averagePWM = averagePWM * control.pwmAverageDecay + control.kS;
 		}
 		else
 		{
-			platform->SetHeater(heater, 0.0);
-			averagePWM *= (1.0 - invHeatPwmAverageCount);
+			SetHeater(0.0);
+			averagePWM *= control.pwmAverageDecay;
 		}
 		return;
 	}
 
-	if (error < -pp.fullBand)
+	// If we have a thermal model, the feed-forward term provides the steady-state power and the I term only has to correct the model
+	const bool useModel = model.enabled && model.IsValid() && control.kS > 0.0;
+	feedForward = (useModel) ? model.FeedForwardPwm(targetTemperature, platform->GetFanValue(), extrusionRate) : 0.0;
+	const float pwm = control.Calculate(targetTemperature, temperature, lastTemperature, useModel, feedForward, temp_iState);
+	lastTemperature = temperature;
+	SetHeater(pwm);
+	averagePWM = averagePWM * control.pwmAverageDecay + pwm;
+}
+
+// Compare the temperature rise over each fault period with the rise that the power we applied should have produced.
+// With a thermal model we can predict the rise at any power, allowing for the heat lost at the current temperature.
+// Without one we only know how fast the heater should heat at full power, so other periods are not judged.
+void PID::CheckHeatingRate()
+{
+	const HeaterFaultParameters& fp = control.fault;
+	if (fp.period <= 0.0)
+	{
+		return;										// fault detection is disabled for this heater
+	}
+
+	float expectedRate;
+	if (model.IsValid())
+	{
+		expectedRate = model.heatingRate * lastPwm
+						- model.coolingRate * (temperature - 25.0) * (1.0 + model.fanFactor * platform->GetFanValue());
+	}
+	else if (lastPwm > 0.0 && lastPwm >= control.kS)
+	{
+		// Without a model we don't know how the rate falls off as the heater approaches its maximum temperature,
+		// so expect less as we get close to the target. Bang-bang control keeps full power on right up to it.
+		const float margin = ((active) ? activeTemperature : standbyTemperature) - temperature;
+		expectedRate = (margin >= HEATING_FAULT_TAPER) ? fp.rate
+						: (margin > 0.0) ? fp.rate * margin/HEATING_FAULT_TAPER
+							: 0.0;
+	}
+	else
+	{
+		rateCheckStarted = false;
+		return;
+	}
+
+	if (!rateCheckStarted)
 	{
-		// actual temperature is well above target
-		temp_iState = (targetTemperature + pp.fullBand - 25.0) * pp.kT;	// set the I term to our estimate of what will be needed ready for the switch to PID
-		platform->SetHeater(heater, 0.0);
-		averagePWM *= (1.0 - invHeatPwmAverageCount);
-		lastTemperature = temperature;
+		// We don't know the temperature at the start of the interval just finished, so start measuring from now
+		rateCheckStarted = true;
+		rateCheckTime = 0.0;
+		rateCheckStartTemperature = temperature;
+		rateCheckExpectedRise = 0.0;
 		return;
 	}
-	if (error > pp.fullBand)
+
+	rateCheckTime += control.sampleInterval;
+	rateCheckExpectedRise += expectedRate * control.sampleInterval;
+	if (rateCheckTime < fp.period)
 	{
-		// actual temperature is well below target
-		temp_iState = (targetTemperature - pp.fullBand - 25.0) * pp.kT;	// set the I term to our estimate of what will be needed ready for the switch to PID
-		platform->SetHeater(heater, pp.kS);
-		averagePWM *= (1.0 - invHeatPwmAverageCount) + pp.kS;
-		lastTemperature = temperature;
 		return;
 	}
 
-	float sampleInterval = platform->HeatSampleTime();
-	temp_iState += error * pp.kI * sampleInterval;
+	const float rise = temperature - rateCheckStartTemperature;
+	if (rateCheckExpectedRise < HEATING_FAULT_MIN_RISE || rise >= fp.fraction * rateCheckExpectedRise)
+	{
+		rateCheckFailures = 0;
+	}
+	else if (++rateCheckFailures >= HEATING_FAULT_PERIODS)
+	{
+		SetHeater(0.0);
+		temperatureFault = true;
+		platform->Message(BOTH_MESSAGE, "Heating fault on heater %d, T = %.1f C; temperature rose %.1fC in %.1f seconds, expected %.1fC.\n",
+				heater, temperature, rise, rateCheckTime, rateCheckExpectedRise);
+		reprap.FlagTemperatureFault(heater);
+	}
+
+	rateCheckTime = 0.0;
+	rateCheckStartTemperature = temperature;
+	rateCheckExpectedRise = 0.0;
+}
 
-	if (temp_iState < pp.pidMin)
+float PID::GetAveragePWM() const
+{
+	return averagePWM * control.pwmAverageFactor;
+}
+
+// Auto tuning uses the relay method (see AutoTune.h). The first oscillation includes the heat-up from cold so it is not
+// used. From the fitted model, the Ziegler-Nichols rules give the PID terms and the steady-state gain gives kT.
+
+bool PID::StartAutoTune(float target, float power, unsigned int cycles, bool apply)
+{
+	if (temperatureFault)
 	{
-		temp_iState = pp.pidMin;
+		platform->Message(BOTH_ERROR_MESSAGE, "Can't auto tune heater %d because it has a fault\n", heater);
+		return false;
 	}
-	else if (temp_iState > pp.pidMax)
+	if (target <= TEMPERATURE_LOW_SO_DONT_CARE || target + AUTO_TUNE_HYSTERESIS > BAD_HIGH_TEMPERATURE)
 	{
-		temp_iState = pp.pidMax;
+		platform->Message(BOTH_ERROR_MESSAGE, "Auto tune temperature %.1f is out of range for heater %d\n", target, heater);
+		return false;
+	}
+	if (temperature > target - AUTO_TUNE_HYSTERESIS)
+	{
+		platform->Message(BOTH_ERROR_MESSAGE, "Heater %d must be below %.1fC to start auto tuning\n", heater, target - AUTO_TUNE_HYSTERESIS);
+		return false;
 	}
 
-	float temp_dState = pp.kD * (temperature - lastTemperature) / sampleInterval;
-	float result = pp.kP * error + temp_iState - temp_dState;
+	const PidParameters& pp = platform->GetPidParameters(heater);
+	const float tunePower = (power > 0.0) ? min<float>(power, pp.kS) : pp.kS;
+	const float now = platform->Time();
+	tuner.Start(target, tunePower, max<unsigned int>(1, min<unsigned int>(cycles, AUTO_TUNE_MAX_CYCLES)), temperature, now);
+	tuneApply = apply;
 
-	lastTemperature = temperature;
+	// Show the target as our active temperature and let the usual checks time the heat-up
+	activeTemperature = target;
+	active = true;
+	SwitchOn();
+	timeSetHeating = now;
+	heatingUp = true;
+	tuning = true;
+	platform->Message(BOTH_MESSAGE, "Auto tuning heater %d at %.1fC using PWM %.2f\n", heater, target, tunePower);
+	return true;
+}
 
-	// Legacy - old RepRap PID parameters were set to give values in [0, 255] for 1 byte PWM control
-	// TODO - maybe change them to give [0.0, 1.0]?
+void PID::DoAutoTune()
+{
+	const float now = platform->Time();
+	if (tuner.Elapsed(now) > AUTO_TUNE_MAX_TIME)
+	{
+		StopAutoTune("timeout");
+		return;
+	}
 
-	if (result < 0.0)
+	if (tuner.Sample(temperature, now))
 	{
-		result = 0.0;
+		FinishAutoTune();
+		return;
 	}
-	else if (result > 255.0)
+
+	const float power = tuner.Pwm();
+	SetHeater(power);
+	averagePWM = averagePWM * control.pwmAverageDecay + power;
+}
+
+void PID::FinishAutoTune()
+{
+	RelayTuneResult result;
+	if (!tuner.Fit(result))
 	{
-		result = 255.0;
+		StopAutoTune("the temperature did not oscillate enough");
+		return;
 	}
-	result = result / 255.0;
 
-	if (!temperatureFault)
+	// PID output is in [0, 255] and is scaled by kS, so convert the gains from PWM to the same units
+	PidParameters pp = platform->GetPidParameters(heater);
+	const float ku = result.ku * 255.0 / pp.kS;
+	pp.kP = 0.6 * ku;
+	pp.kI = 2.0 * pp.kP / result.tu;
+	pp.kD = pp.kP * result.tu * 0.125;
+	pp.kT = 255.0/(result.gain * pp.kS);
+
+	SwitchOff();
+	platform->Message(BOTH_MESSAGE, "Auto tune of heater %d complete: Ku %.2f, Tu %.1fs, gain %.1fC, time constant %.1fs, dead time %.1fs\n",
+			heater, ku, result.tu, result.gain, result.timeConstant, result.deadTime);
+	platform->Message(BOTH_MESSAGE, "%s M301 H%d P%.2f I%.3f D%.2f T%.2f\n", (tuneApply) ? "Applied" : "Suggested",
+			heater, pp.kP, pp.kI * platform->HeatSampleTime(), pp.kD / platform->HeatSampleTime(), pp.kT);
+	if (tuneApply)
 	{
-		platform->SetHeater(heater, result * pp.kS);
+		platform->SetPidParameters(heater, pp);
+		UpdateParameters();
 	}
 
-	averagePWM = averagePWM * (1.0 - invHeatPwmAverageCount) + result;
-//	debugPrintf("Heater %d: e=%f, P=%f, I=%f, d=%f, r=%f\n", heater, error, pp.kP*error, temp_iState, temp_dState, result);
+	// The thermal model's heating rate is the initial rate of rise at full PWM, and its cooling rate is the reciprocal of the time constant
+	if (result.timeConstant > 0.0)
+	{
+		const float heatingRate = result.gain/result.timeConstant;
+		const float coolingRate = 1.0/result.timeConstant;
+		platform->Message(BOTH_MESSAGE, "%s M307 H%d A%.3f C%.5f\n", (tuneApply) ? "Applied" : "Suggested", heater, heatingRate, coolingRate);
+		if (tuneApply)
+		{
+			model.heatingRate = heatingRate;
+			model.coolingRate = coolingRate;
+		}
+	}
 }
 
-float PID::GetAveragePWM() const
+void PID::StopAutoTune(const char *reason)
 {
-	return averagePWM * invHeatPwmAverageCount;
+	SwitchOff();
+	platform->Message(BOTH_ERROR_MESSAGE, "Auto tune of heater %d abandoned: %s\n", heater, reason);
 }
 
 // End
@@ -21,6 +21,32 @@ Licence: GPL
 #ifndef HEAT_H
 #define HEAT_H
 
+/**
+ * A history of the temperature and PWM of every heater, sampled at regular intervals. Temperatures are stored as
+ * differences from the previous sample in quarter degrees, with an absolute temperature at the start of each block
+ * so that the history can be decoded from any block onwards. Each sample has a sequence number, so that clients
+ * can fetch the whole history once and then just the samples they haven't seen.
+ */
+
+const size_t heatHistoryBlocks = HEAT_HISTORY_LENGTH/HEAT_HISTORY_BLOCK;
+
+class TemperatureHistory
+{
+  public:
+    void Init();
+    void Record(const float temperatures[], const float pwmValues[]);	// Add a sample for every heater
+    void GetResponse(StringRef& response, uint32_t from) const;		// Report as JSON the samples from sequence number 'from'
+
+  private:
+    int16_t GetBase(size_t heater, uint32_t seq) const;				// Temperature in quarter degrees before sample seq
+
+    uint32_t count;													// Number of samples recorded, which is the next sequence number
+    int16_t lastTemperatures[HEATERS];								// The temperatures the stored differences add up to so far
+    int16_t blockTemperatures[heatHistoryBlocks][HEATERS];			// Temperatures before the first sample of each block
+    int8_t differences[HEAT_HISTORY_LENGTH][HEATERS];
+    uint8_t pwms[HEAT_HISTORY_LENGTH][HEATERS];						// Heater PWM, 255 = full power
+};
+
 /**
  * This class implements a PID controller for the heaters
  */
@@ -33,6 +59,8 @@ class PID
     PID(Platform* p, int8_t h);
     void Init();									// (Re)Set everything to start
     void Spin();									// Called in a tight loop to keep things running
+    void UpdateParameters();						// Recalculate the control block after the parameters have changed
+    void HoldOff(float until);						// Keep the heater power off until this time, to stagger switching on
     void SetActiveTemperature(float t);
     float GetActiveTemperature() const;
     void SetStandbyTemperature(float t);
@@ -46,10 +74,20 @@ class PID
     void ResetFault();								// Reset a fault condition - only call this if you know what you are doing
     float GetTemperature() const;					// Get the current temperature
     float GetAveragePWM() const;					// Return the running average PWM to the heater. Answer is a fraction in [0, 1].
+    bool StartAutoTune(float target, float power, unsigned int cycles, bool apply);	// Start a relay auto tune around the target temperature
+    bool AutoTuning() const;						// Is an auto tune in progress?
+    ThermalModel& GetModel();						// The thermal model used for feed-forward
+    void SetExtrusionRate(float rate);				// Set the planned filament feed rate in mm/sec through this heater
 
   private:
 
     void SwitchOn();
+    void SetHeater(float pwm);						// Set the heater PWM and remember it for the heating rate check
+    void CheckHeatingRate();						// Check that the temperature is rising as fast as the power applied should make it
+    void ResetHeatingRateCheck();					// Start a new measurement of the heating rate
+    void DoAutoTune();								// Run the relay for one sample while auto tuning
+    void FinishAutoTune();							// Report or apply the parameters from the fitted model
+    void StopAutoTune(const char *reason);			// Abandon an auto tune and switch the heater off
   
     Platform* platform;								// The instance of the class that is the RepRap hardware
     float activeTemperature;						// The required active temperature
@@ -65,6 +103,21 @@ class PID
     float timeSetHeating;							// When we were switched on
     bool heatingUp;									// Are we heating up?
     float averagePWM;								// The running average of the PWM.
+    PidControlBlock control;						// Gains and constants derived from the parameters
+    float holdOffUntil;								// Heater power is held off until this time
+    float lastPwm;									// The PWM applied over the last sample interval
+    bool rateCheckStarted;							// Are we measuring the heating rate?
+    uint8_t rateCheckFailures;						// Consecutive periods in which the temperature rose too little
+    float rateCheckTime;							// How long we have been measuring
+    float rateCheckStartTemperature;				// Temperature at the start of the measurement
+    float rateCheckExpectedRise;					// The rise the applied power should have produced so far
+    ThermalModel model;								// Thermal model for feed-forward control
+    float extrusionRate;							// Planned filament feed rate through this heater, mm/sec
+    float feedForward;								// The last feed-forward PWM, for diagnostics
+
+    bool tuning;									// Are we running a relay auto tune?
+    bool tuneApply;									// Should the tuned parameters be applied when we finish?
+    RelayTuner tuner;								// Runs the relay and fits the model
 };
 
 /**
@@ -95,8 +148,14 @@ class Heat
     bool AllHeatersAtSetTemperatures(bool includingBed) const;	// Is everything at temperature within tolerance?
     bool HeaterAtSetTemperature(int8_t heater) const;			// Is a specific heater at temperature within tolerance?
     void Diagnostics();											// Output useful information
+    void UpdateParameters(int8_t heater);						// Call after changing the parameters of a heater
+    void UpdateAllParameters();									// Call after changing the parameters of all heaters, or the zones and sample periods
+    void GetHistoryResponse(StringRef& response, uint32_t from) const;	// Report the temperature history from sequence number 'from'
     
     float GetAveragePWM(int8_t heater) const;					// Return the running average PWM to the heater. Answer is a fraction in [0, 1].
+    bool StartAutoTune(int8_t heater, float target, float power, unsigned int cycles, bool apply);	// Start a relay auto tune
+    bool AutoTuning(int8_t heater) const;						// Is this heater being auto tuned?
+    ThermalModel* GetModel(int8_t heater) const;				// Get the thermal model of a heater, or NULL
 
   private:
   
@@ -106,6 +165,13 @@ class Heat
     PID* pids[HEATERS];							// A PID controller for each heater
     float lastTime;								// The last time our Spin() was called
     float longWait;								// Long time for things that happen occasionally
+    HeaterSchedule<HEATERS> schedule;			// Which heaters are controlled in each sample, and staggering of slow heaters
+    float lastHistoryTime;						// When we last added to the temperature history
+    TemperatureHistory history;					// Recent temperatures and PWM of all heaters
+
+    float GetExtrusionRate(int8_t heater) const;	// Planned filament feed rate through a heater of the current tool
+    void UpdateSchedule();						// Work out which sample each heater is controlled in
+    bool InGroup(size_t h, int8_t heater) const;	// Is h this heater or one of its zones?
 };
 
 
@@ -195,14 +261,48 @@ inline void PID::ResetFault()
 	temperatureFault = false;
 	timeSetHeating = platform->Time();		// otherwise we will get another timeout immediately
 	badTemperatureCount = 0;
+	ResetHeatingRateCheck();
+}
+
+inline void PID::SetHeater(float pwm)
+{
+	platform->SetHeater(heater, pwm);
+	lastPwm = pwm;
+}
+
+inline void PID::ResetHeatingRateCheck()
+{
+	rateCheckStarted = false;
+	rateCheckFailures = 0;
 }
 
 inline void PID::SwitchOff()
 {
-	platform->SetHeater(heater, 0.0);
+	SetHeater(0.0);
 	active = false;
 	switchedOff = true;
 	heatingUp = false;
+	tuning = false;
+}
+
+inline bool PID::AutoTuning() const
+{
+	return tuning;
+}
+
+inline ThermalModel& PID::GetModel()
+{
+	return model;
+}
+
+inline void PID::HoldOff(float until)
+{
+	holdOffUntil = until;
+}
+
+inline void PID::SetExtrusionRate(float rate)
+{
+	extrusionRate = rate;
 }
 
 inline bool PID::SwitchedOff() const
@@ -210,11 +310,37 @@ inline bool PID::SwitchedOff() const
 	return switchedOff;
 }
 
+inline void Heat::GetHistoryResponse(StringRef& response, uint32_t from) const
+{
+	history.GetResponse(response, from);
+}
+
 inline float Heat::GetAveragePWM(int8_t heater) const
 {
 	return pids[heater]->GetAveragePWM();
 }
 
+inline bool Heat::StartAutoTune(int8_t heater, float target, float power, unsigned int cycles, bool apply)
+{
+	return heater >= 0 && heater < HEATERS && pids[heater]->StartAutoTune(target, power, cycles, apply);
+}
+
+// A zone follows the temperatures and state of its leader, so most operations on a heater also apply to its zones
+inline bool Heat::InGroup(size_t h, int8_t heater) const
+{
+	return (int)h == heater || platform->GetHeaterZoneLeader(h) == heater;
+}
+
+inline bool Heat::AutoTuning(int8_t heater) const
+{
+	return heater >= 0 && heater < HEATERS && pids[heater]->AutoTuning();
+}
+
+inline ThermalModel* Heat::GetModel(int8_t heater) const
+{
+	return (heater >= 0 && heater < HEATERS) ? &pids[heater]->GetModel() : NULL;
+}
+
 //**********************************************************************************
 
 // Heat
@@ -224,8 +350,11 @@ inline Heat::HeaterStatus Heat::GetStatus(int8_t heater) const
 	if (heater < 0 || heater >= HEATERS)
 		return HS_off;
 
-	if (pids[heater]->FaultOccurred())
-		return HS_fault;
+	for (size_t h = 0; h < HEATERS; ++h)
+	{
+		if (InGroup(h, heater) && pids[h]->FaultOccurred())
+			return HS_fault;
+	}
 
 	if (pids[heater]->SwitchedOff())
 		return HS_off;
@@ -240,7 +369,13 @@ inline void Heat::SetActiveTemperature(int8_t heater, float t)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->SetActiveTemperature(t);
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->SetActiveTemperature(t);
+			}
+		}
 	}
 }
 
@@ -253,7 +388,13 @@ inline void Heat::SetStandbyTemperature(int8_t heater, float t)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->SetStandbyTemperature(t);
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->SetStandbyTemperature(t);
+			}
+		}
 	}
 }
 
@@ -271,7 +412,13 @@ inline void Heat::Activate(int8_t heater)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->Activate();
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->Activate();
+			}
+		}
 	}
 }
 
@@ -279,7 +426,13 @@ inline void Heat::SwitchOff(int8_t heater)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->SwitchOff();
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->SwitchOff();
+			}
+		}
 	}
 }
 
@@ -295,7 +448,13 @@ inline void Heat::Standby(int8_t heater)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->Standby();
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->Standby();
+			}
+		}
 	}
 }
 
@@ -303,7 +462,13 @@ inline void Heat::ResetFault(int8_t heater)
 {
 	if (heater >= 0 && heater < HEATERS)
 	{
-		pids[heater]->ResetFault();
+		for (size_t h = 0; h < HEATERS; ++h)
+		{
+			if (InGroup(h, heater))
+			{
+				pids[h]->ResetFault();
+			}
+		}
 	}
 }
 
@@ -0,0 +1,95 @@
+/****************************************************************************************************
+
+RepRapFirmware - HeaterSchedule
+
+Decides which heaters are controlled in each heat sample, and staggers the switching on of slow
+heaters so that the high-power ones don't all come on together. Nothing in here depends on the
+hardware, so that it can also be built and tested on the host (see Tests).
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef HEATERSCHEDULE_H
+#define HEATERSCHEDULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+template<size_t heaters> class HeaterSchedule
+{
+  public:
+    void Init(float now);
+    void Update(const uint8_t multiples[]);			// Give each heater a slot, so that heaters with the same sample multiple are controlled in different samples
+    void NextSample();								// Call at every heat sample time, before asking which heaters are due
+    bool Due(size_t heater, unsigned int multiple) const;	// Should the heater be controlled in this sample?
+    bool Stagger(size_t heater, unsigned int multiple, bool on, float now, float staggerTime, float& start);	// Must a due heater hold off its power?
+    uint8_t Slot(size_t heater) const;
+
+  private:
+    uint32_t sampleCount;							// Heat sample times since we started
+    uint8_t sampleSlots[heaters];					// Spreads heaters with the same sample multiple across successive samples
+    bool heaterWasOn[heaters];						// Was the heater switched on when we last controlled it?
+    float nextStaggerTime;							// The earliest time at which the next slow heater may switch on
+};
+
+template<size_t heaters> void HeaterSchedule<heaters>::Init(float now)
+{
+	sampleCount = 0;
+	nextStaggerTime = now;
+	for (size_t heater = 0; heater < heaters; ++heater)
+	{
+		sampleSlots[heater] = 0;
+		heaterWasOn[heater] = false;
+	}
+}
+
+template<size_t heaters> void HeaterSchedule<heaters>::Update(const uint8_t multiples[])
+{
+	for (size_t heater = 0; heater < heaters; ++heater)
+	{
+		// Number the heaters that share this heater's multiple
+		unsigned int slot = 0;
+		for (size_t h = 0; h < heater; ++h)
+		{
+			if (multiples[h] == multiples[heater])
+			{
+				++slot;
+			}
+		}
+		sampleSlots[heater] = (multiples[heater] > 1) ? (uint8_t)(slot % multiples[heater]) : 0;
+	}
+}
+
+template<size_t heaters> inline void HeaterSchedule<heaters>::NextSample()
+{
+	++sampleCount;
+}
+
+template<size_t heaters> inline bool HeaterSchedule<heaters>::Due(size_t heater, unsigned int multiple) const
+{
+	return (sampleCount + sampleSlots[heater]) % multiple == 0;
+}
+
+// Slow heaters are usually the high-power ones such as beds and chambers, so don't let them all switch on together.
+// Returns true if a slow heater has just been switched on, with the time until which it must keep its power off in start.
+template<size_t heaters> bool HeaterSchedule<heaters>::Stagger(size_t heater, unsigned int multiple, bool on, float now, float staggerTime, float& start)
+{
+	const bool switchedOn = multiple > 1 && on && !heaterWasOn[heater];
+	if (switchedOn)
+	{
+		start = (nextStaggerTime > now) ? nextStaggerTime : now;
+		nextStaggerTime = start + staggerTime;
+	}
+	heaterWasOn[heater] = on;
+	return switchedOn;
+}
+
+template<size_t heaters> inline uint8_t HeaterSchedule<heaters>::Slot(size_t heater) const
+{
+	return sampleSlots[heater];
+}
+
+#endif
@@ -83,12 +83,12 @@
 
 /* MEM_SIZE: the size of the heap memory. If the application will send
 a lot of data that needs to be copied, this should be set high. */
-#define MEM_SIZE                (1024)
+#define MEM_SIZE                (2048)
 
 /* MEMP_NUM_PBUF: the number of memp struct pbufs. If the application
    sends a lot of data out of ROM (or other static memory), this
    should be set high. */
-#define MEMP_NUM_PBUF           8
+#define MEMP_NUM_PBUF           12
 
 /* Number of raw connection PCBs */
 #define MEMP_NUM_RAW_PCB        0
@@ -102,8 +102,9 @@ a lot of data that needs to be copied, this should be set high. */
 
 /* MEMP_NUM_TCP_PCB: the number of simultaneously active TCP connections. */
 #define MEMP_NUM_TCP_PCB        16
-/* MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP connections. */
-#define MEMP_NUM_TCP_PCB_LISTEN 4
+/* MEMP_NUM_TCP_PCB_LISTEN: the number of listening TCP connections.
+   HTTP, FTP and Telnet plus one PASV data port per FTP session (numFtpSessions in Network.h). */
+#define MEMP_NUM_TCP_PCB_LISTEN 6
 /* MEMP_NUM_TCP_SEG: the number of simultaneously queued TCP segments. */
 #define MEMP_NUM_TCP_SEG        16
 /* MEMP_NUM_SYS_TIMEOUT: the number of simultaneously active timeouts. */
@@ -144,7 +145,7 @@ a lot of data that needs to be copied, this should be set high. */
 /* TCP Maximum segment size. */
 #define TCP_MSS                 (1432)	// 1432 is optimal for Windows clients
 /* TCP sender buffer space (bytes). */
-#define TCP_SND_BUF             (2 * 1432)  //changed from 2150 to pass LWIP sanity checks
+#define TCP_SND_BUF             (4 * 1432)  // allows several full segments to be in flight while earlier ones are acknowledged
 /* TCP sender buffer space (pbufs). This must be at least = 2 * TCP_SND_BUF/TCP_MSS for things to work. */
 #define TCP_SND_QUEUELEN        (3 * TCP_SND_BUF / TCP_MSS)
 /* Maximum number of retransmissions of data segments. */
@@ -3193,6 +3193,81 @@ FRESULT f_truncate (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Cluster Chain to an Empty File                  */
+/*-----------------------------------------------------------------------*/
+/* Added for RepRapFirmware after f_expand() in later FatFs releases.    */
+/* The file size is set to fsz; the caller truncates it when done.       */
+
+FRESULT f_expand (
+	FIL *fp,		/* Pointer to the file object */
+	DWORD fsz		/* Number of bytes to allocate */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst;
+
+
+	res = validate(fp->fs, fp->id);		/* Check validity of the object */
+	if (res == FR_OK) {
+		if (fp->flag & FA__ERROR) {			/* Check abort flag */
+			res = FR_INT_ERR;
+		} else {
+			if (!(fp->flag & FA_WRITE) || fsz == 0 || fp->fsize != 0 || fp->sclust != 0)
+				res = FR_DENIED;		/* Only an empty file open for writing can be expanded */
+		}
+	}
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+
+	fs = fp->fs;
+	n = (DWORD)fs->csize * SS(fs);		/* Cluster size */
+	tcl = fsz / n + ((fsz % n) ? 1 : 0);	/* Number of clusters required */
+	stcl = fs->last_clust;				/* Start searching after the last allocated cluster */
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	scl = clst = stcl; ncl = 0;
+	for (;;) {							/* Find a contiguous block of free clusters */
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (n == 0) {					/* Free cluster? */
+			if (++ncl == tcl) break;	/* Found a block that is large enough */
+		} else {
+			ncl = 0;
+		}
+		if (++clst >= fs->n_fatent) {	/* Wrap around, a block can't span the end of the FAT */
+			clst = 2; ncl = 0;
+		}
+		if (ncl == 0) scl = clst;		/* Start of the next candidate block */
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No block large enough */
+	}
+
+	if (res == FR_OK) {					/* Link the block into a chain */
+		lclst = scl + tcl - 1;
+		for (clst = scl; clst < lclst && res == FR_OK; clst++) {
+			res = put_fat(fs, clst, clst + 1);
+		}
+		if (res == FR_OK) res = put_fat(fs, lclst, 0x0FFFFFFF);
+		if (res == FR_OK) {
+			fs->last_clust = lclst;		/* Update FSINFO */
+			if (fs->free_clust != 0xFFFFFFFF) {
+				fs->free_clust -= tcl;
+				fs->fsi_flag = 1;
+			}
+			fp->sclust = scl;
+			fp->fsize = fsz;
+			fp->flag |= FA__WRITTEN;
+		} else {
+			fp->flag |= FA__ERROR;
+		}
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -82,6 +82,7 @@ void Move::Init()
   
   ddaRingGetPointer = ddaRingAddPointer; 
   ddaRingLocked = false;
+  plannedExtrusion.Init();
   
   for(uint8_t i = 0; i <= LOOK_AHEAD_RING_LENGTH; i++)
   {
@@ -636,6 +637,8 @@ bool Move::DDARingAdd(LookAhead* lookAhead)
     
     float u, v;
     ddaRingAddPointer->Init(lookAhead, u, v);
+    ddaRingAddPointer->SetPlannedExtrusion();
+    plannedExtrusion.Add(ddaRingAddPointer->plannedMicros, ddaRingAddPointer->plannedSteps);
     ddaRingAddPointer = ddaRingAddPointer->Next();
     ReleaseDDARingLock();
     return true;
@@ -682,6 +685,32 @@ DDA* Move::DDARingGet()
 	return NULL;
 }
 
+// Work out the average rate at which an extruder will feed filament over the move that is executing and those
+// waiting in the DDA ring, so that the heaters can allow for it in advance. Retractions are not counted.
+
+float Move::GetPlannedExtrusionRate(size_t extruder)
+{
+	return plannedExtrusion.Rate(extruder, platform->DriveStepsPerUnit(extruder + AXES));
+}
+
+// Called by the step interrupt when a DDA from the ring has finished or been cancelled
+
+void Move::RemovePlannedExtrusion(const DDA* d)
+{
+	plannedExtrusion.Remove(d->plannedMicros, d->plannedSteps);
+}
+
+// Record the filament fed forwards by each extruder and the time taken by this move
+
+void DDA::SetPlannedExtrusion()
+{
+	plannedMicros = (distance > 0.0 && feedRate > 0.0) ? (uint32_t)(distance*1000000.0/feedRate) : 0;
+	for(size_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+	{
+		plannedSteps[extruder] = (plannedMicros != 0 && directions[extruder + AXES] == FORWARDS) ? delta[extruder + AXES] : 0;
+	}
+}
+
 // Do the look-ahead calculations
 
 void Move::DoLookAhead()
@@ -804,6 +833,7 @@ void Move::Interrupt()
 		{
 			if (IsCancelled())
 			{
+				RemovePlannedExtrusion(dda);
 				dda->Release();		// Yes - but don't use it. All pending moves have been cancelled.
 				dda = NULL;
 			}
@@ -828,6 +858,7 @@ void Move::Interrupt()
 
 	// Yes - it's finished.  Throw it away so the code above will then find a new one.
 
+	RemovePlannedExtrusion(dda);
 	dda->Release();
 	dda = NULL;
 }
@@ -1219,6 +1250,11 @@ DDA::DDA(Move* m, Platform* p, DDA* n)
   move = m;
   platform = p;
   next = n;
+  plannedMicros = 0;
+  for(size_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+  {
+    plannedSteps[extruder] = 0;
+  }
 }
 
 /*
@@ -1472,6 +1508,7 @@ void DDA::Start()
 		platform->ExtrudeOff();
 	}
 
+	platform->ArmZProbeTrigger(endStopsToCheck);
 	platform->SetInterrupt(timeStep); // seconds
 	active = true;
 }
@@ -1482,8 +1519,24 @@ void DDA::Step()
 {
   if (!active || !move->active)
   {
+	  platform->DisarmZProbeTrigger();
 	  return;
   }
+
+  // If the ADC has seen the Z probe trigger, stop here without stepping. The ADC interrupt runs us early to do this.
+
+  const bool probeStopped = platform->ZProbeTriggered();
+  if (probeStopped)
+  {
+	  for(size_t drive = 0; drive < AXES; drive++)
+	  {
+		  if ((endStopsToCheck & (1 << drive)) != 0 && platform->Stopped(drive) == lowHit)
+		  {
+			  move->HitLowStop(drive, myLookAheadEntry, this);
+			  active = false;
+		  }
+	  }
+  }
   
   // Try to slow down the current move to achieve a better deceleration profile
 
@@ -1503,7 +1556,7 @@ void DDA::Step()
   // Step each drive and possibly check for endstops
 
   int drivesMoving = 0;
-  for(size_t drive = 0; drive < DRIVES; drive++)
+  for(size_t drive = 0; !probeStopped && drive < DRIVES; drive++)
   {
     counter[drive] += delta[drive];
     if(counter[drive] > 0)
@@ -1578,6 +1631,7 @@ void DDA::Step()
   
   if(!active)
   {
+	platform->DisarmZProbeTrigger();
 	for(uint8_t drive = 0; drive < DRIVES; drive++)
 	{
 	  if (drive < AXES)
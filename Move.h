@@ -141,6 +141,7 @@ protected:
 	bool Active() const;
 	DDA* Next();																// Next entry in the ring
 	float InstantDv() const;
+	void SetPlannedExtrusion();													// Record the extrusion and time of this move for the planned totals
 
 private:
 
@@ -168,6 +169,8 @@ private:
     bool eMoveAllowed[DRIVES-AXES];			// Which extruder is allowed to move?
     bool isDecelerating;					// Is the DDA is trying to slow down while pausing?
     volatile bool active;					// Is the DDA running?
+    uint32_t plannedMicros;					// How long this move counts for in the planned extrusion totals
+    uint32_t plannedSteps[DRIVES-AXES];		// Forward extruder steps this move counts for in the planned extrusion totals
 };
 
 /**
@@ -243,6 +246,7 @@ class Move
     void SetExtrusionFactor(uint8_t extruder, float factor);
     float GetSpeedFactor() const;					// Factor by which we changed the speed factor since the last move
     void SetSpeedFactor(float factor);
+    float GetPlannedExtrusionRate(size_t extruder);	// Filament feed rate in mm/sec over the current and queued moves
 
   private:
 
@@ -275,6 +279,7 @@ class Move
     bool SetUpIsolatedMove(float to[], float feedRate,
     		bool axesOnly);
     bool SplitNextMove();								// Split the next move to improve 5-point bed compensation
+    void RemovePlannedExtrusion(const DDA* d);			// Take a finished DDA off the planned extrusion totals
 
     Platform* platform;									// The RepRap machine
     GCodes* gCodes;										// The G Codes processing class
@@ -287,6 +292,8 @@ class Move
     DDA* ddaIsolatedMove;
     bool readIsolatedMove;
     volatile bool ddaRingLocked;
+
+    PlannedExtrusion<DRIVES - AXES> plannedExtrusion;	// Running totals of the extrusion in the DDA ring and the executing DDA
     
     // These implement the look-ahead ring
 
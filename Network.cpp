@@ -53,20 +53,33 @@ extern "C"
 
 static tcp_pcb *http_pcb = NULL;
 static tcp_pcb *ftp_main_pcb = NULL;
-static tcp_pcb *ftp_pasv_pcb = NULL;
+static tcp_pcb *ftp_pasv_pcbs[numFtpSessions];			// PASV data port of each FTP session, or NULL
 static tcp_pcb *telnet_pcb = NULL;
 
-static bool closingDataPort = false;
+static bool closingDataPort[numFtpSessions];			// true if the PASV port is to be closed when its data connection has gone
 
 static volatile bool lwipLocked = false;
 
 static NetworkTransaction *sendingTransaction = NULL;
-static char sendingWindow[TCP_WND];
+static char sendingWindow[TCP_SND_BUF];
 static uint16_t sendingWindowSize, sentDataOutstanding;
+static uint16_t windowDataOutstanding;					// how much of sentDataOutstanding is in sendingWindow
 static uint8_t sendingRetries;
 
 static uint16_t httpPort = 80;
 
+// Stop listening on the PASV port of an FTP session
+static void close_pasv_port(uint8_t session)
+{
+	if (ftp_pasv_pcbs[session] != NULL)
+	{
+		tcp_accept(ftp_pasv_pcbs[session], NULL);
+		tcp_close(ftp_pasv_pcbs[session]);
+		ftp_pasv_pcbs[session] = NULL;
+	}
+	closingDataPort[session] = false;
+}
+
 // Called only by LWIP to put out a message.
 // May be called from C as well as C++
 
@@ -134,7 +147,7 @@ static void conn_err(void *arg, err_t err)
 		if (sendingTransaction == cs->sendingTransaction)
 		{
 			sendingTransaction = NULL;
-			sentDataOutstanding = 0;
+			sentDataOutstanding = windowDataOutstanding = 0;
 		}
 	}
 }
@@ -156,7 +169,13 @@ static err_t conn_poll(void *arg, tcp_pcb *pcb)
 			return ERR_ABRT;
 		}
 
-		// Try to send the remaining data once again
+		// Try to send the remaining data once again. File data is passed to LWIP by reference and LWIP retransmits it
+		// itself, so we only do this when all the outstanding data is in the sending window.
+
+		if (sentDataOutstanding != windowDataOutstanding)
+		{
+			return ERR_OK;
+		}
 
 		err_t err = tcp_write(pcb, sendingWindow + (sendingWindowSize - sentDataOutstanding), sentDataOutstanding, 0);
 		if (err == ERR_OK)
@@ -249,7 +268,21 @@ static err_t conn_accept(void *arg, tcp_pcb *pcb, err_t err)
 		  break;
 
 	  default: // HTTP and FTP data
-		  tcp_accepted((pcb->local_port == httpPort) ? http_pcb : ftp_pasv_pcb);
+		  if (pcb->local_port == httpPort)
+		  {
+			  tcp_accepted(http_pcb);
+		  }
+		  else
+		  {
+			  for (size_t i = 0; i < numFtpSessions; i++)
+			  {
+				  if (ftp_pasv_pcbs[i] != NULL && ftp_pasv_pcbs[i]->local_port == pcb->local_port)
+				  {
+					  tcp_accepted(ftp_pasv_pcbs[i]);
+					  break;
+				  }
+			  }
+		  }
 		  break;
 	}
 	tcp_arg(pcb, cs);				// tell LWIP that this is the structure we wish to be passed for our callbacks
@@ -321,8 +354,14 @@ void telnetd_init()
 Network::Network(Platform* p)
 	: platform(p), isEnabled(true), state(NetworkInactive), readingData(false),
 	  freeTransactions(NULL), readyTransactions(NULL), writingTransactions(NULL),
-	  dataCs(NULL), ftpCs(NULL), telnetCs(NULL), freeSendBuffers(NULL), freeConnections(NULL)
+	  telnetCs(NULL), freeSendBuffers(NULL), freeConnections(NULL),
+	  freeFileSendBuffers(NULL), fileBytesSent(0), fileSendTime(0.0)
 {
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		dataCs[i] = ftpCs[i] = NULL;
+	}
+
 	for (size_t i = 0; i < networkTransactionCount; i++)
 	{
 		freeTransactions = new NetworkTransaction(freeTransactions);
@@ -333,6 +372,11 @@ Network::Network(Platform* p)
 		freeSendBuffers = new SendBuffer(freeSendBuffers);
 	}
 
+	for (size_t i = 0; i < fileSendBufferCount; i++)
+	{
+		freeFileSendBuffers = new FileSendBuffer(freeFileSendBuffers);
+	}
+
 	for (size_t i = 0; i < numConnections; i++)
 	{
 		ConnectionState *cs = new ConnectionState;
@@ -480,6 +524,17 @@ void Network::Diagnostics()
 	}
 	platform->AppendMessage(BOTH_MESSAGE, "Free send buffers: %d of %d\n", numFreeSendBuffs, tcpOutputBufferCount);
 
+	uint16_t numFreeFileSendBuffs = 0;
+	for (FileSendBuffer *buf = freeFileSendBuffers; buf != NULL; buf = buf->next)
+	{
+		numFreeFileSendBuffs++;
+	}
+	platform->AppendMessage(BOTH_MESSAGE, "Free file send buffers: %d of %d\n", numFreeFileSendBuffs, fileSendBufferCount);
+	if (fileSendTime > 0.0)
+	{
+		platform->AppendMessage(BOTH_MESSAGE, "Files sent: %uKB at %.1fKB/s\n", (unsigned int)(fileBytesSent/1024), (float)fileBytesSent/(1024.0 * fileSendTime));
+	}
+
 
 #if LWIP_STATS
 	// Normally we should NOT try to display LWIP stats here, because it uses debugPrintf(), which will hang the system is no USB cable is connected.
@@ -554,6 +609,17 @@ bool Network::AllocateSendBuffer(SendBuffer *&buffer)
 	return true;
 }
 
+// Return how many bytes could be written to the free SendBuffers
+size_t Network::SendBufferSpace() const
+{
+	size_t space = 0;
+	for (const SendBuffer *buf = freeSendBuffers; buf != NULL; buf = buf->next)
+	{
+		space += tcpOutputBufferSize;
+	}
+	return space;
+}
+
 SendBuffer *Network::ReleaseSendBuffer(SendBuffer *buffer)
 {
 	// If we used up all available send buffers, reset freeSendBuffers here
@@ -580,10 +646,43 @@ SendBuffer *Network::ReleaseSendBuffer(SendBuffer *buffer)
 	return lastItem;
 }
 
+FileSendBuffer *Network::AllocateFileSendBuffer()
+{
+	FileSendBuffer *buffer = freeFileSendBuffers;
+	if (buffer != NULL)
+	{
+		freeFileSendBuffers = buffer->next;
+		buffer->next = NULL;
+		buffer->bytesUnacknowledged = 0;
+	}
+	return buffer;
+}
+
+// Return a file send buffer to the free list and return the one that followed it
+FileSendBuffer *Network::ReleaseFileSendBuffer(FileSendBuffer *buffer)
+{
+	FileSendBuffer *next = buffer->next;
+	buffer->next = freeFileSendBuffers;
+	freeFileSendBuffers = buffer;
+	return next;
+}
+
+// Record a file that has been sent and acknowledged completely, so that we can report the throughput
+void Network::FileSent(uint32_t bytes, float time)
+{
+	fileBytesSent += bytes;
+	fileSendTime += time;
+}
+
 void Network::SentPacketAcknowledged(ConnectionState *cs, unsigned int len)
 {
 	if (cs != NULL && sendingTransaction != NULL && cs == sendingTransaction->GetConnection())
 	{
+		// Data from the sending window is always written before any file data, so it is acknowledged first
+		const unsigned int windowAcknowledged = min<unsigned int>(len, windowDataOutstanding);
+		windowDataOutstanding -= windowAcknowledged;
+		sendingTransaction->FileDataAcknowledged(len - windowAcknowledged);
+
 		if (sentDataOutstanding > len)
 		{
 			sentDataOutstanding -= len;
@@ -591,7 +690,7 @@ void Network::SentPacketAcknowledged(ConnectionState *cs, unsigned int len)
 		else
 		{
 			sendingTransaction = NULL;
-			sentDataOutstanding = 0;
+			sentDataOutstanding = windowDataOutstanding = 0;
 		}
 	}
 
@@ -630,13 +729,18 @@ ConnectionState *Network::ConnectionAccepted(tcp_pcb *pcb)
 void Network::ConnectionClosed(ConnectionState* cs, bool closeConnection)
 {
 	// make sure these connections are not reused
-	if (cs == dataCs)
+	uint8_t dataSession = numFtpSessions;
+	for (size_t i = 0; i < numFtpSessions; i++)
 	{
-		dataCs = NULL;
-	}
-	if (cs == ftpCs)
-	{
-		ftpCs = NULL;
+		if (cs == dataCs[i])
+		{
+			dataCs[i] = NULL;
+			dataSession = i;
+		}
+		if (cs == ftpCs[i])
+		{
+			ftpCs[i] = NULL;
+		}
 	}
 	if (cs == telnetCs)
 	{
@@ -659,6 +763,12 @@ void Network::ConnectionClosed(ConnectionState* cs, bool closeConnection)
 		}
 	}
 
+	// If this was the data connection of an FTP session that wants its PASV port closed, we can do that now
+	if (dataSession < numFtpSessions && closingDataPort[dataSession])
+	{
+		close_pasv_port(dataSession);
+	}
+
 	// cs points to a connection state block that the caller is about to release, so we need to stop referring to it.
 	// There may be one NetworkTransaction in the writing or closing list referring to it, and possibly more than one in the ready list.
 
@@ -675,6 +785,7 @@ void Network::ConnectionClosed(ConnectionState* cs, bool closeConnection)
 		cs->sendingTransaction->SetConnectionLost();
 		cs->sendingTransaction = NULL;
 	}
+	ReleaseHeldInput(cs, false);
 
 	cs->next = freeConnections;
 	freeConnections = cs;
@@ -789,7 +900,8 @@ NetworkTransaction *Network::GetTransaction(const ConnectionState *cs)
 
 // Send the output data we already have, optionally with a file appended, then close the connection unless keepConnectionOpen is true.
 // The file may be too large for our buffer, so we may have to send it in multiple transactions.
-void Network::SendAndClose(FileStore *f, bool keepConnectionOpen)
+// If moreToFollow is true this is one part of a longer response, so any further requests from the client are held back until the last part.
+void Network::SendAndClose(FileStore *f, bool keepConnectionOpen, bool moreToFollow)
 {
 	NetworkTransaction *r = readyTransactions;
 	if (r == NULL)
@@ -822,24 +934,24 @@ void Network::SendAndClose(FileStore *f, bool keepConnectionOpen)
 		}
 		else
 		{
-			r->FreePbuf();
-			r->cs->persistConnection = keepConnectionOpen;
-			r->fileBeingSent = f;
-			r->status = dataSending;
-			if (f != NULL && r->sendBuffer == NULL)
+			if (moreToFollow)
 			{
-				SendBuffer *buf;
-				if (AllocateSendBuffer(buf))
-				{
-					r->sendBuffer = buf;
-					r->fileBeingSent = f;
-				}
-				else
+				KeepRemainingInput(r, true);
+			}
+			else
+			{
+				if (keepConnectionOpen)
 				{
-					r->fileBeingSent = NULL;
-//					debugPrintf("Could not allocate send buffer for file transfer!\n");
+					KeepRemainingInput(r, false);
 				}
+				ReleaseHeldInput(r->cs, keepConnectionOpen);
 			}
+			r->FreePbuf();
+			r->cs->persistConnection = keepConnectionOpen;
+			r->fileBeingSent = f;
+			r->fileBytesSent = 0;
+			r->fileStartTime = platform->Time();
+			r->status = dataSending;
 
 			NetworkTransaction *mySendingTransaction = r->cs->sendingTransaction;
 			if (mySendingTransaction == NULL)
@@ -863,6 +975,74 @@ void Network::SendAndClose(FileStore *f, bool keepConnectionOpen)
 	}
 }
 
+// If the client has sent more than the request we have just processed (e.g. pipelined HTTP requests in the same packet),
+// move the rest of its input into a new transaction at the head of the ready list, so that it is processed next.
+// Its response will be queued behind the one to the current request, because they share the same connection.
+// If hold is true, the response to the current request has more parts to come, so the input waits on the connection instead.
+void Network::KeepRemainingInput(NetworkTransaction *r, bool hold)
+{
+	if (r->pb == NULL || r->inputPointer >= r->pb->tot_len)
+	{
+		return;
+	}
+
+	NetworkTransaction *rn = freeTransactions;
+	if (rn == NULL)
+	{
+		platform->Message(HOST_MESSAGE, "Network: Could not keep pipelined request, no free transactions!\n");
+		return;
+	}
+	freeTransactions = rn->next;
+
+	rn->Set(r->pb, r->cs, dataReceiving);
+	rn->inputPointer = r->inputPointer;
+	rn->bufferLength = r->bufferLength;		// we will tell LWIP that it has been processed when rn is freed
+	r->pb = NULL;
+	r->bufferLength = 0;
+
+	if (hold)
+	{
+		AppendTransaction(&r->cs->heldInput, rn);
+	}
+	else
+	{
+		PrependTransaction(&readyTransactions, rn);
+	}
+}
+
+// The last part of a response has been sent, so put any input held back from the client at the head of the ready list,
+// in the order it arrived. If the connection is closing it will never be processed, so free it instead.
+void Network::ReleaseHeldInput(ConnectionState *cs, bool process)
+{
+	NetworkTransaction *held = cs->heldInput;
+	if (held == NULL)
+	{
+		return;
+	}
+	cs->heldInput = NULL;
+
+	if (process)
+	{
+		NetworkTransaction *last = held;
+		while (last->next != NULL)
+		{
+			last = last->next;
+		}
+		last->next = readyTransactions;
+		readyTransactions = held;
+	}
+	else
+	{
+		while (held != NULL)
+		{
+			NetworkTransaction *next = held->next;
+			held->SetConnectionLost();			// the PCB may already have gone, so don't tell LWIP about the data
+			AppendTransaction(&freeTransactions, held);
+			held = next;
+		}
+	}
+}
+
 // We have no data to write and we want to keep the current connection alive if possible.
 // That way we can speed up freeing the current NetworkTransaction.
 void Network::CloseTransaction()
@@ -903,34 +1083,52 @@ void Network::WaitForDataConection()
 	r->inputPointer = 0; // behave as if this request hasn't been processed yet
 }
 
-void Network::OpenDataPort(uint16_t port)
+// Open the PASV data port of an FTP session. Returns false if the port can't be used.
+bool Network::OpenDataPort(uint8_t session, uint16_t port)
 {
-	closingDataPort = false;
+	// The last data port of this session may not have been closed yet
+	close_pasv_port(session);
+
 	tcp_pcb* pcb = tcp_new();
-	tcp_bind(pcb, IP_ADDR_ANY, port);
-	ftp_pasv_pcb = tcp_listen(pcb);
-	tcp_accept(ftp_pasv_pcb, conn_accept);
+	if (pcb == NULL)
+	{
+		return false;
+	}
+	if (tcp_bind(pcb, IP_ADDR_ANY, port) != ERR_OK)
+	{
+		tcp_close(pcb);
+		return false;
+	}
+	tcp_pcb *listenPcb = tcp_listen(pcb);
+	if (listenPcb == NULL)
+	{
+		tcp_close(pcb);
+		return false;
+	}
+	ftp_pasv_pcbs[session] = listenPcb;
+	tcp_accept(listenPcb, conn_accept);
+	return true;
 }
 
-uint16_t Network::GetDataPort() const
+uint16_t Network::GetDataPort(uint8_t session) const
 {
-	return (closingDataPort || (ftp_pasv_pcb == NULL) ? 0 : ftp_pasv_pcb->local_port);
+	return (closingDataPort[session] || ftp_pasv_pcbs[session] == NULL) ? 0 : ftp_pasv_pcbs[session]->local_port;
 }
 
 // Close FTP data port and purge associated PCB
-void Network::CloseDataPort()
+void Network::CloseDataPort(uint8_t session)
 {
 	// See if it's already being closed
-	if (closingDataPort)
+	if (closingDataPort[session])
 	{
 		return;
 	}
-	closingDataPort = true;
+	closingDataPort[session] = true;
 
 	// Close remote connection of our data port or do it as soon as the current transaction has finished
-	if (dataCs != NULL && dataCs->pcb != NULL)
+	if (dataCs[session] != NULL && dataCs[session]->pcb != NULL)
 	{
-		NetworkTransaction *mySendingTransaction = dataCs->sendingTransaction;
+		NetworkTransaction *mySendingTransaction = dataCs[session]->sendingTransaction;
 		if (mySendingTransaction != NULL)
 		{
 			mySendingTransaction->Close();
@@ -939,24 +1137,18 @@ void Network::CloseDataPort()
 	}
 
 	// We can close it now, so do it here
-	if (ftp_pasv_pcb != NULL)
-	{
-		tcp_accept(ftp_pasv_pcb, NULL);
-		tcp_close(ftp_pasv_pcb);
-		ftp_pasv_pcb = NULL;
-	}
-	closingDataPort = false;
+	close_pasv_port(session);
 }
 
 // These methods keep track of our connections in case we need to send to one of them
-void Network::SaveDataConnection()
+void Network::SaveDataConnection(uint8_t session)
 {
-	dataCs = readyTransactions->cs;
+	dataCs[session] = readyTransactions->cs;
 }
 
-void Network::SaveFTPConnection()
+void Network::SaveFTPConnection(uint8_t session)
 {
-	ftpCs = readyTransactions->cs;
+	ftpCs[session] = readyTransactions->cs;
 }
 
 void Network::SaveTelnetConnection()
@@ -974,14 +1166,14 @@ bool Network::CanAcquireTransaction()
 	return (freeSendBuffers != NULL);
 }
 
-bool Network::AcquireFTPTransaction()
+bool Network::AcquireFTPTransaction(uint8_t session)
 {
-	return AcquireTransaction(ftpCs);
+	return AcquireTransaction(ftpCs[session]);
 }
 
-bool Network::AcquireDataTransaction()
+bool Network::AcquireDataTransaction(uint8_t session)
 {
-	return AcquireTransaction(dataCs);
+	return AcquireTransaction(dataCs[session]);
 }
 
 bool Network::AcquireTelnetTransaction()
@@ -989,6 +1181,11 @@ bool Network::AcquireTelnetTransaction()
 	return AcquireTransaction(telnetCs);
 }
 
+bool Network::AcquireStreamTransaction(ConnectionState *cs)
+{
+	return AcquireTransaction(cs);
+}
+
 // Retrieves the NetworkTransaction of a sending connection to which data can be appended to,
 // or prepares a released NetworkTransaction, which can easily be sent via SendAndClose.
 bool Network::AcquireTransaction(ConnectionState *cs)
@@ -1074,6 +1271,7 @@ void ConnectionState::Init(tcp_pcb *p)
 	pcb = p;
 	next = NULL;
 	sendingTransaction = NULL;
+	heldInput = NULL;
 	persistConnection = true;
 }
 
@@ -1106,6 +1304,9 @@ void NetworkTransaction::Set(pbuf *p, ConnectionState *c, TransactionStatus s)
 	inputPointer = 0;
 	sendBuffer = NULL;
 	fileBeingSent = NULL;
+	fileBuffers = NULL;
+	readAheadBuffer = NULL;
+	fileBytesSent = 0;
 	closeRequested = false;
 	nextWrite = NULL;
 	lastWriteTime = NAN;
@@ -1317,7 +1518,8 @@ void NetworkTransaction::Printf(const char* fmt, ...)
 	Write(tempString, len);
 }
 
-// Send exactly one TCP window of data or return true if we can free up this object
+// Send exactly one TCP window of data from the SendBuffers, keep LWIP supplied with file data,
+// or return true if we can free up this object
 bool NetworkTransaction::Send()
 {
 	// Free up this transaction if we either lost our connection or are supposed to close it now
@@ -1336,26 +1538,33 @@ bool NetworkTransaction::Send()
 			sendBuffer = net->ReleaseSendBuffer(sendBuffer);
 		}
 
-		if (!LostConnection())
+		if (readAheadBuffer != NULL)
 		{
-//			debugPrintf("NetworkTransaction is closing connection cs=%08x\n", (unsigned int)cs);
-			reprap.GetNetwork()->ConnectionClosed(cs, true);
+			net->ReleaseFileSendBuffer(readAheadBuffer);
+			readAheadBuffer = NULL;
 		}
 
-		if (closingDataPort)
+		if (fileBuffers != NULL)
 		{
-			if (ftp_pasv_pcb != NULL)
+			// LWIP may still refer to file data that hasn't been acknowledged, so drop the connection before we reuse the buffers
+			if (!LostConnection())
 			{
-				tcp_accept(ftp_pasv_pcb, NULL);
-				tcp_close(ftp_pasv_pcb);
-				ftp_pasv_pcb = NULL;
+				tcp_abort(cs->pcb);
+			}
+			while (fileBuffers != NULL)
+			{
+				fileBuffers = net->ReleaseFileSendBuffer(fileBuffers);
 			}
+		}
 
-			closingDataPort = false;
+		if (!LostConnection())
+		{
+//			debugPrintf("NetworkTransaction is closing connection cs=%08x\n", (unsigned int)cs);
+			reprap.GetNetwork()->ConnectionClosed(cs, true);
 		}
 
 		sendingTransaction = NULL;
-		sentDataOutstanding = 0;
+		sentDataOutstanding = windowDataOutstanding = 0;
 
 		return true;
 	}
@@ -1373,6 +1582,11 @@ bool NetworkTransaction::Send()
 				tcp_abort(cs->pcb);
 				cs->pcb = NULL;
 			}
+			else if (sendBuffer == NULL && (fileBeingSent != NULL || readAheadBuffer != NULL))
+			{
+				// File buffers are released as they are acknowledged, so we may be able to queue some more
+				SendFileData();
+			}
 			return false;
 		}
 	}
@@ -1383,7 +1597,7 @@ bool NetworkTransaction::Send()
 
 	// See if we can fill up the TCP window with some data chunks from our SendBuffer instances
 
-	uint16_t bytesBeingSent = 0, bytesLeftToSend = TCP_WND;
+	uint16_t bytesBeingSent = 0, bytesLeftToSend = min<uint16_t>(TCP_SND_BUF, tcp_sndbuf(cs->pcb));
 	while (sendBuffer != NULL && bytesLeftToSend >= sendBuffer->bytesToWrite)
 	{
 		memcpy(sendingWindow + bytesBeingSent, sendBuffer->tcpOutputBuffer, sendBuffer->bytesToWrite);
@@ -1392,33 +1606,15 @@ bool NetworkTransaction::Send()
 		sendBuffer = reprap.GetNetwork()->ReleaseSendBuffer(sendBuffer);
 	}
 
-	// We also intend to send a file, so check if we can fill up the TCP window
-
-	if (sendBuffer == NULL)
+	if (!bytesBeingSent && fileBeingSent == NULL && readAheadBuffer == NULL)
 	{
-		int bytesRead;
-		size_t bytesToRead;
-		while (bytesLeftToSend && fileBeingSent != NULL)
+		if (fileBytesSent != 0)
 		{
-			bytesToRead = min<size_t>(256, bytesLeftToSend);  // FIXME: doesn't work with higher block sizes
-			bytesRead = fileBeingSent->Read(sendingWindow + bytesBeingSent, bytesToRead);
-
-			if (bytesRead > 0)
-			{
-				bytesBeingSent += bytesRead;
-				bytesLeftToSend = TCP_WND - bytesBeingSent;
-			}
-
-			if (bytesRead != bytesToRead)
-			{
-				fileBeingSent->Close();
-				fileBeingSent = NULL;
-			}
+			// Everything we read from the file has now been acknowledged
+			reprap.GetNetwork()->FileSent(fileBytesSent, reprap.GetPlatform()->Time() - fileStartTime);
+			fileBytesSent = 0;
 		}
-	}
 
-	if (!bytesBeingSent)
-	{
 		// If we have no data to send and fileBeingSent is NULL, we can close the connection
 		if (!cs->persistConnection && nextWrite == NULL)
 		{
@@ -1429,7 +1625,8 @@ bool NetworkTransaction::Send()
 		// We want to send data from another transaction, so only free up this one
 		return true;
 	}
-	else
+
+	if (bytesBeingSent)
 	{
 		// The TCP window has been filled up as much as possible, so send it now. There is no need to check
 		// the available space in the SNDBUF queue, because we really write only one TCP window at once.
@@ -1440,19 +1637,144 @@ bool NetworkTransaction::Send()
 			reprap.GetPlatform()->Message(HOST_MESSAGE, "Network: tcp_write returned error code %d, this should never happen!\n", result);
 			tcp_abort(cs->pcb);
 			cs->pcb = NULL;
+			return false;
 		}
-		else
+
+		sendingTransaction = this;
+		sendingRetries = 0;
+		sendingWindowSize = sentDataOutstanding = windowDataOutstanding = bytesBeingSent;
+		lastWriteTime = reprap.GetPlatform()->Time();
+	}
+
+	// If all the SendBuffers have gone, follow them with as much of the file as LWIP will take
+	if (sendBuffer == NULL && (fileBeingSent != NULL || readAheadBuffer != NULL))
+	{
+		SendFileData();
+	}
+	if (cs->pcb != NULL)
+	{
+		tcp_output(cs->pcb);
+	}
+	return false;
+}
+
+// Pass file data to LWIP without copying it, for as long as LWIP has room for full segments. Each buffer is one MSS,
+// so LWIP can send it as a full segment. This is called again as soon as acknowledgements free up some space, and once
+// LWIP is full we read the next buffer from the SD card while the data already queued is on its way.
+void NetworkTransaction::SendFileData()
+{
+	tcp_pcb *pcb = cs->pcb;
+	bool dataQueued = false;
+
+	for (;;)
+	{
+		if (readAheadBuffer == NULL)
 		{
-			sendingTransaction = this;
-			sendingRetries = 0;
-			sendingWindowSize = sentDataOutstanding = bytesBeingSent;
+			ReadFileData();
+			if (readAheadBuffer == NULL)
+			{
+				break;
+			}
+		}
 
-			lastWriteTime = reprap.GetPlatform()->Time();
+		const unsigned int length = readAheadBuffer->bytesUnacknowledged;
+		if (tcp_sndbuf(pcb) < length || tcp_sndqueuelen(pcb) + 2 > TCP_SND_QUEUELEN)
+		{
+			break;
+		}
 
-			tcp_output(cs->pcb);
+		tcp_sent(pcb, conn_sent);
+		err_t result = tcp_write(pcb, readAheadBuffer->data, length, (fileBeingSent != NULL) ? TCP_WRITE_FLAG_MORE : 0);
+		if (result == ERR_MEM)
+		{
+			// LWIP is short of memory for the segment headers, so keep this buffer and try again later
+			break;
+		}
+		if (result != ERR_OK)
+		{
+			reprap.GetPlatform()->Message(HOST_MESSAGE, "Network: tcp_write of file data returned error code %d\n", result);
+			tcp_abort(pcb);
+			cs->pcb = NULL;
+			return;
+		}
+
+		// Keep the buffers in the order they were written, because they are acknowledged in that order
+		FileSendBuffer **tail = &fileBuffers;
+		while (*tail != NULL)
+		{
+			tail = &((*tail)->next);
+		}
+		*tail = readAheadBuffer;
+		readAheadBuffer = NULL;
+
+		sentDataOutstanding += length;
+		fileBytesSent += length;
+		dataQueued = true;
+	}
+
+	if (dataQueued)
+	{
+		sendingTransaction = this;
+		sendingRetries = 0;
+		lastWriteTime = reprap.GetPlatform()->Time();
+		tcp_output(pcb);
+	}
+
+	// Read the next buffer now, so that it is ready as soon as LWIP has room for it
+	if (readAheadBuffer == NULL)
+	{
+		ReadFileData();
+	}
+}
+
+// Read the next MSS of the file we are sending into the read-ahead buffer. FatFs reads whole sectors straight from
+// the SD card into it, so most of the data is never copied at all.
+void NetworkTransaction::ReadFileData()
+{
+	if (fileBeingSent == NULL)
+	{
+		return;
+	}
+
+	Network *net = reprap.GetNetwork();
+	FileSendBuffer *buf = net->AllocateFileSendBuffer();
+	if (buf == NULL)
+	{
+		return;
+	}
+
+	const int bytesRead = fileBeingSent->Read(buf->data, TCP_MSS);
+	if (bytesRead != TCP_MSS)
+	{
+		fileBeingSent->Close();
+		fileBeingSent = NULL;
+	}
+
+	if (bytesRead > 0)
+	{
+		buf->bytesUnacknowledged = bytesRead;
+		readAheadBuffer = buf;
+	}
+	else
+	{
+		net->ReleaseFileSendBuffer(buf);
+	}
+}
+
+// Some of the file data we gave to LWIP has been acknowledged, so free the buffers that have been completely
+void NetworkTransaction::FileDataAcknowledged(unsigned int len)
+{
+	Network *net = reprap.GetNetwork();
+	while (len != 0 && fileBuffers != NULL)
+	{
+		const unsigned int acknowledged = min<unsigned int>(len, fileBuffers->bytesUnacknowledged);
+		fileBuffers->bytesUnacknowledged -= acknowledged;
+		len -= acknowledged;
+		if (fileBuffers->bytesUnacknowledged == 0)
+		{
+			fileBuffers = net->ReleaseFileSendBuffer(fileBuffers);
 		}
 	}
-	return false;
 }
 
 void NetworkTransaction::SetConnectionLost()
@@ -1505,4 +1827,116 @@ void NetworkTransaction::FreePbuf()
 	}
 }
 
+// ChunkedWriter class
+
+void ChunkedWriter::catc(char c)
+{
+	if (length == ARRAY_SIZE(buffer))
+	{
+		Flush();
+	}
+	buffer[length++] = c;
+}
+
+void ChunkedWriter::cat(const char *s)
+{
+	while (*s != 0)
+	{
+		catc(*s++);
+	}
+}
+
+// Format text straight into the buffer. If it doesn't fit, write out what we have and try again.
+void ChunkedWriter::catf(const char *fmt, ...)
+{
+	for (;;)
+	{
+		const size_t space = ARRAY_SIZE(buffer) - length;
+		va_list p;
+		va_start(p, fmt);
+		const int len = vsnprintf(buffer + length, space, fmt, p);
+		va_end(p);
+
+		if (len >= 0 && (size_t)len < space)
+		{
+			length += len;
+			return;
+		}
+		if (length == 0)
+		{
+			length = ARRAY_UPB(buffer);		// too long for one chunk, so truncate it
+			return;
+		}
+		Flush();
+	}
+}
+
+// Append a string in quotes, escaping the characters that JSON needs escaped and dropping other control characters
+void ChunkedWriter::catEncoded(const char *s)
+{
+	catc('"');
+	for (char c = *s; c != 0; c = *++s)
+	{
+		char esc;
+		switch (c)
+		{
+			case '\r':
+				esc = 'r';
+				break;
+			case '\n':
+				esc = 'n';
+				break;
+			case '\t':
+				esc = 't';
+				break;
+			case '"':
+				esc = '"';
+				break;
+			case '\\':
+				esc = '\\';
+				break;
+			default:
+				esc = 0;
+				break;
+		}
+		if (esc != 0)
+		{
+			catc('\\');
+			catc(esc);
+		}
+		else if (c >= ' ')
+		{
+			catc(c);
+		}
+	}
+	catc('"');
+}
+
+// Check whether another 'len' bytes of text can be written, allowing for the chunk headers
+bool ChunkedWriter::HasSpace(size_t len) const
+{
+	const size_t bytesNeeded = length + len + 2 * (len/chunkedWriterBufferSize + 2) * 8;
+	return bytesNeeded <= reprap.GetNetwork()->SendBufferSpace();
+}
+
+// Write the collected text as one chunk
+void ChunkedWriter::Flush()
+{
+	if (length != 0)
+	{
+		char chunkHeader[12];
+		snprintf(chunkHeader, ARRAY_SIZE(chunkHeader), "%x\r\n", (unsigned int)length);
+		transaction->Write(chunkHeader);
+		transaction->Write(buffer, length);
+		transaction->Write("\r\n");
+		length = 0;
+	}
+}
+
+void ChunkedWriter::Finish()
+{
+	Flush();
+	transaction->Write("0\r\n\r\n");
+}
+
 // End
@@ -21,6 +21,7 @@ Separated out from Platform.h by dc42 and extended by zpl
 
 const uint16_t ftpPort = 21;
 const uint16_t telnetPort = 23;
+const uint8_t numFtpSessions = 3;							// number of FTP clients that can be logged in at the same time, each with its own PASV port
 
 // The size of the TCP output buffer is critical to getting fast load times in the browser.
 // If this value is less than the TCP MSS, then Chrome under Windows will delay ack messages by about 120ms,
@@ -30,11 +31,17 @@ const uint16_t telnetPort = 23;
 // Currently we set the MSS (in file network/lwipopts.h) to 1432 which matches the value used by most versions of Windows
 // and therefore avoids additional memory use and fragmentation.
 
-const uint16_t tcpOutputBufferCount = 20;					// number of send buffers
-const uint16_t tcpOutputBufferSize = 358;					// size of each send buffer (MUST be 1/n-th of TCP_WND)
+const uint16_t tcpOutputBufferSize = 358;					// size of each send buffer (MUST be 1/n-th of TCP_SND_BUF)
+const uint16_t tcpOutputBufferCount = TCP_SND_BUF/tcpOutputBufferSize + 4;	// number of send buffers (one full window plus some spare)
 const uint8_t numConnections = 16;							// number of ConnectionState instances
 const uint8_t networkTransactionCount = 24;					// number of NetworkTransactions to be used for network IO
 const float writeTimeout = 4.0;	 							// seconds to wait for data we have written to be acknowledged
+const uint16_t chunkedWriterBufferSize = 256;				// amount of text collected by a ChunkedWriter before it writes a chunk
+
+// Files are read into buffers of one TCP MSS, which LWIP sends by reference instead of copying. Enough of them
+// to fill the TCP send buffer keeps the connection busy while earlier ones wait to be acknowledged, and one more
+// lets us read ahead from the SD card while the others are in flight.
+const uint8_t fileSendBufferCount = TCP_SND_BUF/TCP_MSS + 1;	// number of file send buffers
 
 #define IP_ADDRESS {192, 168, 1, 10} // Need some sort of default...
 #define NET_MASK {255, 255, 255, 0}
@@ -49,6 +56,7 @@ struct pbuf;
 
 class NetworkTransaction;
 class SendBuffer;
+class FileSendBuffer;
 
 // ConnectionState structure that we use to track TCP connections. It is usually combined with NetworkTransactions.
 struct ConnectionState
@@ -56,6 +64,7 @@ struct ConnectionState
 	tcp_pcb *pcb;								// connection PCB
 	NetworkTransaction *sendingTransaction;		// NetworkTransaction that is currently sending via this connection
 	ConnectionState *next;						// next ConnectionState in this list
+	NetworkTransaction * volatile heldInput;	// pipelined input held back until the response being sent in parts is complete
 	bool persistConnection;						// do we expect this connection to stay alive?
 
 	void Init(tcp_pcb *p);
@@ -103,6 +112,9 @@ public:
 private:
 	void Close();
 	void FreePbuf();
+	void SendFileData();
+	void ReadFileData();
+	void FileDataAcknowledged(unsigned int len);
 
 	ConnectionState* cs;
 	NetworkTransaction* volatile next;			// next NetworkTransaction in the list we are in
@@ -113,6 +125,10 @@ private:
 
 	SendBuffer *sendBuffer;
 	FileStore *fileBeingSent;
+	FileSendBuffer *fileBuffers;				// file data given to LWIP and not yet acknowledged, oldest first
+	FileSendBuffer *readAheadBuffer;			// file data read from the SD card but not yet given to LWIP
+	uint32_t fileBytesSent;						// for measuring the transfer rate
+	float fileStartTime;
 
 	TransactionStatus status;
 	float lastWriteTime;
@@ -136,6 +152,44 @@ class SendBuffer
 		char tcpOutputBuffer[tcpOutputBufferSize];
 };
 
+// This class holds file data that has been passed to LWIP by reference. It must not be reused until it has been acknowledged.
+class FileSendBuffer
+{
+	public:
+		friend class Network;
+		friend class NetworkTransaction;
+
+		FileSendBuffer(FileSendBuffer *n) : next(n) { };
+
+	private:
+		FileSendBuffer *next;
+
+		uint16_t bytesUnacknowledged;
+		char data[TCP_MSS] __attribute__((aligned(4)));		// word aligned so that the SD card DMA can write to it directly
+};
+
+
+// Writes an HTTP response body of unknown length to a NetworkTransaction using chunked transfer encoding.
+// Text is collected in a small buffer and written to the SendBuffers one chunk at a time, so large responses
+// don't need a large buffer on the stack. Use HasSpace() to check that the SendBuffers can take more text.
+class ChunkedWriter
+{
+public:
+	ChunkedWriter(NetworkTransaction *t) : transaction(t), length(0) { }
+	void cat(const char *s);
+	void catf(const char *fmt, ...);
+	void catEncoded(const char *s);			// append a quoted JSON string
+	bool HasSpace(size_t len) const;
+	void Flush();
+	void Finish();							// write the remaining text and the final empty chunk
+
+private:
+	void catc(char c);
+
+	NetworkTransaction *transaction;
+	size_t length;
+	char buffer[chunkedWriterBufferSize];
+};
 
 // The main network class that drives the network.
 class Network
@@ -151,22 +205,24 @@ public:
 	void ConnectionClosedGracefully(ConnectionState *cs);
 
 	NetworkTransaction *GetTransaction(const ConnectionState *cs = NULL);
-	void SendAndClose(FileStore *f, bool keepConnectionOpen = false);
+	void SendAndClose(FileStore *f, bool keepConnectionOpen = false, bool moreToFollow = false);
 	void CloseTransaction();
 	void WaitForDataConection();
 
-	void OpenDataPort(uint16_t port);
-	uint16_t GetDataPort() const;
-	void CloseDataPort();
+	bool OpenDataPort(uint8_t session, uint16_t port);
+	uint16_t GetDataPort(uint8_t session) const;
+	void CloseDataPort(uint8_t session);
 
-	void SaveDataConnection();
-	void SaveFTPConnection();
+	void SaveDataConnection(uint8_t session);
+	void SaveFTPConnection(uint8_t session);
 	void SaveTelnetConnection();
 
 	bool CanAcquireTransaction();
-	bool AcquireFTPTransaction();
-	bool AcquireDataTransaction();
+	size_t SendBufferSpace() const;
+	bool AcquireFTPTransaction(uint8_t session);
+	bool AcquireDataTransaction(uint8_t session);
 	bool AcquireTelnetTransaction();
+	bool AcquireStreamTransaction(ConnectionState *cs);
 
 	Network(Platform* p);
 	void Init();
@@ -194,10 +250,15 @@ private:
 
 	void AppendTransaction(NetworkTransaction* volatile * list, NetworkTransaction *r);
 	void PrependTransaction(NetworkTransaction* volatile * list, NetworkTransaction *r);
+	void KeepRemainingInput(NetworkTransaction *r, bool hold);
+	void ReleaseHeldInput(ConnectionState *cs, bool process);
 	bool AcquireTransaction(ConnectionState *cs);
 
 	bool AllocateSendBuffer(SendBuffer *&buffer);
 	SendBuffer *ReleaseSendBuffer(SendBuffer *buffer);
+	FileSendBuffer *AllocateFileSendBuffer();
+	FileSendBuffer *ReleaseFileSendBuffer(FileSendBuffer *buffer);
+	void FileSent(uint32_t bytes, float time);
 
 	NetworkTransaction * volatile freeTransactions;
 	NetworkTransaction * volatile readyTransactions;
@@ -208,13 +269,17 @@ private:
 	bool volatile readingData;
 	char hostname[16];			// limit DHCP hostname to 15 characters + terminating 0
 
-	ConnectionState *dataCs;
-	ConnectionState *ftpCs;
+	ConnectionState *dataCs[numFtpSessions];
+	ConnectionState *ftpCs[numFtpSessions];
 	ConnectionState *telnetCs;
 
 	ConnectionState * volatile freeConnections;
 
 	SendBuffer *freeSendBuffers;
+	FileSendBuffer *freeFileSendBuffers;
+
+	uint32_t fileBytesSent;			// totals for files we have finished sending, to report the throughput
+	float fileSendTime;
 };
 
 #endif
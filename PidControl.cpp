@@ -0,0 +1,68 @@
+/****************************************************************************************************
+
+RepRapFirmware - PidControl
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include "Configuration.h"
+#include "PidControl.h"
+
+// Take the gains as M301 sets them and precalculate the scaled ones, so that Calculate doesn't have to divide
+void PidControlBlock::SetGains(float p, float i, float d, float t, float s, float band, float minResult, float maxResult, float interval)
+{
+	sampleInterval = interval;
+	pwmAverageFactor = interval / HEAT_PWM_AVERAGE_TIME;
+	pwmAverageDecay = 1.0 - pwmAverageFactor;
+	kP = p;
+	kISample = i * interval;
+	kDSample = d / interval;
+	kT = t;
+	kS = s;
+	pwmToResult = (s > 0.0) ? 255.0 / s : 0.0;
+	resultToPwm = s * (1.0/255.0);
+	fullBand = band;
+	pidMin = minResult;
+	pidMax = maxResult;
+}
+
+// Run the controller for one sample and return the heater PWM. iState holds the integral term between samples.
+// If we have a thermal model, the feed-forward PWM provides the steady-state power and the I term only has to correct the model.
+float PidControlBlock::Calculate(float target, float temperature, float lastTemperature, bool useModel, float feedForward, float& iState) const
+{
+	const float error = target - temperature;
+	if (error < -fullBand)
+	{
+		// actual temperature is well above target
+		iState = (useModel) ? 0.0 : (target + fullBand - 25.0) * kT;	// set the I term to our estimate of what will be needed ready for the switch to PID
+		return 0.0;
+	}
+	if (error > fullBand)
+	{
+		// actual temperature is well below target
+		iState = (useModel) ? 0.0 : (target - fullBand - 25.0) * kT;	// set the I term to our estimate of what will be needed ready for the switch to PID
+		return kS;
+	}
+
+	const float feedForwardResult = (useModel) ? feedForward * pwmToResult : 0.0;
+	iState += error * kISample;
+	if (iState < pidMin - feedForwardResult)
+	{
+		iState = pidMin - feedForwardResult;
+	}
+	else if (iState > pidMax - feedForwardResult)
+	{
+		iState = pidMax - feedForwardResult;
+	}
+
+	// Legacy - old RepRap PID parameters were set to give values in [0, 255] for 1 byte PWM control
+	const float result = feedForwardResult + kP * error + iState - kDSample * (temperature - lastTemperature);
+	return (result <= 0.0) ? 0.0
+			: (result >= 255.0) ? kS
+				: result * resultToPwm;
+}
+
+// End
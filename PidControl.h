@@ -0,0 +1,52 @@
+/****************************************************************************************************
+
+RepRapFirmware - PidControl
+
+The arithmetic of the heater PID controller. Nothing in here depends on the hardware, so that it can
+also be built and tested on the host (see Tests).
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef PIDCONTROL_H
+#define PIDCONTROL_H
+
+// Parameters for detecting a heater that does not heat as fast as it should
+
+struct HeaterFaultParameters
+{
+	float period;						// Seconds over which the temperature rise is measured
+	float fraction;						// Fault if the rise is less than this fraction of the expected rise
+	float rate;							// Rise in Celsius/sec expected at full power if the heater has no thermal model
+};
+
+/**
+ * Constants that the PID controller derives from the heater parameters. They are recalculated only when the
+ * parameters change (M301, M305, M570 etc.), so that PID::Spin doesn't fetch and rescale them every sample.
+ */
+
+struct PidControlBlock
+{
+    bool usePid;									// False for bang-bang control
+    float sampleInterval;							// Seconds between calls to Spin
+    float pwmAverageFactor;							// Weight of each sample in the running average PWM
+    float pwmAverageDecay;							// 1 - pwmAverageFactor
+    bool checkTimeToHot;							// Apply the TimeToHot backstop? Only for hot ends
+    float kP;										// Proportional gain
+    float kISample;									// Integral gain times the sample interval
+    float kDSample;									// Derivative gain divided by the sample interval
+    float kT;										// Steady-state PID output per degree above ambient
+    float kS;										// PWM at full PID output
+    float pwmToResult;								// 255/kS, to convert a PWM into PID output units
+    float resultToPwm;								// kS/255, to convert PID output into a PWM
+    float fullBand, pidMin, pidMax;
+    HeaterFaultParameters fault;					// Heating rate fault detection
+
+    void SetGains(float p, float i, float d, float t, float s, float band, float minResult, float maxResult, float interval);
+    float Calculate(float target, float temperature, float lastTemperature, bool useModel, float feedForward, float& iState) const;
+};
+
+#endif
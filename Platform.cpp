@@ -96,7 +96,7 @@ bool PidParameters::operator==(const PidParameters& other) const
 // Platform class
 
 Platform::Platform() :
-		tickState(0), fileStructureInitialised(false), active(false), errorCodeBits(0), debugCode(0),
+		fileStructureInitialised(false), active(false), errorCodeBits(0), debugCode(0),
 		messageString(messageStringBuffer, ARRAY_SIZE(messageStringBuffer)), autoSaveEnabled(false)
 {
 	line = new Line(SerialUSB);
@@ -149,6 +149,9 @@ void Platform::Init()
 		files[file]->Init();
 	}
 
+	macroCacheUsed = 0;
+	InvalidateMacroCache();
+
 	fileStructureInitialised = true;
 
 	mcpDuet.begin(); //only call begin once in the entire execution, this begins the I2C comms on that channel for all objects
@@ -203,6 +206,13 @@ void Platform::Init()
 	coolingFanPin = COOLING_FAN_PIN;
 	coolingFanRpmPin = COOLING_FAN_RPM_PIN;
 	timeToHot = TIME_TO_HOT;
+	for (size_t heater = 0; heater < HEATERS; heater++)
+	{
+		SetDefaultHeaterFaultParameters(heater, (int)heater == HOT_BED);
+		heaterZoneLeaders[heater] = -1;
+		heaterSampleMultiples[heater] = ((int)heater == HOT_BED) ? BED_SAMPLE_MULTIPLE : 1;
+	}
+	heaterStaggerTime = HEATER_STAGGER_TIME;
 	lastRpmResetTime = 0.0;
 
 	webDir = WEB_DIR;
@@ -238,6 +248,7 @@ void Platform::Init()
 
 	extrusionAncilliaryPWM = 0.0;
 
+	heaterPwmPending = 0;
 	for (size_t heater = 0; heater < HEATERS; heater++)
 	{
 		if (heatOnPins[heater] >= 0)
@@ -245,16 +256,12 @@ void Platform::Init()
 			digitalWrite(heatOnPins[heater], HIGH);	// turn the heater off
 			pinMode(heatOnPins[heater], OUTPUT);
 		}
+		heaterPwmFrequencies[heater] = DEFAULT_HEATER_PWM_FREQUENCY;
+		InitialiseHeaterPwm(heater);
 		analogReadResolution(12);
 		thermistorFilters[heater].Init(analogRead(tempSensePins[heater]));
 		heaterAdcChannels[heater] = PinToAdcChannel(tempSensePins[heater]);
-
-		// Calculate and store the ADC average sum that corresponds to an overheat condition, so that we can check is quickly in the tick ISR
-		float thermistorOverheatResistance = nvData.pidParams[heater].GetRInf()
-				* exp(-nvData.pidParams[heater].GetBeta() / (BAD_HIGH_TEMPERATURE - ABS_ZERO));
-		float thermistorOverheatAdcValue = (adRangeReal + 1) * thermistorOverheatResistance
-				/ (thermistorOverheatResistance + nvData.pidParams[heater].thermistorSeriesR);
-		thermistorOverheatSums[heater] = (uint32_t) (thermistorOverheatAdcValue + 0.9) * numThermistorReadingsAveraged;
+		UpdateThermistorTable(heater);
 	}
 
 	if (coolingFanPin >= 0)
@@ -318,7 +325,7 @@ void Platform::InitZProbe()
 
 int Platform::GetRawZHeight() const
 {
-	return (nvData.zProbeType != 0) ? analogRead(zProbePin) : 0;
+	return (nvData.zProbeType != 0) ? lastZProbeReading : 0;
 }
 
 // Return the Z probe data.
@@ -543,6 +550,7 @@ void Platform::ResetNvData()
 		pp.pidMin = defaultPidMins[i];
 		pp.pidMax = defaultPidMaxes[i];
 		pp.adcLowOffset = pp.adcHighOffset = 0.0;
+		UpdateThermistorTable(i);
 	}
 
 #ifdef FLASH_SAVE_ENABLED
@@ -560,6 +568,13 @@ void Platform::ReadNvData()
 		ResetNvData();
 		// No point in writing it back here
 	}
+	else
+	{
+		for (size_t heater = 0; heater < HEATERS; ++heater)
+		{
+			UpdateThermistorTable(heater);
+		}
+	}
 #else
 	Message(BOTH_ERROR_MESSAGE, "Cannot load non-volatile data, because Flash support has been disabled!\n");
 #endif
@@ -606,6 +621,18 @@ float Platform::Time()
 	return addToTime + TIME_FROM_REPRAP * (float) now;
 }
 
+// Read a number from the SAM3X true random number generator. It takes 84 clocks to produce each one.
+uint32_t Platform::GetTrueRandom()
+{
+	pmc_enable_periph_clk(ID_TRNG);
+	TRNG->TRNG_CR = TRNG_CR_KEY(0x524e47) | TRNG_CR_ENABLE;
+	while ((TRNG->TRNG_ISR & TRNG_ISR_DATRDY) == 0) {}
+	const uint32_t result = TRNG->TRNG_ODATA;
+	TRNG->TRNG_CR = TRNG_CR_KEY(0x524e47);
+	pmc_disable_periph_clk(ID_TRNG);
+	return result;
+}
+
 void Platform::Exit()
 {
 	Message(BOTH_MESSAGE, "Platform class exited.\n");
@@ -682,6 +709,12 @@ void Platform::Spin()
 		for (;;) {}
 	}
 
+	ProcessAdcBlocks();
+	if (heaterPwmPending != 0)
+	{
+		FinishHeaterPwm();
+	}
+
 	line->Spin();
 	aux->Spin();
 
@@ -747,6 +780,11 @@ void TC4_Handler()
 	reprap.GetNetwork()->Interrupt();
 }
 
+void ADC_Handler()
+{
+	reprap.GetPlatform()->AdcInterrupt();
+}
+
 void FanInterrupt()
 {
 	++fanInterruptCount;
@@ -783,9 +821,8 @@ void Platform::InitialiseInterrupts()
 	// Interrupt for 4-pin PWM fan sense line
 	attachInterrupt(coolingFanRpmPin, FanInterrupt, FALLING);
 
-	// Tick interrupt for ADC conversions
-	tickState = 0;
-	currentHeater = 0;
+	// Timer-triggered ADC scans with PDC transfers
+	InitialiseAdc();
 
 	active = true;							// this enables the tick interrupt, which keeps the watchdog happy
 }
@@ -811,96 +848,240 @@ void Platform::SetInterrupt(float s) // Seconds
 ///	NVIC_DisableIRQ(TC4_IRQn);
 //}
 
-// Process a 1ms tick interrupt
-// This function must be kept fast so as not to disturb the stepper timing, so don't do any floating point maths in here.
-// This is what we need to do:
-// 0.  Kick the watchdog.
-// 1.  Kick off a new ADC conversion.
-// 2.  Fetch and process the result of the last ADC conversion.
-// 3a. If the last ADC conversion was for the Z probe, toggle the modulation output if using a modulated IR sensor.
-// 3b. If the last ADC reading was a thermistor reading, check for an over-temperature situation and turn off the heater if necessary.
-//     We do this here because the usual polling loop sometimes gets stuck trying to send data to the USB port.
-
-//#define TIME_TICK_ISR	1		// define this to store the tick ISR time in errorCodeBits
+// Set up the ADC to scan all the thermistor channels and the Z probe channel each time TC0 channel 0 fires.
+// The results are tagged with their channel numbers and the PDC transfers them into a ring of blocks.
 
-void Platform::Tick()
+void Platform::InitialiseAdc()
 {
-#ifdef TIME_TICK_ISR
-	uint32_t now = micros();
-#endif
-	switch (tickState)
+	adc_disable_all_channel(ADC);
+	for (size_t thermistor = 0; thermistor < HEATERS; ++thermistor)
 	{
-	case 1:			// last conversion started was a thermistor
-	case 3:
+		adc_enable_channel(ADC, PinToAdcChannel(tempSensePins[thermistor]));
+	}
+	adc_enable_channel(ADC, zProbeAdcChannel);
+	adcWordsPerBlock = adcScansPerBlock * __builtin_popcount(ADC->ADC_CHSR);
+	adc_enable_tag(ADC);
+	adc_configure_trigger(ADC, ADC_TRIG_TIO_CH_0, 0);
+
+	lastZProbeReading = 0;
+	zProbeArmed = zProbeTriggered = false;
+	zProbeMatches = 0;
+	zProbeWindowTriggers = 0;
+	adcBlocksFilled = adcBlocksProcessed = 0;
+	adcOverruns = adcBlocksProcessedInTick = 0;
+	adcProcessing = false;
+	adcIrOn = adcBlockIrOn[0] = true;	// InitZProbe turned the IR LED on
+	adcFillingSlot = 0;
+	adcNextSlot = 1;
+
+	ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+	ADC->ADC_RPR = (uint32_t)adcBuffer[0];
+	ADC->ADC_RCR = adcWordsPerBlock;
+	ADC->ADC_RNPR = (uint32_t)adcBuffer[1];
+	ADC->ADC_RNCR = adcWordsPerBlock;
+	ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+	adc_enable_interrupt(ADC, ADC_IER_ENDRX);
+	NVIC_EnableIRQ(ADC_IRQn);
+
+	// The rising edge of TIOA0 starts each scan. We don't connect TIOA0 to its pin.
+	pmc_enable_periph_clk(ID_TC0);
+	TC_Configure(TC0, 0, TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC | TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_ACPA_CLEAR | TC_CMR_ACPC_SET);
+	const uint32_t rc = VARIANT_MCK/2/adcScanFrequency;	// 2 because we selected TIMER_CLOCK1 above
+	TC_SetRA(TC0, 0, rc/2);
+	TC_SetRC(TC0, 0, rc);
+	TC_Start(TC0, 0);
+}
+
+// The PDC has filled a block and moved on to the next one, so give it another to follow that,
+// or the Z probe reading has gone above the comparison window threshold.
+// This must be kept fast, so all we do here is keep the ring going, toggle the IR LED and latch the Z probe.
+
+void Platform::AdcInterrupt()
+{
+	const uint32_t status = ADC->ADC_ISR & ADC->ADC_IMR;		// reading the status clears the comparison event
+	if ((status & ADC_ISR_COMPE) != 0 && zProbeArmed && !zProbeTriggered)
+	{
+		++zProbeMatches;
+		if (zProbeMatches >= zProbeWindowMatches)
+		{
+			// Latch the trigger and make the step interrupt run now. DDA::Step checks the trigger before stepping,
+			// so this early call stops the move without taking a step.
+			zProbeTriggered = true;
+			++zProbeWindowTriggers;
+			adc_disable_interrupt(ADC, ADC_IDR_COMPE);
+			NVIC_SetPendingIRQ(TC3_IRQn);
+		}
+	}
+	if ((status & ADC_ISR_ENDRX) == 0)
 	{
-		ThermistorAveragingFilter& currentFilter = const_cast<ThermistorAveragingFilter&>(thermistorFilters[currentHeater]);
-		currentFilter.ProcessReading(GetAdcReading(heaterAdcChannels[currentHeater]));
-		StartAdcConversion(zProbeAdcChannel);
-		if (currentFilter.IsValid())
+		return;
+	}
+
+	zProbeMatches = 0;
+
+	// The PDC has finished one block and moved on to the next
+	if (adcFillingSlot < adcBlocks)
+	{
+		++adcBlocksFilled;
+	}
+	else
+	{
+		++adcOverruns;									// that block went into the discard buffer, so it is lost
+	}
+	adcFillingSlot = adcNextSlot;
+	adcIrOn = !adcIrOn;									// alternate blocks go to the IR-on and IR-off filters
+	if (adcFillingSlot < adcBlocks)
+	{
+		adcBlockIrOn[adcFillingSlot] = adcIrOn;
+	}
+	if (nvData.zProbeType == 2)							// if using a modulated IR sensor
+	{
+		digitalWrite(zProbeModulationPin, (adcIrOn) ? HIGH : LOW);
+	}
+
+	// Queue the next ring block, unless it still holds readings that haven't been processed.
+	// In that case the next block of readings is discarded, so that we never overwrite blocks waiting to be processed.
+	const uint32_t blocksInUse = adcBlocksFilled + ((adcFillingSlot < adcBlocks) ? 1 : 0);
+	if (blocksInUse - adcBlocksProcessed < adcBlocks)
+	{
+		adcNextSlot = blocksInUse % adcBlocks;
+		ADC->ADC_RNPR = (uint32_t)adcBuffer[adcNextSlot];
+	}
+	else
+	{
+		adcNextSlot = adcBlocks;
+		ADC->ADC_RNPR = (uint32_t)adcDiscardBuffer;
+	}
+	ADC->ADC_RNCR = adcWordsPerBlock;					// this also clears the ENDRX interrupt
+}
+
+// Set up the ADC comparison window to watch the Z probe if it is one of the endstops checked by the move that is starting.
+// A modulated IR probe needs the difference between readings, so it still relies on the filtered readings.
+// Called from the step ISR.
+
+void Platform::ArmZProbeTrigger(uint16_t endstopChecks)
+{
+	bool useProbe = false;
+	if (nvData.zProbeType == 1 || nvData.zProbeType == 3)
+	{
+		for (size_t drive = 0; drive < AXES; ++drive)
 		{
-			uint32_t sum = currentFilter.GetSum();
-			if (sum < thermistorOverheatSums[currentHeater] || sum >= adDisconnectedReal * numThermistorReadingsAveraged)
+			if ((endstopChecks & (1 << drive)) != 0 && nvData.zProbeAxes[drive])
 			{
-				// We have an over-temperature or bad reading from this thermistor, so turn off the heater
-				// NB - the SetHeater function we call does floating point maths, but this is an exceptional situation so we allow it
-				SetHeater(currentHeater, 0.0);
-				errorCodeBits |= ErrorBadTemp;
+				useProbe = true;
 			}
 		}
-		++currentHeater;
-		if (currentHeater == HEATERS)
-		{
-			currentHeater = 0;
-		}
 	}
-		++tickState;
-		break;
 
-	case 2:			// last conversion started was the Z probe, with IR LED on
-		const_cast<ZProbeAveragingFilter&>(zProbeOnFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
-		StartAdcConversion(heaterAdcChannels[currentHeater]);	// read a thermistor
-		if (nvData.zProbeType == 2)								// if using a modulated IR sensor
+	if (!useProbe)
+	{
+		DisarmZProbeTrigger();
+		return;
+	}
+
+	// ZProbe() returns the raw 12-bit reading divided by 4 for these probe types
+	const int adcValue = (nvData.zProbeType == 3) ? nvData.alternateZProbeParameters.adcValue : nvData.irZProbeParameters.adcValue;
+	const uint16_t threshold = (uint16_t)max<int>(1, min<int>(adcValue * 4, adRangeReal));
+	adc_set_comparison_channel(ADC, zProbeAdcChannel);
+	adc_set_comparison_window(ADC, 0, threshold - 1);
+	adc_set_comparison_mode(ADC, ADC_EMR_CMPMODE_HIGH);
+	zProbeMatches = 0;
+	zProbeTriggered = false;
+	zProbeArmed = true;
+	adc_enable_interrupt(ADC, ADC_IER_COMPE);
+}
+
+void Platform::DisarmZProbeTrigger()
+{
+	adc_disable_interrupt(ADC, ADC_IDR_COMPE);
+	zProbeArmed = false;
+}
+
+// Reduce any blocks of ADC readings that the PDC has completed into the averaging filters
+
+void Platform::ProcessAdcBlocks()
+{
+	adcProcessing = true;
+	while (adcBlocksProcessed != adcBlocksFilled)
+	{
+		ProcessAdcBlock(adcBlocksProcessed % adcBlocks);
+		++adcBlocksProcessed;
+	}
+	adcProcessing = false;
+}
+
+// Average the readings of each channel in a block and pass them to the filters.
+// Then check for an over-temperature situation and turn off the heater if necessary.
+
+void Platform::ProcessAdcBlock(size_t block)
+{
+	uint32_t sums[16];
+	uint16_t counts[16];
+	for (size_t chan = 0; chan < 16; ++chan)
+	{
+		sums[chan] = 0;
+		counts[chan] = 0;
+	}
+
+	size_t zProbeScans = 0;
+	const uint16_t *readings = adcBuffer[block];
+	for (size_t i = 0; i < adcWordsPerBlock; ++i)
+	{
+		const size_t chan = readings[i] >> 12;
+		if (chan == (size_t)zProbeAdcChannel && zProbeScans++ < adcZProbeSettleScans)
 		{
-			digitalWrite(zProbeModulationPin, LOW);		// turn off the IR emitter
+			continue;										// the IR LED may still be settling
 		}
-		++tickState;
-		break;
+		sums[chan] += readings[i] & 0x0FFF;
+		++counts[chan];
+	}
 
-	case 4:			// last conversion started was the Z probe, with IR LED off if modulation is enabled
-		const_cast<ZProbeAveragingFilter&>(zProbeOffFilter).ProcessReading(GetAdcReading(zProbeAdcChannel));
-		// no break
-	case 0:			// this is the state after initialisation, no conversion has been started
-	default:
+	for (size_t heater = 0; heater < HEATERS; ++heater)
 	{
-		StartAdcConversion(heaterAdcChannels[currentHeater]);	// read a thermistor
-		if (nvData.zProbeType == 2)								// if using a modulated IR sensor
+		const size_t chan = heaterAdcChannels[heater];
+		if (counts[chan] != 0)
 		{
-			digitalWrite(zProbeModulationPin, HIGH);		// turn on the IR emitter
+			ThermistorAveragingFilter& filter = const_cast<ThermistorAveragingFilter&>(thermistorFilters[heater]);
+			filter.ProcessReading((uint16_t)((sums[chan] + counts[chan]/2)/counts[chan]));
+			if (filter.IsValid())
+			{
+				uint32_t sum = filter.GetSum();
+				if (sum < thermistorOverheatSums[heater] || sum >= adDisconnectedReal * numThermistorReadingsAveraged)
+				{
+					// We have an over-temperature or bad reading from this thermistor, so turn off the heater
+					// NB - the SetHeater function we call does floating point maths, but this is an exceptional situation so we allow it
+					SetHeater(heater, 0.0);
+					errorCodeBits |= ErrorBadTemp;
+				}
+			}
 		}
 	}
-		tickState = 1;
-		break;
-	}
-#ifdef TIME_TICK_ISR
-	uint32_t now2 = micros();
-	if (now2 - now > errorCodeBits)
+
+	if (counts[zProbeAdcChannel] != 0)
 	{
-		errorCodeBits = now2 - now;
+		lastZProbeReading = (uint16_t)((sums[zProbeAdcChannel] + counts[zProbeAdcChannel]/2)/counts[zProbeAdcChannel]);
+		if (adcBlockIrOn[block])
+		{
+			const_cast<ZProbeAveragingFilter&>(zProbeOnFilter).ProcessReading(lastZProbeReading);
+		}
+		else
+		{
+			const_cast<ZProbeAveragingFilter&>(zProbeOffFilter).ProcessReading(lastZProbeReading);
+		}
 	}
-#endif
 }
 
-/*static*/uint16_t Platform::GetAdcReading(adc_channel_num_t chan)
-{
-	uint16_t rslt = (uint16_t) adc_get_channel_value(ADC, chan);
-	adc_disable_channel(ADC, chan);
-	return rslt;
-}
+// Process a 1ms tick interrupt
+// The main loop normally processes the ADC readings, but it sometimes gets stuck trying to send data to the USB port,
+// so if it falls behind we do it here in order to keep checking for over-temperature heaters.
 
-/*static*/void Platform::StartAdcConversion(adc_channel_num_t chan)
+void Platform::Tick()
 {
-	adc_enable_channel(ADC, chan);
-	adc_start(ADC );
+	if (!adcProcessing && adcBlocksFilled - adcBlocksProcessed >= 2)
+	{
+		adcBlocksProcessedInTick += adcBlocksFilled - adcBlocksProcessed;
+		ProcessAdcBlocks();
+	}
 }
 
 // Convert an Arduino Due pin number to the corresponding ADC channel number
@@ -979,9 +1160,34 @@ void Platform::Diagnostics()
 	}
 	AppendMessage(BOTH_MESSAGE, "Free file entries: %u\n", numFreeFiles);
 
+	// Show the macro cache usage
+	unsigned int numCachedMacros = 0;
+	for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+	{
+		if (macroCacheEntries[i].fileName[0] != 0)
+		{
+			++numCachedMacros;
+		}
+	}
+	AppendMessage(BOTH_MESSAGE, "Macro cache: %u files, %u of %u bytes used\n", numCachedMacros, macroCacheUsed, MACRO_CACHE_SIZE);
+
 	// Show the longest write time
 	AppendMessage(BOTH_MESSAGE, "Longest block write time: %.1fms\n", FileStore::GetAndClearLongestWriteTime());
 
+	// Show the ADC statistics
+	AppendMessage(BOTH_MESSAGE, "ADC: %u samples/sec per channel, %u blocks processed, %u in tick, %u lost\n",
+			adcScanFrequency, adcBlocksProcessed, adcBlocksProcessedInTick, adcOverruns);
+	AppendMessage(BOTH_MESSAGE, "Z probe stops by ADC comparison window: %u\n", zProbeWindowTriggers);
+
+	// Show the heater PWM frequencies actually achieved
+	for (size_t heater = 0; heater < HEATERS; ++heater)
+	{
+		if (heatOnPins[heater] >= 0)
+		{
+			AppendMessage(BOTH_MESSAGE, "Heater %u PWM: %.1fHz, %u steps\n", heater, GetHeaterPwmFrequency(heater), GetHeaterPwmResolution(heater));
+		}
+	}
+
 	reprap.Timing();
 }
 
@@ -1056,29 +1262,33 @@ void Platform::ClassReport(float &lastTime)
 
 float Platform::GetTemperature(size_t heater) const
 {
-	int rawTemp = GetRawTemperature(heater);
-
-	// If the ADC reading is N then for an ideal ADC, the input voltage is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
-	// So we add 0.5 to to the reading to get a better estimate of the input.
-
-	float reading = (float) rawTemp + 0.5;
+	const int rawTemp = GetRawTemperature(heater);
 
-	// Recognise the special case of thermistor disconnected.
-	// For some ADCs, the high-end offset is negative, meaning that the ADC never returns a high enough value. We need to allow for this here.
+	// Recognise the special case of thermistor disconnected. UpdateThermistorTable allows for the ADC high-end offset in the threshold.
 
-	const PidParameters& p = nvData.pidParams[heater];
-	if (p.adcHighOffset < 0.0)
-	{
-		rawTemp -= (int) p.adcHighOffset;
-	}
-	if (rawTemp >= adDisconnectedVirtual)
+	if (rawTemp >= thermistorDisconnectedReadings[heater])
 	{
 		return ABS_ZERO;		// thermistor is disconnected
 	}
 
+	// Readings outside the table (below -40C, above 400C or a short circuit) fall back to the full calculation
+	float temperature;
+	return (thermistorTables[heater].GetTemperature(rawTemp, temperature)) ? temperature : CalcTemperature(heater, rawTemp);
+}
+
+// Calculate the temperature from a raw averaged ADC reading using the beta formula.
+// This is only used for readings outside the range of the thermistor table.
+float Platform::CalcTemperature(size_t heater, int rawTemp) const
+{
+	const PidParameters& p = nvData.pidParams[heater];
+
+	// If the ADC reading is N then for an ideal ADC, the input voltage is at least N/(AD_RANGE + 1) and less than (N + 1)/(AD_RANGE + 1), times the analog reference.
+	// So we add 0.5 to to the reading to get a better estimate of the input.
+
+	float reading = (float) rawTemp + 0.5;
+
 	// Correct for the low and high ADC offsets
-	reading -= p.adcLowOffset;
-	reading *= (adRangeVirtual + 1) / (adRangeVirtual + 1 + p.adcHighOffset - p.adcLowOffset);
+	reading = (reading - p.adcLowOffset) * thermistorAdcScales[heater];
 
 	float resistance = reading * p.thermistorSeriesR / ((adRangeVirtual + 1) - reading);
 	return (resistance <= p.GetRInf()) ? 2000.0			// thermistor short circuit, return a high temperature
@@ -1090,12 +1300,40 @@ void Platform::SetPidParameters(size_t heater, const PidParameters& params)
 	if (heater < HEATERS && params != nvData.pidParams[heater])
 	{
 		nvData.pidParams[heater] = params;
+		UpdateThermistorTable(heater);
 		if (autoSaveEnabled)
 		{
 			WriteNvData();
 		}
 	}
 }
+
+// Rebuild the interpolation table and the overheat threshold for a heater after its thermistor parameters have changed.
+// Each table entry is the averaged raw reading that GetTemperature would convert to the entry's temperature.
+void Platform::UpdateThermistorTable(size_t heater)
+{
+	const PidParameters& p = nvData.pidParams[heater];
+	thermistorTables[heater].Build(p.GetBeta(), p.GetRInf(), p.thermistorSeriesR, p.adcLowOffset, p.adcHighOffset, adRangeVirtual + 1);
+
+	// Calculate and store the ADC average sum that corresponds to an overheat condition, so that we can check is quickly in the tick ISR
+	float thermistorOverheatResistance = p.GetRInf() * exp(-p.GetBeta() / (BAD_HIGH_TEMPERATURE - ABS_ZERO));
+	float thermistorOverheatAdcValue = (adRangeReal + 1) * thermistorOverheatResistance
+			/ (thermistorOverheatResistance + p.thermistorSeriesR);
+	thermistorOverheatSums[heater] = (uint32_t) (thermistorOverheatAdcValue + 0.9) * numThermistorReadingsAveraged;
+
+	// For some ADCs, the high-end offset is negative, meaning that the ADC never returns a high enough value to recognise
+	// a disconnected thermistor. Lower the threshold to allow for this.
+	thermistorDisconnectedReadings[heater] = (p.adcHighOffset < 0.0) ? (int)adDisconnectedVirtual + (int) p.adcHighOffset : (int)adDisconnectedVirtual;
+	thermistorAdcScales[heater] = (adRangeVirtual + 1) / (adRangeVirtual + 1 + p.adcHighOffset - p.adcLowOffset);
+}
+// Beds and chambers heat much more slowly than hot ends, so their heating rate is measured over a longer period and less is expected of it
+void Platform::SetDefaultHeaterFaultParameters(size_t heater, bool slow)
+{
+	heaterFaultParameters[heater].period = (slow) ? BED_HEATING_FAULT_PERIOD : HEATING_FAULT_PERIOD;
+	heaterFaultParameters[heater].fraction = HEATING_FAULT_FRACTION;
+	heaterFaultParameters[heater].rate = (slow) ? BED_HEATING_FAULT_RATE : HEATING_FAULT_RATE;
+}
+
 const PidParameters& Platform::GetPidParameters(size_t heater) const
 {
 	return nvData.pidParams[heater];
@@ -1105,17 +1343,129 @@ const PidParameters& Platform::GetPidParameters(size_t heater) const
 
 void Platform::SetHeater(size_t heater, float power)
 {
-	if (heatOnPins[heater] < 0)
+	if (heatOnPins[heater] < 0 || (heaterPwmPending & (1u << heater)) != 0)
 		return;
 
-	byte p = (byte) (255.0 * min<float>(1.0, max<float>(0.0, power)));
-	analogWrite(heatOnPins[heater], (HEAT_ON == 0) ? 255 - p : p);
+	const uint32_t period = heaterPwmPeriods[heater];
+	if (period == 0)
+	{
+		byte p = (byte) (255.0 * min<float>(1.0, max<float>(0.0, power)));
+		analogWrite(heatOnPins[heater], (HEAT_ON == 0) ? 255 - p : p);
+		return;
+	}
+
+	// Writing the update register makes the new duty cycle take effect at the start of the next period
+	const uint32_t on = (uint32_t) (period * min<float>(1.0, max<float>(0.0, power)) + 0.5);
+	PWM->PWM_CH_NUM[g_APinDescription[heatOnPins[heater]].ulPWMChannel].PWM_CDTYUPD = (HEAT_ON == 0) ? period - on : on;
+}
+
+// Set up the PWM peripheral channel for a heater at the requested frequency, leaving the heater off.
+// We use the channel's own prescaler rather than clock A or B, so each heater can have a different frequency.
+// Pins that don't have a PWM channel fall back to analogWrite. If the channel is already running with the same
+// prescaler we just write the update registers. Otherwise the prescaler can only be changed once the channel has
+// stopped at the end of its current period, which may take most of a second, so Spin finishes the job.
+
+void Platform::InitialiseHeaterPwm(size_t heater)
+{
+	const int pin = heatOnPins[heater];
+	if (pin < 0 || (g_APinDescription[pin].ulPinAttribute & PIN_ATTR_PWM) != PIN_ATTR_PWM)
+	{
+		heaterPwmPeriods[heater] = 0;
+		return;
+	}
+
+	// Use the smallest prescaler that lets the period fit in 16 bits, to get the best resolution
+	const float freq = min<float>(maxHeaterPwmFrequency, max<float>(minHeaterPwmFrequency, heaterPwmFrequencies[heater]));
+	uint8_t prescaler = 0;
+	while (prescaler < 10 && (float)VARIANT_MCK/((1u << prescaler) * freq) > 65535.0)
+	{
+		++prescaler;
+	}
+	const uint16_t period = (uint16_t)min<float>(65535.0, (float)VARIANT_MCK/((1u << prescaler) * freq) + 0.5);
+
+	heaterPwmPrescalers[heater] = prescaler;
+	heaterPwmPeriods[heater] = period;
+
+	const uint32_t chan = g_APinDescription[pin].ulPWMChannel;
+	pmc_enable_periph_clk(PWM_INTERFACE_ID);
+	if ((PWM->PWM_SR & (1u << chan)) == 0)
+	{
+		heaterPwmPending &= ~(1u << heater);
+		StartHeaterPwm(heater);
+	}
+	else if ((heaterPwmPending & (1u << heater)) == 0 && (PWM->PWM_CH_NUM[chan].PWM_CMR & PWM_CMR_CPRE_Msk) == prescaler)
+	{
+		// Both of these take effect at the end of the current period
+		PWM->PWM_CH_NUM[chan].PWM_CPRDUPD = period;
+		PWM->PWM_CH_NUM[chan].PWM_CDTYUPD = (HEAT_ON == 0) ? period : 0;
+	}
+	else
+	{
+		PWM->PWM_DIS = 1u << chan;
+		heaterPwmPending |= (1u << heater);
+	}
+}
+
+// Program a stopped PWM channel with the prescaler and period chosen for the heater and start it with the heater off
+
+void Platform::StartHeaterPwm(size_t heater)
+{
+	const int pin = heatOnPins[heater];
+	const uint32_t chan = g_APinDescription[pin].ulPWMChannel;
+	const uint16_t period = heaterPwmPeriods[heater];
+	PWM->PWM_CH_NUM[chan].PWM_CMR = heaterPwmPrescalers[heater];	// CPRE is the bottom 4 bits; left aligned, low polarity like analogWrite
+	PWM->PWM_CH_NUM[chan].PWM_CPRD = period;
+	PWM->PWM_CH_NUM[chan].PWM_CDTY = (HEAT_ON == 0) ? period : 0;
+	PIO_Configure(g_APinDescription[pin].pPort, g_APinDescription[pin].ulPinType,
+					g_APinDescription[pin].ulPin, g_APinDescription[pin].ulPinConfiguration);
+	PWM->PWM_ENA = 1u << chan;
+}
+
+// Restart the PWM channels that InitialiseHeaterPwm has been waiting for to stop
+
+void Platform::FinishHeaterPwm()
+{
+	for (size_t heater = 0; heater < HEATERS; heater++)
+	{
+		if ((heaterPwmPending & (1u << heater)) != 0
+				&& (PWM->PWM_SR & (1u << g_APinDescription[heatOnPins[heater]].ulPWMChannel)) == 0)
+		{
+			heaterPwmPending &= ~(1u << heater);
+			StartHeaterPwm(heater);
+		}
+	}
+}
+
+void Platform::SetHeaterPwmFrequency(size_t heater, float freq)
+{
+	if (heater < HEATERS && freq > 0.0)
+	{
+		heaterPwmFrequencies[heater] = freq;
+		InitialiseHeaterPwm(heater);			// this turns the heater off until the next PID cycle
+	}
+}
+
+float Platform::GetHeaterPwmFrequency(size_t heater) const
+{
+	return (heaterPwmPeriods[heater] == 0) ? PWM_FREQUENCY
+			: (float)VARIANT_MCK/((1u << heaterPwmPrescalers[heater]) * (float)heaterPwmPeriods[heater]);
+}
+
+uint32_t Platform::GetHeaterPwmResolution(size_t heater) const
+{
+	return (heaterPwmPeriods[heater] == 0) ? 255 : heaterPwmPeriods[heater];
 }
 
 EndStopHit Platform::Stopped(int8_t drive)
 {
 	if (nvData.zProbeType > 0 && drive < AXES && nvData.zProbeAxes[drive])
 	{
+		// If the ADC is watching the probe we don't need to slow down near the trigger point
+		if (zProbeArmed)
+		{
+			return (zProbeTriggered) ? lowHit : noStop;
+		}
+
 		int zProbeVal = ZProbe();
 		int zProbeADValue = (nvData.zProbeType == 3) ?
 								nvData.alternateZProbeParameters.adcValue :
@@ -1307,6 +1657,11 @@ FileStore* Platform::GetFileStore(const char* directory, const char* fileName, b
 	if (!fileStructureInitialised)
 		return NULL;
 
+	if (write)
+	{
+		InvalidateMacroCache((directory != NULL) ? massStorage->CombineName(directory, fileName) : fileName);
+	}
+
 	for (int i = 0; i < MAX_FILES; i++)
 	{
 		if (!files[i]->inUse)
@@ -1327,6 +1682,149 @@ FileStore* Platform::GetFileStore(const char* directory, const char* fileName, b
 	return NULL;
 }
 
+// Open a macro file for reading. Small files are kept in RAM after they have been read once,
+// so that macros that are run often (e.g. for tool changes) don't have to be opened and read from the SD card each time.
+FileStore* Platform::GetMacroFileStore(const char* directory, const char* fileName, bool& filledCache)
+{
+	filledCache = false;
+	if (!fileStructureInitialised)
+		return NULL;
+
+	const char* location = (directory != NULL) ? massStorage->CombineName(directory, fileName) : fileName;
+	for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+	{
+		const MacroCacheEntry& entry = macroCacheEntries[i];
+		if (entry.fileName[0] != 0 && FileNamesMatch(entry.fileName, location))
+		{
+			for (int j = 0; j < MAX_FILES; j++)
+			{
+				if (!files[j]->inUse)
+				{
+					files[j]->OpenCached(macroCache + entry.offset, entry.length);
+					return files[j];
+				}
+			}
+			Message(HOST_MESSAGE, "Max open file count exceeded.\n");
+			return NULL;
+		}
+	}
+
+	// Not in the cache, so read it from the SD card and try to cache it for next time
+	FileStore *f = GetFileStore(directory, fileName, false);
+	if (f != NULL && strlen(location) < SHORT_STRING_LENGTH)
+	{
+		char locationCopy[SHORT_STRING_LENGTH];
+		strcpy(locationCopy, location);
+		filledCache = CacheMacroFile(f, locationCopy);
+		if (f->Position() != 0 && !f->Seek(0))
+		{
+			f->Close();
+			f = NULL;
+		}
+	}
+	return f;
+}
+
+// Try to read the whole of an open file into the macro cache, returning true if it has been cached.
+// The caller must rewind the file if anything has been read from it.
+bool Platform::CacheMacroFile(FileStore *f, const char* location)
+{
+	// We can only reuse the cache memory if no cached file is open, because it may still be being read
+	bool cachedFileOpen = false;
+	for (size_t i = 0; i < MAX_FILES; i++)
+	{
+		if (files[i]->inUse && files[i]->IsCached())
+		{
+			cachedFileOpen = true;
+			break;
+		}
+	}
+
+	size_t freeEntry = MAX_CACHED_MACROS;
+	for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+	{
+		if (macroCacheEntries[i].fileName[0] == 0)
+		{
+			freeEntry = i;
+			break;
+		}
+	}
+	if (!cachedFileOpen)
+	{
+		CompactMacroCache();
+	}
+
+	const unsigned long length = f->Length();
+	if (freeEntry == MAX_CACHED_MACROS || length > MACRO_CACHE_SIZE - macroCacheUsed)
+	{
+		return false;
+	}
+
+	if (f->Read(macroCache + macroCacheUsed, length) != (int)length)
+	{
+		return false;
+	}
+
+	MacroCacheEntry& entry = macroCacheEntries[freeEntry];
+	strncpy(entry.fileName, location, ARRAY_SIZE(entry.fileName));
+	entry.fileName[ARRAY_UPB(entry.fileName)] = 0;
+	entry.offset = macroCacheUsed;
+	entry.length = length;
+	macroCacheUsed += length;
+	return true;
+}
+
+// Close up the space left by files that have been removed from the macro cache.
+// This moves the cached data, so it must only be called when no cached file is open.
+void Platform::CompactMacroCache()
+{
+	bool moved[MAX_CACHED_MACROS];
+	for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+	{
+		moved[i] = (macroCacheEntries[i].fileName[0] == 0);
+	}
+
+	size_t used = 0;
+	for (;;)
+	{
+		// Find the remaining file that comes first in the cache
+		size_t next = MAX_CACHED_MACROS;
+		for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+		{
+			if (!moved[i] && (next == MAX_CACHED_MACROS || macroCacheEntries[i].offset < macroCacheEntries[next].offset))
+			{
+				next = i;
+			}
+		}
+		if (next == MAX_CACHED_MACROS)
+		{
+			break;
+		}
+
+		MacroCacheEntry& entry = macroCacheEntries[next];
+		if (entry.offset != used)
+		{
+			memmove(macroCache + used, macroCache + entry.offset, entry.length);
+			entry.offset = used;
+		}
+		used += entry.length;
+		moved[next] = true;
+	}
+	macroCacheUsed = used;
+}
+
+// Forget the cached copy of a file that is being written, deleted or renamed
+void Platform::InvalidateMacroCache(const char* fileName)
+{
+	for (size_t i = 0; i < MAX_CACHED_MACROS; i++)
+	{
+		if (fileName == NULL || FileNamesMatch(macroCacheEntries[i].fileName, fileName))
+		{
+			macroCacheEntries[i].fileName[0] = 0;
+		}
+	}
+}
+
 MassStorage* Platform::GetMassStorage()
 {
 	return massStorage;
@@ -1786,6 +2284,17 @@ bool MassStorage::FindNext(FileInfo &file_info)
 	return true;
 }
 
+void MassStorage::GetFindPosition(DIR& position) const
+{
+	position = *findDir;
+}
+
+// If the card has been remounted since the position was saved, FindNext will just report that there are no more files
+void MassStorage::SetFindPosition(const DIR& position)
+{
+	*findDir = position;
+}
+
 // Month names. The first entry is used for invalid month numbers.
 static const char *monthNames[13] = { "???", "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
@@ -1801,6 +2310,7 @@ bool MassStorage::Delete(const char* directory, const char* fileName)
 	const char* location = (directory != NULL)
 							? platform->GetMassStorage()->CombineName(directory, fileName)
 								: fileName;
+	platform->InvalidateMacroCache(location);
 	if (f_unlink(location) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't delete file %s\n", location);
@@ -1834,6 +2344,7 @@ bool MassStorage::MakeDirectory(const char *directory)
 // Rename a file or directory
 bool MassStorage::Rename(const char *oldFilename, const char *newFilename)
 {
+	platform->InvalidateMacroCache();		// a whole directory may be renamed
 	if (f_rename(oldFilename, newFilename) != FR_OK)
 	{
 		platform->Message(BOTH_ERROR_MESSAGE, "Can't rename file or directory %s to %s\n", oldFilename, newFilename);
@@ -1850,6 +2361,22 @@ bool MassStorage::FileExists(const char *file) const
 	return (f_stat(file, &fil) == FR_OK);
 }
 
+// Get the length of a file and its FAT modification date and time (date in the upper 16 bits).
+// Returns false if the file doesn't exist.
+bool MassStorage::GetFileStats(const char* directory, const char* fileName, uint32_t& length, uint32_t& timestamp)
+{
+	FILINFO fil;
+	fil.lfname = nullptr;
+	if (f_stat(CombineName(directory, fileName), &fil) != FR_OK || (fil.fattrib & AM_DIR) != 0)
+	{
+		return false;
+	}
+
+	length = fil.fsize;
+	timestamp = ((uint32_t)fil.fdate << 16) | fil.ftime;
+	return true;
+}
+
 // Check if the specified directory exists
 bool MassStorage::PathExists(const char *path) const
 {
@@ -1877,8 +2404,12 @@ void FileStore::Init()
 	bufferPointer = 0;
 	inUse = false;
 	writing = false;
+	preallocated = false;
+	growBy = 0;
 	lastBufferEntry = 0;
 	openCount = 0;
+	cachedData = NULL;
+	cachedLength = 0;
 }
 
 // Open a local file (for example on an SD card).
@@ -1890,8 +2421,11 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
 							? platform->GetMassStorage()->CombineName(directory, fileName)
 								: fileName;
 	writing = write;
+	preallocated = false;
+	growBy = 0;
 	lastBufferEntry = FILE_BUF_LEN - 1;
 	bytesRead = 0;
+	cachedData = NULL;
 
 	FRESULT openReturn = f_open(&file, location, (writing) ? FA_CREATE_ALWAYS | FA_WRITE : FA_OPEN_EXISTING | FA_READ);
 	if (openReturn != FR_OK)
@@ -1906,6 +2440,19 @@ bool FileStore::Open(const char* directory, const char* fileName, bool write)
 	return true;
 }
 
+// Open a file whose contents are held in the macro cache.
+// This is protected - only Platform can access it.
+
+void FileStore::OpenCached(const char *data, unsigned long length)
+{
+	writing = false;
+	bytesRead = 0;
+	cachedData = data;
+	cachedLength = length;
+	inUse = true;
+	openCount = 1;
+}
+
 void FileStore::Duplicate()
 {
 	if (!inUse)
@@ -1928,10 +2475,21 @@ bool FileStore::Close()
 	{
 		return true;
 	}
+	if (cachedData != NULL)
+	{
+		cachedData = NULL;
+		inUse = false;
+		return true;
+	}
 	bool ok = true;
 	if (writing)
 	{
 		ok = Flush();
+		if (ok && preallocated)
+		{
+			// Give back the space we allocated but didn't use
+			ok = (f_truncate(&file) == FR_OK);
+		}
 	}
 	FRESULT fr = f_close(&file);
 	inUse = false;
@@ -1952,6 +2510,15 @@ bool FileStore::Seek(unsigned long pos)
 		platform->Message(BOTH_ERROR_MESSAGE, "Attempt to seek on a non-open file.\n");
 		return false;
 	}
+	if (cachedData != NULL)
+	{
+		if (pos > cachedLength)
+		{
+			return false;
+		}
+		bytesRead = pos;
+		return true;
+	}
 	if (writing)
 	{
 		WriteBuffer();
@@ -1978,7 +2545,12 @@ unsigned long FileStore::Length() const
 		platform->Message(BOTH_ERROR_MESSAGE, "Attempt to size non-open file.\n");
 		return 0;
 	}
-	return file.fsize;
+	if (cachedData != NULL)
+	{
+		return cachedLength;
+	}
+	// If we have allocated space in advance, the file ends where we have written to
+	return (preallocated) ? file.fptr : file.fsize;
 }
 
 float FileStore::FractionRead() const
@@ -1997,6 +2569,9 @@ int8_t FileStore::Status()
 	if (!inUse)
 		return nothing;
 
+	if (cachedData != NULL)
+		return (bytesRead < cachedLength) ? byteAvailable : nothing;
+
 	if (lastBufferEntry == FILE_BUF_LEN)
 		return byteAvailable;
 
@@ -2027,6 +2602,17 @@ bool FileStore::Read(char& b)
 		return false;
 	}
 
+	if (cachedData != NULL)
+	{
+		if (bytesRead >= cachedLength)
+		{
+			b = 0;
+			return false;
+		}
+		b = cachedData[bytesRead++];
+		return true;
+	}
+
 	if (bufferPointer >= FILE_BUF_LEN)
 	{
 		bool ok = ReadBuffer();
@@ -2057,6 +2643,13 @@ int FileStore::Read(char* extBuf, unsigned int nBytes)
 		platform->Message(BOTH_ERROR_MESSAGE, "Attempt to read from a non-open file.\n");
 		return -1;
 	}
+	if (cachedData != NULL)
+	{
+		unsigned int bytes = min<unsigned long>(nBytes, cachedLength - bytesRead);
+		memcpy(extBuf, cachedData + bytesRead, bytes);
+		bytesRead += bytes;
+		return (int)bytes;
+	}
 	bufferPointer = FILE_BUF_LEN;	// invalidate the buffer
 	UINT bytes_read;
 	FRESULT readStatus = f_read(&file, extBuf, nBytes, &bytes_read);
@@ -2136,6 +2729,12 @@ bool FileStore::Write(const char *s, unsigned int len)
 bool FileStore::InternalWriteBlock(const char *s, unsigned int len)
 {
  	unsigned int bytesWritten;
+	if (growBy != 0 && file.fptr + len > file.fsize)
+	{
+		// Keep some allocated space ahead of the data. If this fails, FatFs allocates clusters as we write.
+		preallocated = true;
+		(void)Extend(file.fptr + len + growBy);
+	}
 	uint32_t time = micros();
  	FRESULT writeStatus = f_write(&file, s, len, &bytesWritten);
 	time = micros() - time;
@@ -2165,6 +2764,47 @@ bool FileStore::Flush()
 	return f_sync(&file) == FR_OK;
 }
 
+// Allocate space for a file we are about to write, so that FatFs doesn't have to update the FAT as it grows.
+// If nothing has been written yet we try to allocate a contiguous cluster chain, which also makes the file faster to read back.
+// If growth is nonzero, the allocation is extended by that much each time the data reaches the end of it.
+// The unused space is truncated when the file is closed.
+bool FileStore::Preallocate(unsigned long length, unsigned long growth)
+{
+	if (!inUse || !writing || cachedData != NULL)
+	{
+		platform->Message(BOTH_ERROR_MESSAGE, "Attempt to preallocate a file that isn't open for writing.\n");
+		return false;
+	}
+	growBy = growth;
+	if (length <= file.fsize)
+	{
+		return true;
+	}
+
+	if (!WriteBuffer())
+	{
+		return false;
+	}
+
+	preallocated = true;
+	if (file.fsize == 0 && f_expand(&file, length) == FR_OK)
+	{
+		return true;
+	}
+
+	// There is no contiguous free space large enough, or the file isn't empty, so let FatFs find the clusters
+	return Extend(length);
+}
+
+// Extend a file that is open for writing to the specified length, leaving the file pointer where it was
+bool FileStore::Extend(unsigned long length)
+{
+	// Seeking beyond the end of a file that is open for writing makes FatFs extend it
+	const DWORD position = file.fptr;
+	const bool ok = (f_lseek(&file, length) == FR_OK && file.fsize == length);
+	return f_lseek(&file, position) == FR_OK && ok;
+}
+
 float FileStore::GetAndClearLongestWriteTime()
 {
 	float ret = (float)longestWriteTime/1000.0;
@@ -181,14 +181,30 @@ const float defaultPidMaxes[HEATERS] = {255, 180, 180, 180, 180, 180};			// maxi
 // For the theory behind ADC oversampling, see http://www.atmel.com/Images/doc8003.pdf
 const unsigned int adOversampleBits = 1;					// number of bits we oversample when reading temperatures
 
+// The ADC scans all the thermistor channels and the Z probe channel together, triggered by a timer, and the PDC stores the results
+// in a ring of blocks. Each block is reduced to one averaged reading per channel outside the interrupt, normally in Spin.
+const unsigned int adcScanFrequency = 8000;					// scans per second, set by the timer that triggers the ADC
+const size_t adcScansPerBlock = 16;							// number of scans averaged into one reading per channel
+const size_t adcBlocks = 4;									// number of blocks in the PDC ring
+const size_t adcZProbeSettleScans = 4;						// scans at the start of each block that the Z probe ignores while the IR LED settles
+const unsigned int zProbeWindowMatches = 3;					// readings above the threshold within one block needed to trigger the Z probe
+const size_t numAdcChannels = HEATERS + 1;					// all the thermistor channels and the Z probe
+
 // Define the number of temperature readings we average for each thermistor. This should be a power of 2 and at least 4 ** adOversampleBits.
-// Keep numThermistorReadingsAveraged * NUM_HEATERS * 2ms no greater than HEAT_SAMPLE_TIME or the PIDs won't work well.
+// Keep numThermistorReadingsAveraged * adcScansPerBlock/adcScanFrequency no greater than HEAT_SAMPLE_TIME or the PIDs won't work well.
 const unsigned int numThermistorReadingsAveraged = (HEATERS > 3) ? 32 : 64;
 const unsigned int adRangeReal = 4095;						// the ADC that measures temperatures gives an int this big as its max value
 const unsigned int adRangeVirtual = ((adRangeReal + 1) << adOversampleBits) - 1;	// the max value we can get using oversampling
 const unsigned int adDisconnectedReal = adRangeReal - 3;	// we consider an ADC reading at/above this value to indicate that the thermistor is disconnected
 const unsigned int adDisconnectedVirtual = adDisconnectedReal << adOversampleBits;
 
+// Heaters on PWM-capable pins are driven by the PWM peripheral directly. The period register sets the resolution,
+// so we keep at least 12 bits by limiting the frequency. Slow SSRs on beds want a low frequency, MOSFETs can go higher.
+#define DEFAULT_HEATER_PWM_FREQUENCY (1000.0)					// Hz, the same as the Arduino analogWrite default
+const uint32_t minHeaterPwmPeriod = 4096;						// 12-bit resolution
+const float maxHeaterPwmFrequency = (float)VARIANT_MCK/minHeaterPwmPeriod;
+const float minHeaterPwmFrequency = (float)VARIANT_MCK/(1024.0 * 65535.0);	// largest prescaler and period
+
 #define HOT_BED 0 	// The index of the heated bed; set to -1 if there is no heated bed
 #define E0_HEATER 1 //the index of the first extruder heater
 #define E1_HEATER 2 //the index of the second extruder heater
@@ -203,6 +219,9 @@ const unsigned int adDisconnectedVirtual = adDisconnectedReal << adOversampleBit
 
 #define MAX_FILES (10)		// must be large enough to handle the max number of simultaneous web requests + file being printed
 #define FILE_BUF_LEN (256)
+#define FILE_ALLOCATION_CHUNK (131072)	// how much space to preallocate at a time when writing a file of unknown length
+#define MACRO_CACHE_SIZE (2048)				// bytes of RAM used to cache macro files from the system directory
+#define MAX_CACHED_MACROS (8)				// maximum number of macro files held in the cache
 #define WEB_DIR "0:/www/" 						// Place to find web files on the SD card
 #define GCODE_DIR "0:/gcodes/" 					// Ditto - g-codes
 #define SYS_DIR "0:/sys/" 						// Ditto - system files
@@ -332,6 +351,8 @@ public:
 
   bool FindFirst(const char *directory, FileInfo &file_info);
   bool FindNext(FileInfo &file_info);
+  void GetFindPosition(DIR& position) const;		// Save where FindNext has got to, so that a long listing can carry on from there
+  void SetFindPosition(const DIR& position);		// Carry on a listing from a saved position
   const char* GetMonthName(const uint8_t month);
   const char* CombineName(const char* directory, const char* fileName);
   bool Delete(const char* directory, const char* fileName);
@@ -341,6 +362,7 @@ public:
   bool FileExists(const char *file) const;
   bool PathExists(const char *path) const;
   bool PathExists(const char* directory, const char* subDirectory);
+  bool GetFileStats(const char* directory, const char* fileName, uint32_t& length, uint32_t& timestamp);	// Get the size and FAT date/time of a file
 
 friend class Platform;
 
@@ -380,6 +402,8 @@ public:
 	float FractionRead() const;						// How far in we are
 	void Duplicate();								// Create a second reference to this file
 	bool Flush();									// Write remaining buffer data
+	bool Preallocate(unsigned long length, unsigned long growth = 0);	// Allocate space for a file we are about to write
+	bool IsCached() const;							// Is this file being read from the macro cache?
 	static float GetAndClearLongestWriteTime();		// Return the longest time it took to write a block to a file, in milliseconds
 
 friend class Platform;
@@ -389,6 +413,7 @@ protected:
 	FileStore(Platform* p);
 	void Init();
 	bool Open(const char* directory, const char* fileName, bool write);
+	void OpenCached(const char *data, unsigned long length);
         
 private:
 
@@ -400,13 +425,19 @@ private:
 	bool ReadBuffer();
 	bool WriteBuffer();
 	bool InternalWriteBlock(const char *s, unsigned int len);
+	bool Extend(unsigned long length);
 
 	FIL file;
 	Platform* platform;
 	bool writing;
+	bool preallocated;								// true if the file may be longer than the data written to it
+	unsigned long growBy;							// how much to extend a preallocated file by when the data reaches its end
 	unsigned int lastBufferEntry;
 	unsigned int openCount;
 
+	const char *cachedData;							// if the file is being read from the macro cache, the cached contents
+	unsigned long cachedLength;
+
 	static uint32_t longestWriteTime;
 };
 
@@ -570,6 +601,7 @@ public:
   void SoftwareReset(uint16_t reason);
   bool AtxPower() const;
   void SetAtxPower(bool on);
+  uint32_t GetTrueRandom();	// Returns a random number from the hardware generator, different on every boot
 
   // Timing
   
@@ -577,6 +609,7 @@ public:
   void SetInterrupt(float s); // Set a regular interrupt going every s seconds; if s is -ve turn interrupt off
   //void DisableInterrupts();
   void Tick();
+  void AdcInterrupt();		// Called when the PDC has filled a block of ADC readings
   
   // Communications and data storage
   
@@ -600,6 +633,8 @@ public:
   
   MassStorage* GetMassStorage();
   FileStore* GetFileStore(const char* directory, const char* fileName, bool write);
+  FileStore* GetMacroFileStore(const char* directory, const char* fileName, bool& filledCache);	// Open a macro file for reading, using the cache if possible
+  void InvalidateMacroCache(const char* fileName = NULL);		// Forget the cached copy of a file, or all files if NULL
   const char* GetWebDir() const;		// Where the htm etc files are
   const char* GetGCodeDir() const;		// Where the gcodes are
   const char* GetSysDir() const;		// Where the system files are
@@ -645,6 +680,9 @@ public:
   float HomeFeedRate(int8_t axis) const;
   void SetHomeFeedRate(int8_t axis, float value);
   EndStopHit Stopped(int8_t drive);
+  void ArmZProbeTrigger(uint16_t endstopChecks);	// Use the ADC comparison window to catch the Z probe during a move, if possible
+  void DisarmZProbeTrigger();
+  bool ZProbeTriggered() const;					// has the armed comparison window seen the Z probe trigger?
   float AxisMaximum(int8_t axis) const;
   void SetAxisMaximum(int8_t axis, float value);
   float AxisMinimum(int8_t axis) const;
@@ -682,6 +720,9 @@ public:
   
   float GetTemperature(size_t heater) const;		// Result is in degrees Celsius
   void SetHeater(size_t heater, float power);		// power is a fraction in [0,1]
+  void SetHeaterPwmFrequency(size_t heater, float freq);
+  float GetHeaterPwmFrequency(size_t heater) const;	// the actual frequency, which may differ slightly from the one requested
+  uint32_t GetHeaterPwmResolution(size_t heater) const;	// number of PWM steps, or 255 if the pin has to use analogWrite
   float HeatSampleTime() const;
   void SetHeatSampleTime(float st);
   float GetFanValue() const;						// Result is returned in per cent
@@ -691,6 +732,15 @@ public:
   const PidParameters& GetPidParameters(size_t heater) const;
   float TimeToHot() const;
   void SetTimeToHot(float t);
+  const HeaterFaultParameters& GetHeaterFaultParameters(size_t heater) const;
+  int8_t GetHeaterZoneLeader(size_t heater) const;	// the heater this one is a zone of, or -1
+  void SetHeaterZoneLeader(size_t heater, int8_t leader);
+  unsigned int GetHeaterSampleMultiple(size_t heater) const;	// the heater is controlled every this many heat sample times
+  void SetHeaterSampleMultiple(size_t heater, unsigned int multiple);
+  float GetHeaterStaggerTime() const;
+  void SetHeaterStaggerTime(float t);
+  void SetHeaterFaultParameters(size_t heater, const HeaterFaultParameters& params);
+  void SetDefaultHeaterFaultParameters(size_t heater, bool slow);	// the bed and chamber defaults if slow, else the hot end ones
   void SetThermistorNumber(size_t heater, size_t thermistor);
   int GetThermistorNumber(size_t heater) const;
 
@@ -813,9 +863,15 @@ private:
 // HEATERS - Bed is assumed to be the first
 
   int GetRawTemperature(byte heater) const;
+  void UpdateThermistorTable(size_t heater);
+  float CalcTemperature(size_t heater, int rawTemp) const;
 
   int8_t tempSensePins[HEATERS];
   int8_t heatOnPins[HEATERS];
+  uint16_t heaterPwmPeriods[HEATERS];		// PWM period in prescaled clocks, or 0 if not using the PWM peripheral
+  uint8_t heaterPwmPrescalers[HEATERS];		// PWM clock is MCK divided by 2 to the power of this
+  float heaterPwmFrequencies[HEATERS];		// requested PWM frequencies
+  uint32_t heaterPwmPending;				// bitmap of heaters whose PWM channel is being disabled to change its prescaler
   float heatSampleTime;
   float standbyTemperatures[HEATERS];
   float activeTemperatures[HEATERS];
@@ -823,6 +879,10 @@ private:
   int8_t coolingFanPin;
   int8_t coolingFanRpmPin;
   float timeToHot;
+  HeaterFaultParameters heaterFaultParameters[HEATERS];
+  int8_t heaterZoneLeaders[HEATERS];
+  uint8_t heaterSampleMultiples[HEATERS];
+  float heaterStaggerTime;
   float lastRpmResetTime;
 
 // Serial/USB
@@ -838,6 +898,20 @@ private:
   MassStorage* massStorage;
   FileStore* files[MAX_FILES];
   bool fileStructureInitialised;
+
+  struct MacroCacheEntry
+  {
+	  char fileName[SHORT_STRING_LENGTH];		// combined file name, empty if the entry is unused
+	  size_t offset;							// where the file contents start in macroCache
+	  size_t length;
+  };
+
+  char macroCache[MACRO_CACHE_SIZE];
+  size_t macroCacheUsed;
+  MacroCacheEntry macroCacheEntries[MAX_CACHED_MACROS];
+
+  bool CacheMacroFile(FileStore *f, const char* location);
+  void CompactMacroCache();
   const char* webDir;
   const char* gcodeDir;
   const char* sysDir;
@@ -845,17 +919,40 @@ private:
   const char* configFile;
   const char* defaultFile;
   
-// Data used by the tick interrupt handler
+// Data used by the ADC and tick interrupt handlers
 
   adc_channel_num_t heaterAdcChannels[HEATERS];
   adc_channel_num_t zProbeAdcChannel;
   uint32_t thermistorOverheatSums[HEATERS];
-  uint8_t tickState;
-  uint8_t currentHeater;
+  ThermistorTable thermistorTables[HEATERS];		// interpolation tables for converting readings to temperatures
+  int thermistorDisconnectedReadings[HEATERS];		// raw readings at or above this mean the thermistor is disconnected
+  float thermistorAdcScales[HEATERS];				// corrects readings for the ADC low and high offsets
   int debugCode;
 
-  static uint16_t GetAdcReading(adc_channel_num_t chan);
-  static void StartAdcConversion(adc_channel_num_t chan);
+  uint16_t adcBuffer[adcBlocks][adcScansPerBlock * numAdcChannels];	// PDC ring, each reading tagged with its channel number
+  uint16_t adcDiscardBuffer[adcScansPerBlock * numAdcChannels];	// where the PDC puts readings when the ring is full
+  bool adcBlockIrOn[adcBlocks];				// whether the IR LED was on while each block was filled
+  size_t adcFillingSlot;					// ring block the PDC is filling, or adcBlocks for the discard buffer
+  size_t adcNextSlot;						// ring block the PDC fills next, or adcBlocks for the discard buffer
+  bool adcIrOn;								// whether the IR LED is on for the block being filled
+  size_t adcWordsPerBlock;					// readings in each block, depending on how many channels are enabled
+  volatile uint32_t adcBlocksFilled;		// number of blocks completed by the PDC
+  volatile uint32_t adcBlocksProcessed;		// number of blocks reduced into the filters
+  volatile bool adcProcessing;				// set while the main loop is reducing blocks
+  uint32_t adcOverruns;						// number of blocks of readings discarded because the ring was full
+  uint32_t adcBlocksProcessedInTick;		// number of blocks the tick had to process because the main loop fell behind
+  uint16_t lastZProbeReading;				// latest block average of the Z probe channel
+  volatile bool zProbeArmed;				// is the ADC comparison window watching the Z probe?
+  volatile bool zProbeTriggered;			// has the comparison window seen the Z probe reach its threshold?
+  uint8_t zProbeMatches;					// readings above the threshold in the current block
+  uint32_t zProbeWindowTriggers;			// number of times the comparison window has stopped a move
+
+  void InitialiseAdc();
+  void InitialiseHeaterPwm(size_t heater);
+  void StartHeaterPwm(size_t heater);
+  void FinishHeaterPwm();
+  void ProcessAdcBlocks();
+  void ProcessAdcBlock(size_t block);
   static adc_channel_num_t PinToAdcChannel(int pin);
 
   char messageStringBuffer[messageStringLength];
@@ -910,6 +1007,11 @@ public:
 		return f->Flush();
 	}
 
+	bool Preallocate(unsigned long length, unsigned long growth = 0)
+	{
+		return f->Preallocate(length, growth);
+	}
+
 	bool Seek(unsigned long position)
 	{
 		return f->Seek(position);
@@ -966,6 +1068,11 @@ private:
 
 // Where the htm etc files are
 
+inline bool FileStore::IsCached() const
+{
+	return cachedData != NULL;
+}
+
 inline const char* Platform::GetWebDir() const
 {
   return webDir;
@@ -1162,6 +1269,11 @@ inline int Platform::GetRawTemperature(byte heater) const
 		  : 0;
 }
 
+inline bool Platform::ZProbeTriggered() const
+{
+	return zProbeArmed && zProbeTriggered;
+}
+
 inline float Platform::HeatSampleTime() const
 {
   return heatSampleTime;
@@ -1182,6 +1294,46 @@ inline void Platform::SetTimeToHot(float t)
 	timeToHot = t;
 }
 
+inline const HeaterFaultParameters& Platform::GetHeaterFaultParameters(size_t heater) const
+{
+	return heaterFaultParameters[heater];
+}
+
+inline void Platform::SetHeaterFaultParameters(size_t heater, const HeaterFaultParameters& params)
+{
+	heaterFaultParameters[heater] = params;
+}
+
+inline int8_t Platform::GetHeaterZoneLeader(size_t heater) const
+{
+	return heaterZoneLeaders[heater];
+}
+
+inline void Platform::SetHeaterZoneLeader(size_t heater, int8_t leader)
+{
+	heaterZoneLeaders[heater] = leader;
+}
+
+inline unsigned int Platform::GetHeaterSampleMultiple(size_t heater) const
+{
+	return heaterSampleMultiples[heater];
+}
+
+inline void Platform::SetHeaterSampleMultiple(size_t heater, unsigned int multiple)
+{
+	heaterSampleMultiples[heater] = (multiple < 1) ? 1 : (multiple > MAX_SAMPLE_MULTIPLE) ? MAX_SAMPLE_MULTIPLE : (uint8_t)multiple;
+}
+
+inline float Platform::GetHeaterStaggerTime() const
+{
+	return heaterStaggerTime;
+}
+
+inline void Platform::SetHeaterStaggerTime(float t)
+{
+	heaterStaggerTime = t;
+}
+
 inline const unsigned char* Platform::IPAddress() const
 {
 	return nvData.ipAddress;
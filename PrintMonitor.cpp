@@ -22,8 +22,12 @@ Licence: GPL
 PrintMonitor::PrintMonitor(Platform *p, GCodes *gc) : platform(p), gCodes(gc), fileInfoDetected(false),
 			printStartTime(0.0), currentLayer(0), firstLayerDuration(0.0), firstLayerHeight(0.0),
 			firstLayerFilament(0.0), firstLayerProgress(0.0), warmUpDuration(0.0), layerEstimatedTimeLeft(0.0),
-			lastLayerTime(0.0), lastLayerFilament(0.0), numLayerSamples(0)
+			lastLayerTime(0.0), lastLayerFilament(0.0), numLayerSamples(0), nextCachedFileInfo(0)
 {
+	for(size_t i=0; i<MAX_CACHED_FILE_INFO; i++)
+	{
+		cachedFileNames[i][0] = 0;
+	}
 }
 
 void PrintMonitor::Init()
@@ -215,6 +219,12 @@ void PrintMonitor::StoppedPrint()
 	lastLayerTime = lastLayerFilament = 0.0;
 }
 
+// Return true if the specified file name looks like a G-code file that we can parse
+static bool IsGcodeFileName(const char *fileName)
+{
+	return StringEndsWith(fileName, ".gcode") || StringEndsWith(fileName, ".g") || StringEndsWith(fileName, ".gco") || StringEndsWith(fileName, ".gc");
+}
+
 bool PrintMonitor::GetFileInfo(const char *directory, const char *fileName, GcodeFileInfo& info) const
 {
 	if (reprap.GetPlatform()->GetMassStorage()->PathExists(directory, fileName))
@@ -226,8 +236,16 @@ bool PrintMonitor::GetFileInfo(const char *directory, const char *fileName, Gcod
 	FileStore *f = reprap.GetPlatform()->GetFileStore(directory, fileName, false);
 	if (f != NULL)
 	{
-		// Try to find the object height by looking for the last G1 Zxxx command in the file
 		info.fileSize = f->Length();
+
+		// See if we collected the information for this file while it was being uploaded
+		if (IsGcodeFileName(fileName) && FindCachedFileInfo(platform->GetMassStorage()->CombineName(directory, fileName), info.fileSize, info))
+		{
+			f->Close();
+			return true;
+		}
+
+		// Try to find the object height by looking for the last G1 Zxxx command in the file
 		info.objectHeight = 0.0;
 		info.layerHeight = 0.0;
 		info.numFilaments = 0;
@@ -237,7 +255,7 @@ bool PrintMonitor::GetFileInfo(const char *directory, const char *fileName, Gcod
 			info.filamentNeeded[extr] = 0.0;
 		}
 
-		if (info.fileSize != 0 && (StringEndsWith(fileName, ".gcode") || StringEndsWith(fileName, ".g") || StringEndsWith(fileName, ".gco") || StringEndsWith(fileName, ".gc")))
+		if (info.fileSize != 0 && IsGcodeFileName(fileName))
 		{
 			const size_t readSize = 512;					// read 512 bytes at a time (1K doesn't seem to work when we read from the end)
 			const size_t overlap = 100;
@@ -283,55 +301,7 @@ bool PrintMonitor::GetFileInfo(const char *directory, const char *fileName, Gcod
 					// Look for slicer program
 					if (!info.generatedBy[0])
 					{
-						// Slic3r and S3D
-						const char* generatedByString = "generated by ";
-						char* pos = strstr(buf, generatedByString);
-						size_t generatedByLength = ARRAY_SIZE(info.generatedBy);
-						if (pos != NULL)
-						{
-							pos += strlen(generatedByString);
-							size_t i = 0;
-							while (i < ARRAY_SIZE(info.generatedBy) - 1 && *pos >= ' ')
-							{
-								char c = *pos++;
-								if (c == '"' || c == '\\')
-								{
-									// Need to escape the quote-mark for JSON
-									if (i > ARRAY_SIZE(info.generatedBy) - 3)
-									{
-										break;
-									}
-									info.generatedBy[i++] = '\\';
-								}
-								info.generatedBy[i++] = c;
-							}
-							info.generatedBy[i] = 0;
-						}
-
-						// Cura
-						const char* slicedAtString = ";Sliced at: ";
-						pos = strstr(buf, slicedAtString);
-						if (pos != NULL)
-						{
-							pos += strlen(slicedAtString);
-							strcpy(info.generatedBy, "Cura at ");
-							size_t i = 8;
-							while (i < ARRAY_SIZE(info.generatedBy) - 1 && *pos >= ' ')
-							{
-								char c = *pos++;
-								if (c == '"' || c == '\\')
-								{
-									// Need to escape the quote-mark for JSON
-									if (i > ARRAY_SIZE(info.generatedBy) - 3)
-									{
-										break;
-									}
-									info.generatedBy[i++] = '\\';
-								}
-								info.generatedBy[i++] = c;
-							}
-							info.generatedBy[i] = 0;
-						}
+						FindGeneratedBy(buf, info);
 					}
 
 					// Add code to look for other values here...
@@ -743,3 +713,274 @@ unsigned int PrintMonitor::FindFilamentUsed(const char* buf, size_t len, float *
 
 	return filamentsFound;
 }
+
+// Scan the buffer for the slicer program. The buffer is null-terminated.
+void PrintMonitor::FindGeneratedBy(const char* buf, GcodeFileInfo& info) const
+{
+	// Slic3r and S3D
+	const char* generatedByString = "generated by ";
+	const char* pos = strstr(buf, generatedByString);
+	if (pos != NULL)
+	{
+		pos += strlen(generatedByString);
+		size_t i = 0;
+		while (i < ARRAY_SIZE(info.generatedBy) - 1 && *pos >= ' ')
+		{
+			char c = *pos++;
+			if (c == '"' || c == '\\')
+			{
+				// Need to escape the quote-mark for JSON
+				if (i > ARRAY_SIZE(info.generatedBy) - 3)
+				{
+					break;
+				}
+				info.generatedBy[i++] = '\\';
+			}
+			info.generatedBy[i++] = c;
+		}
+		info.generatedBy[i] = 0;
+	}
+
+	// Cura
+	const char* slicedAtString = ";Sliced at: ";
+	pos = strstr(buf, slicedAtString);
+	if (pos != NULL)
+	{
+		pos += strlen(slicedAtString);
+		strcpy(info.generatedBy, "Cura at ");
+		size_t i = 8;
+		while (i < ARRAY_SIZE(info.generatedBy) - 1 && *pos >= ' ')
+		{
+			char c = *pos++;
+			if (c == '"' || c == '\\')
+			{
+				// Need to escape the quote-mark for JSON
+				if (i > ARRAY_SIZE(info.generatedBy) - 3)
+				{
+					break;
+				}
+				info.generatedBy[i++] = '\\';
+			}
+			info.generatedBy[i++] = c;
+		}
+		info.generatedBy[i] = 0;
+	}
+}
+
+// Remember the file information that was collected while a file was being uploaded
+void PrintMonitor::StoreFileInfo(const char *fileName, const GcodeFileInfo& info)
+{
+	// Replace an existing entry for the same file if there is one, otherwise replace the oldest entry
+	size_t slot = nextCachedFileInfo;
+	for(size_t i=0; i<MAX_CACHED_FILE_INFO; i++)
+	{
+		if (cachedFileNames[i][0] != 0 && FileNamesMatch(cachedFileNames[i], fileName))
+		{
+			slot = i;
+			break;
+		}
+	}
+	if (slot == nextCachedFileInfo)
+	{
+		nextCachedFileInfo = (nextCachedFileInfo + 1) % MAX_CACHED_FILE_INFO;
+	}
+
+	strncpy(cachedFileNames[slot], fileName, ARRAY_SIZE(cachedFileNames[slot]));
+	cachedFileNames[slot][ARRAY_UPB(cachedFileNames[slot])] = 0;
+	cachedFileInfo[slot] = info;
+}
+
+// Discard any file information we hold for a file that is being overwritten
+void PrintMonitor::ForgetFileInfo(const char *directory, const char *fileName)
+{
+	const char *location = (directory != NULL) ? platform->GetMassStorage()->CombineName(directory, fileName) : fileName;
+	for(size_t i=0; i<MAX_CACHED_FILE_INFO; i++)
+	{
+		if (cachedFileNames[i][0] != 0 && FileNamesMatch(cachedFileNames[i], location))
+		{
+			cachedFileNames[i][0] = 0;
+		}
+	}
+}
+
+// Look up the file information collected during an upload. The file size must still match.
+bool PrintMonitor::FindCachedFileInfo(const char *fileName, unsigned long fileSize, GcodeFileInfo& info) const
+{
+	for(size_t i=0; i<MAX_CACHED_FILE_INFO; i++)
+	{
+		if (cachedFileNames[i][0] != 0 && cachedFileInfo[i].fileSize == fileSize && FileNamesMatch(cachedFileNames[i], fileName))
+		{
+			info = cachedFileInfo[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+//*************************************************************************************************
+// GcodeFileScanner class
+
+GcodeFileScanner::GcodeFileScanner() : active(false), linePointer(0)
+{
+}
+
+// Start scanning the data of a new upload. Only G-code files are scanned.
+void GcodeFileScanner::Start(const char *fileName)
+{
+	active = IsGcodeFileName(fileName);
+	foundLayerHeight = filamentsDone = heightPending = false;
+	pendingHeight = 0.0;
+	linePointer = 0;
+
+	fileInfo.fileSize = 0;
+	fileInfo.objectHeight = 0.0;
+	fileInfo.layerHeight = 0.0;
+	fileInfo.numFilaments = 0;
+	fileInfo.generatedBy[0] = 0;
+	for(size_t extr=0; extr<DRIVES - AXES; extr++)
+	{
+		fileInfo.filamentNeeded[extr] = 0.0;
+	}
+}
+
+// Split the uploaded data into lines and process each complete line. Overlong lines are truncated.
+void GcodeFileScanner::Scan(const char *data, size_t len)
+{
+	if (active)
+	{
+		while (len != 0)
+		{
+			char c = *data++;
+			--len;
+			if (c == '\n' || c == '\r')
+			{
+				ProcessLine();
+			}
+			else if (linePointer < ARRAY_UPB(line))
+			{
+				line[linePointer++] = c;
+			}
+		}
+	}
+}
+
+// Process the last line and return true if we have collected valid file information
+bool GcodeFileScanner::Finish(unsigned long fileSize)
+{
+	if (!active)
+	{
+		return false;
+	}
+
+	ProcessLine();
+	if (heightPending)
+	{
+		fileInfo.objectHeight = pendingHeight;
+		heightPending = false;
+	}
+	fileInfo.fileSize = fileSize;
+	active = false;
+	return true;
+}
+
+// Look for the same values as PrintMonitor::GetFileInfo in a single line of G-code
+void GcodeFileScanner::ProcessLine()
+{
+	line[linePointer] = 0;
+	const char *p = line;
+	size_t len = linePointer;
+	linePointer = 0;
+
+	while (*p == ' ' || *p == '\t')
+	{
+		++p;
+		--len;
+	}
+	if (*p == 0)
+	{
+		return;
+	}
+
+	// The last Z move counts as the object height unless it is followed by the end G-code (see PrintMonitor::FindHeight)
+	if (heightPending)
+	{
+		if (p[0] != ';' || p[1] != 'E')
+		{
+			fileInfo.objectHeight = pendingHeight;
+		}
+		heightPending = false;
+	}
+
+	if (*p == ';')
+	{
+		const PrintMonitor *printMonitor = reprap.GetPrintMonitor();
+		if (!foundLayerHeight)
+		{
+			foundLayerHeight = printMonitor->FindLayerHeight(p, len, fileInfo.layerHeight);
+		}
+
+		// Filament usage is reported on consecutive comment lines, one per extruder
+		if (!filamentsDone && fileInfo.numFilaments < DRIVES - AXES)
+		{
+			unsigned int nFilaments = printMonitor->FindFilamentUsed(p, len, fileInfo.filamentNeeded + fileInfo.numFilaments, DRIVES - AXES - fileInfo.numFilaments);
+			if (nFilaments != 0)
+			{
+				fileInfo.numFilaments += nFilaments;
+			}
+			else if (fileInfo.numFilaments != 0)
+			{
+				filamentsDone = true;
+			}
+		}
+
+		if (!fileInfo.generatedBy[0])
+		{
+			printMonitor->FindGeneratedBy(p, fileInfo);
+		}
+	}
+	else
+	{
+		if (fileInfo.numFilaments != 0)
+		{
+			filamentsDone = true;
+		}
+
+		// Skip any line number, e.g. N123 G1 Z0.3*45
+		if (*p == 'N' || *p == 'n')
+		{
+			do
+			{
+				++p;
+			} while (*p >= '0' && *p <= '9');
+			while (*p == ' ' || *p == '\t')
+			{
+				++p;
+			}
+		}
+
+		// Look for a G0/G1 move (also written G00/G01 or in lower case) with a Z parameter outside the comment
+		if (*p != 'G' && *p != 'g')
+		{
+			return;
+		}
+		const char *q = p + 1;
+		unsigned int code = 0;
+		while (*q >= '0' && *q <= '9')
+		{
+			code = (10 * code) + (*q - '0');
+			++q;
+		}
+		if (q != p + 1 && code <= 1 && (*q == ' ' || *q == '\t'))
+		{
+			for (; *q != 0 && *q != ';'; ++q)
+			{
+				if (*q == 'Z' || *q == 'z')
+				{
+					pendingHeight = strtod(q + 1, NULL);
+					heightPending = true;
+					break;
+				}
+			}
+		}
+	}
+}
@@ -37,6 +37,28 @@ struct GcodeFileInfo
 	char generatedBy[50];
 };
 
+// Class to collect G-code file information from data that is being uploaded, so that
+// the file need not be read back from the SD card when its information is requested later
+class GcodeFileScanner
+{
+	public:
+		GcodeFileScanner();
+		void Start(const char *fileName);				// called when an upload starts
+		void Scan(const char *data, size_t len);		// called for each chunk of uploaded data
+		bool Finish(unsigned long fileSize);			// called when the upload has finished, returns true if the info is valid
+		const GcodeFileInfo& GetFileInfo() const;
+
+	private:
+		bool active;
+		bool foundLayerHeight, filamentsDone, heightPending;
+		float pendingHeight;
+		char line[GCODE_LENGTH];
+		size_t linePointer;
+		GcodeFileInfo fileInfo;
+
+		void ProcessLine();
+};
+
 class PrintMonitor
 {
 	public:
@@ -61,6 +83,11 @@ class PrintMonitor
 		float GetFirstLayerDuration() const;
 		float GetFirstLayerHeight() const;
 
+		void StoreFileInfo(const char *fileName, const GcodeFileInfo& info);	// remember file info collected during an upload
+		void ForgetFileInfo(const char *directory, const char *fileName);		// called when a file is overwritten
+
+		friend class GcodeFileScanner;
+
 	private:
 		Platform *platform;
 		GCodes *gCodes;
@@ -86,11 +113,20 @@ class PrintMonitor
 	    float fileProgressPerLayer[MAX_LAYER_SAMPLES];
 	    float layerEstimatedTimeLeft;
 
+	    GcodeFileInfo cachedFileInfo[MAX_CACHED_FILE_INFO];
+	    char cachedFileNames[MAX_CACHED_FILE_INFO][FILENAME_LENGTH];
+	    size_t nextCachedFileInfo;
+
+	    bool FindCachedFileInfo(const char *fileName, unsigned long fileSize, GcodeFileInfo& info) const;
+
 	    bool FindHeight(const char* buf, size_t len, float& height) const;
 	    bool FindLayerHeight(const char* buf, size_t len, float& layerHeight) const;
 	    unsigned int FindFilamentUsed(const char* buf, size_t len, float *filamentUsed, unsigned int maxFilaments) const;
+	    void FindGeneratedBy(const char* buf, GcodeFileInfo& info) const;
 };
 
+inline const GcodeFileInfo& GcodeFileScanner::GetFileInfo() const { return fileInfo; }
+
 inline const char *PrintMonitor::GetPrintFilename() const { return fileBeingPrinted; }
 inline unsigned int PrintMonitor::GetCurrentLayer() const { return currentLayer; }
 inline float PrintMonitor::GetCurrentLayerTime() const { return (lastLayerTime > 0.0) ? (platform->Time() - lastLayerTime) : 0.0; }
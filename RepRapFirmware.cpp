@@ -192,10 +192,21 @@ void RepRap::Init()
 
 	gcodeReply[0] = 0;
 	replySeq = webSeq = auxSeq = 0;
+	messageSeq = 0;
+
+	for (size_t i = 0; i < numStatusWords; i++)
+	{
+		statusWords[i] = 0;
+		statusWordSeqs[i] = 0;
+	}
 	processingConfig = true;
 
 	// All of the following init functions must execute reasonably quickly before the watchdog times us out
 	platform->Init();
+
+	// Start the status sequence numbers from a different point on each boot, so that a client still holding
+	// a sequence number from before a reset gets the whole status block. Leave plenty of room for counting up.
+	statusBaseSeq = statusSeq = (platform->GetTrueRandom() & 0x3FFFFFFF) + 1;
 	gCodes->Init();
 	webserver->Init();
 	move->Init();
@@ -426,6 +437,36 @@ void RepRap::PrintDebug()
 	}
 }
 
+// A chamber heats as slowly as a bed, so it gets the bed's heating fault thresholds while it is the chamber heater,
+// and so do its zones. A heater that stops being the chamber heater goes back to the defaults for its index.
+void RepRap::SetChamberHeater(int8_t heater)
+{
+	const int8_t oldHeater = chamberHeater;
+	if (heater == oldHeater)
+	{
+		return;
+	}
+
+	chamberHeater = heater;
+	if (oldHeater >= 0)
+	{
+		platform->SetDefaultHeaterFaultParameters(oldHeater, oldHeater == HOT_BED);
+	}
+	if (heater >= 0)
+	{
+		platform->SetDefaultHeaterFaultParameters(heater, true);
+	}
+	for (size_t h = 0; h < HEATERS; ++h)
+	{
+		const int8_t leader = platform->GetHeaterZoneLeader(h);
+		if (leader >= 0 && (leader == oldHeater || leader == heater))
+		{
+			platform->SetHeaterFaultParameters(h, platform->GetHeaterFaultParameters(leader));
+		}
+	}
+	heat->UpdateAllParameters();
+}
+
 void RepRap::AddTool(Tool* tool)
 {
 	if(toolList == NULL)
@@ -959,6 +1000,94 @@ void RepRap::GetStatusResponse(StringRef& response, uint8_t type, bool forWebser
 	response.cat("}");
 }
 
+// Compact status response. Instead of formatting the whole status as JSON, we keep it as a fixed block of
+// scaled integers and only send the ones that have changed since status sequence number 'from'. Each change
+// is sent as an index into the block followed by the new value. If 'from' is 0 or unknown (e.g. from before a reset)
+// the whole block is sent, together with its layout. Returns the current status sequence number.
+uint32_t RepRap::GetCompactStatusResponse(StringRef& response, uint32_t from)
+{
+	UpdateStatusWords();
+
+	const bool sendAll = (from < statusBaseSeq || from > statusSeq);
+	response.printf("{\"seq\":%u", (unsigned int)statusSeq);
+	if (sendAll)
+	{
+		response.catf(",\"layout\":[%d,%d,%d]", AXES, DRIVES - AXES, HEATERS);
+	}
+
+	char ch = '[';
+	response.cat(",\"d\":");
+	for (size_t i = 0; i < numStatusWords; i++)
+	{
+		if (sendAll || statusWordSeqs[i] > from)
+		{
+			response.catf("%c%u,%ld", ch, (unsigned int)i, (long)statusWords[i]);
+			ch = ',';
+		}
+	}
+	response.cat((ch == '[') ? "[]}" : "]}");
+	return statusSeq;
+}
+
+// Bring the compact status block up to date, advancing the status sequence number if anything has changed
+void RepRap::UpdateStatusWords()
+{
+	int32_t words[numStatusWords];
+
+	words[swStatus] = GetStatusCharacter();
+	words[swAxesHomed] = 0;
+	for (size_t axis = 0; axis < AXES; axis++)
+	{
+		if (gCodes->GetAxisIsHomed(axis))
+		{
+			words[swAxesHomed] |= (1 << axis);
+		}
+	}
+	words[swCurrentTool] = (currentTool == NULL) ? -1 : currentTool->Number();
+	words[swAtxPower] = platform->AtxPower() ? 1 : 0;
+	const float fanValue = (gCodes->CoolingInverted() ? 1.0 - platform->GetFanValue() : platform->GetFanValue());
+	words[swFanPercent] = (int32_t)roundf(fanValue * 10000.0);
+	words[swSpeedFactor] = (int32_t)roundf(move->GetSpeedFactor() * 10000.0);
+	words[swProbeValue] = platform->ZProbe();
+	words[swFanRPM] = (int32_t)platform->GetFanRPM();
+	words[swReplySeq] = GetReplySeq();
+
+	float liveCoordinates[DRIVES + 1];
+	move->LiveCoordinates(liveCoordinates);
+	for (size_t axis = 0; axis < AXES; axis++)
+	{
+		words[swXyz + axis] = (int32_t)roundf(liveCoordinates[axis] * 100.0);
+	}
+	for (size_t extruder = 0; extruder < DRIVES - AXES; extruder++)
+	{
+		words[swExtruders + extruder] = (int32_t)roundf(liveCoordinates[AXES + extruder] * 10.0);
+		words[swExtrFactors + extruder] = (int32_t)roundf(move->GetExtrusionFactor(extruder) * 10000.0);
+	}
+
+	for (size_t heater = 0; heater < HEATERS; heater++)
+	{
+		words[swCurrentTemps + heater] = (int32_t)roundf(heat->GetTemperature(heater) * 10.0);
+		words[swActiveTemps + heater] = (int32_t)roundf(heat->GetActiveTemperature(heater) * 10.0);
+		words[swStandbyTemps + heater] = (int32_t)roundf(heat->GetStandbyTemperature(heater) * 10.0);
+		words[swHeaterStates + heater] = static_cast<int32_t>(heat->GetStatus(heater));
+	}
+
+	bool changed = false;
+	for (size_t i = 0; i < numStatusWords; i++)
+	{
+		if (words[i] != statusWords[i] || statusSeq == statusBaseSeq)
+		{
+			if (!changed)
+			{
+				++statusSeq;
+				changed = true;
+			}
+			statusWords[i] = words[i];
+			statusWordSeqs[i] = statusSeq;
+		}
+	}
+}
+
 void RepRap::GetConfigResponse(StringRef& response)
 {
 	// Axis minima
@@ -1432,6 +1561,7 @@ void RepRap::SetMessage(const char *msg)
 {
 	strncpy(message, msg, SHORT_STRING_LENGTH);
 	message[SHORT_STRING_LENGTH - 1] = 0;
+	messageSeq++;
 }
 
 void RepRap::MessageToGCodeReply(const char *message)
@@ -1667,3 +1797,38 @@ int StringContains(const char* string, const char* match)
 
 	return -1;
 }
+
+// Compare two file names, ignoring the drive prefix, letter case and repeated slashes
+bool FileNamesMatch(const char *a, const char *b)
+{
+	if (StringStartsWith(a, "0:"))
+	{
+		a += 2;
+	}
+	if (StringStartsWith(b, "0:"))
+	{
+		b += 2;
+	}
+
+	for (;;)
+	{
+		if (*a == '/' && *b == '/')
+		{
+			while (*a == '/') { ++a; }
+			while (*b == '/') { ++b; }
+		}
+		else if (tolower(*a) != tolower(*b))
+		{
+			return false;
+		}
+		else if (*a == 0)
+		{
+			return true;
+		}
+		else
+		{
+			++a;
+			++b;
+		}
+	}
+}
@@ -79,6 +79,7 @@ bool StringEndsWith(const char* string, const char* ending);
 bool StringStartsWith(const char* string, const char* starting);
 bool StringEquals(const char* s1, const char* s2);
 int StringContains(const char* string, const char* match);
+bool FileNamesMatch(const char* a, const char* b);
   
 // Macro to give us the number of elements in an array
 #define ARRAY_SIZE(_x)	(sizeof(_x)/sizeof(_x[0]))
@@ -125,6 +126,11 @@ extern StringRef scratchString;
 
 #include "Arduino.h"
 #include "Configuration.h"
+#include "Thermistor.h"
+#include "AutoTune.h"
+#include "PidControl.h"
+#include "FeedForward.h"
+#include "HeaterSchedule.h"
 #include "Network.h"
 #include "Platform.h"
 #include "Webserver.h"
@@ -83,6 +83,7 @@ class RepRap
     uint16_t GetHeatersInUse() const;
 
     void GetStatusResponse(StringRef& response, uint8_t type, bool forWebserver);
+    uint32_t GetCompactStatusResponse(StringRef& response, uint32_t from);
     void GetConfigResponse(StringRef& response);
     void GetLegacyStatusResponse(StringRef &response, uint8_t type, int seq);
     void GetNameResponse(StringRef& response) const;
@@ -90,6 +91,9 @@ class RepRap
 
     void Beep(int freq, int ms);
     void SetMessage(const char *msg);
+    const char *GetMessage() const;
+    unsigned int GetMessageSeq() const;
+    unsigned int GetReplySeq() const;
     
     void MessageToGCodeReply(const char *message);
     void AppendMessageToGCodeReply(const char *message);
@@ -104,7 +108,30 @@ class RepRap
     static void EncodeString(StringRef& response, const char* src, size_t spaceToLeave, bool allowControlChars);
   
     char GetStatusCharacter() const;
-    unsigned int GetReplySeq() const;
+    void UpdateStatusWords();
+
+    // Layout of the compact status block, which holds the status as scaled integers so that only the ones
+    // that have changed need to be sent. See rr_statusdelta in Webserver.cpp.
+    enum StatusWord
+    {
+    	swStatus = 0,										// status character
+    	swAxesHomed,										// bitmap of homed axes
+    	swCurrentTool,
+    	swAtxPower,
+    	swFanPercent,										// hundredths of a percent
+    	swSpeedFactor,										// hundredths of a percent
+    	swProbeValue,
+    	swFanRPM,
+    	swReplySeq,
+    	swXyz,												// AXES words, hundredths of a mm
+    	swExtruders = swXyz + AXES,							// DRIVES - AXES words, tenths of a mm
+    	swExtrFactors = swExtruders + DRIVES - AXES,		// DRIVES - AXES words, hundredths of a percent
+    	swCurrentTemps = swExtrFactors + DRIVES - AXES,		// HEATERS words, tenths of a degree
+    	swActiveTemps = swCurrentTemps + HEATERS,			// HEATERS words, tenths of a degree
+    	swStandbyTemps = swActiveTemps + HEATERS,			// HEATERS words, tenths of a degree
+    	swHeaterStates = swStandbyTemps + HEATERS,			// HEATERS words
+    	numStatusWords = swHeaterStates + HEATERS
+    };
 
     Platform* platform;
     Network* network;
@@ -138,11 +165,17 @@ class RepRap
 
     int beepFrequency, beepDuration;
     char message[SHORT_STRING_LENGTH + 1];
+    unsigned int messageSeq;						// Incremented each time a new message is set
 
     char gcodeReplyBuffer[GCODE_REPLY_LENGTH];
     StringRef gcodeReply;
     unsigned int replySeq;							// The current reply sequence number
     unsigned int webSeq, auxSeq;					// The last-known reply sequence number for web and AUX
+
+    int32_t statusWords[numStatusWords];			// The compact status when it was last requested
+    uint32_t statusWordSeqs[numStatusWords];		// The status sequence number at which each word last changed
+    uint32_t statusSeq;								// The current status sequence number
+    uint32_t statusBaseSeq;							// The status sequence number we started from on this boot
 };
 
 inline Platform* RepRap::GetPlatform() const { return platform; }
@@ -160,7 +193,6 @@ inline Tool* RepRap::GetCurrentTool() { return currentTool; }
 inline uint16_t RepRap::GetExtrudersInUse() const { return activeExtruders; }
 inline uint16_t RepRap::GetHeatersInUse() const { return activeHeaters; }
 
-inline void RepRap::SetChamberHeater(int8_t heater) { chamberHeater = heater; }
 inline int8_t RepRap::GetChamberHeater() const { return chamberHeater; }
 
 inline bool RepRap::ColdExtrude() { return coldExtrude; }
@@ -210,6 +242,8 @@ inline uint16_t RepRap::GetTicksInSpinState() const { return ticksInSpinState; }
 
 inline const StringRef& RepRap::GetGcodeReply() { webSeq = replySeq; return gcodeReply; }
 inline unsigned int RepRap::GetReplySeq() const { return replySeq; }
+inline const char *RepRap::GetMessage() const { return message; }
+inline unsigned int RepRap::GetMessageSeq() const { return messageSeq; }
 
 #endif
 
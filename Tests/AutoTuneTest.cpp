@@ -0,0 +1,110 @@
+// Host test for relay auto tuning (AutoTune.cpp). Runs the relay against simulated first-order-plus-dead-time heaters,
+// sampled as often as PID::Spin would sample them, and checks that the fit recovers the heater's gain, time constant
+// and dead time.
+
+#include <vector>
+#include "Check.h"
+#include "../Configuration.h"
+#include "../AutoTune.h"
+
+const double ambient = 25.0;
+const double simulationStep = 0.01;			// seconds
+
+// dT/dt = (gain * pwm(t - deadTime) - (T - ambient))/timeConstant
+class SimulatedHeater
+{
+  public:
+	SimulatedHeater(double g, double tc, double dt)
+		: gain(g), timeConstant(tc), temperature(ambient), delayed((size_t)(dt/simulationStep + 0.5), 0.0), next(0) {}
+
+	void Run(double pwm, double seconds)
+	{
+		for (double t = 0.0; t < seconds - simulationStep/2; t += simulationStep)
+		{
+			double applied = pwm;
+			if (!delayed.empty())
+			{
+				applied = delayed[next];
+				delayed[next] = pwm;
+				next = (next + 1) % delayed.size();
+			}
+			temperature += (gain * applied - (temperature - ambient)) * simulationStep/timeConstant;
+		}
+	}
+
+	double Temperature() const { return temperature; }
+
+  private:
+	double gain, timeConstant, temperature;
+	std::vector<double> delayed;
+	size_t next;
+};
+
+struct TestCase
+{
+	const char *name;
+	double gain, timeConstant, deadTime;		// the simulated heater
+	float target, power, sampleInterval;		// how we tune it
+};
+
+static const TestCase cases[] =
+{
+	{ "hot end", 300.0, 150.0, 4.0, 200.0, 1.0, 0.5 },
+	{ "hot end at reduced power", 300.0, 150.0, 4.0, 180.0, 0.8, 0.5 },
+	{ "bed", 110.0, 500.0, 12.0, 70.0, 1.0, 2.0 }
+};
+
+static void RunCase(const TestCase& tc)
+{
+	SimulatedHeater heater(tc.gain, tc.timeConstant, tc.deadTime);
+	RelayTuner tuner;
+	float now = 0.0;
+	tuner.Start(tc.target, tc.power, AUTO_TUNE_CYCLES, heater.Temperature(), now);
+
+	bool finished = false;
+	while (!finished && tuner.Elapsed(now) < 4 * AUTO_TUNE_MAX_TIME)
+	{
+		finished = tuner.Sample(heater.Temperature(), now);
+		heater.Run(tuner.Pwm(), tc.sampleInterval);
+		now += tc.sampleInterval;
+	}
+	CHECK(finished);
+	CHECK(tuner.CyclesMeasured() == AUTO_TUNE_CYCLES);
+
+	RelayTuneResult result;
+	CHECK(tuner.Fit(result));
+	printf("  %s: gain %.1fC (%.1f), time constant %.1fs (%.1f), dead time %.1fs (%.1f), Ku %.3f, Tu %.1fs, %.0fs\n",
+			tc.name, result.gain, tc.gain, result.timeConstant, tc.timeConstant, result.deadTime, tc.deadTime, result.ku, result.tu, now);
+	CHECK_NEAR(result.gain, tc.gain, 0.05 * tc.gain);
+	CHECK_NEAR(result.timeConstant, tc.timeConstant, 0.1 * tc.timeConstant);
+	CHECK_NEAR(result.deadTime, tc.deadTime, tc.sampleInterval + 0.1 * tc.deadTime);
+	CHECK(result.ku > 0.0 && result.tu > 2.0 * tc.deadTime);
+}
+
+// A heater that can't get more than the hysteresis above the target never oscillates enough to fit
+static void TestNoOscillation()
+{
+	RelayTuner tuner;
+	tuner.Start(100.0, 1.0, 2, 90.0, 0.0);
+	float now = 0.0;
+	const float temps[] = { 95.0, 101.0, 101.5, 100.0, 99.0, 99.2, 101.0, 100.5, 99.0, 99.5, 101.0, 100.0, 99.0 };
+	bool finished = false;
+	for (size_t i = 0; i < sizeof(temps)/sizeof(temps[0]) && !finished; ++i)
+	{
+		finished = tuner.Sample(temps[i], now);
+		now += 1.0;
+	}
+	CHECK(finished);
+	RelayTuneResult result;
+	CHECK(!tuner.Fit(result));
+}
+
+int main()
+{
+	for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i)
+	{
+		RunCase(cases[i]);
+	}
+	TestNoOscillation();
+	return CheckResult("AutoTuneTest");
+}
@@ -0,0 +1,34 @@
+// Minimal checking for the host tests. Each test program counts its failures and returns non-zero if there were any.
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+static int checkFailures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); ++checkFailures; } } while (0)
+
+#define CHECK_NEAR(actual, expected, tolerance) \
+	do { const double a_ = (actual), e_ = (expected); \
+		if (!(fabs(a_ - e_) <= (tolerance))) { printf("%s:%d: check failed: %s = %g, expected %g +/- %g\n", __FILE__, __LINE__, #actual, a_, e_, (double)(tolerance)); ++checkFailures; } } while (0)
+
+// Report the result at the end of main
+static inline int CheckResult(const char *name)
+{
+	printf("%s: %s\n", name, (checkFailures == 0) ? "passed" : "FAILED");
+	return (checkFailures == 0) ? 0 : 1;
+}
+
+// Wall-clock time in nanoseconds, for comparing the cost of two calculations on the host
+static inline double NanoTime()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1.0e9 + (double)ts.tv_nsec;
+}
+
+#endif
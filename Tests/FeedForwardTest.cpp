@@ -0,0 +1,156 @@
+// Host test for heater feed-forward (FeedForward.h/.cpp). Checks the running totals of planned extrusion, including
+// when they wrap, and runs the PID controller in closed loop against a simulated hot end to show that the thermal model
+// holds the temperature and reduces the sag when the fan or the extrusion rate steps up.
+
+#include "Check.h"
+#include "../Configuration.h"
+#include "../PidControl.h"
+#include "../FeedForward.h"
+
+const size_t extruders = 2;
+
+static void TestPlannedExtrusion()
+{
+	PlannedExtrusion<extruders> planned;
+	planned.Init();
+	CHECK(planned.Rate(0, 100.0) == 0.0);
+
+	// Two queued moves: 1s feeding 500 steps on extruder 0, then 0.5s feeding 100 steps on extruder 1
+	const uint32_t first[extruders] = { 500, 0 };
+	const uint32_t second[extruders] = { 0, 100 };
+	planned.Add(1000000, first);
+	planned.Add(500000, second);
+	CHECK_NEAR(planned.Rate(0, 100.0), 5.0/1.5, 1.0e-5);
+	CHECK_NEAR(planned.Rate(1, 100.0), 1.0/1.5, 1.0e-5);
+
+	// The first finishes, leaving only the second
+	planned.Remove(1000000, first);
+	CHECK_NEAR(planned.Rate(0, 100.0), 0.0, 1.0e-6);
+	CHECK_NEAR(planned.Rate(1, 100.0), 2.0, 1.0e-5);
+	planned.Remove(500000, second);
+	CHECK(planned.Rate(1, 100.0) == 0.0);
+
+	// Run the totals through their wrap, a long move at a time, and check the rate stays right throughout
+	const uint32_t longMove[extruders] = { 3000000, 1000000 };		// 10 minutes at 50 and 16.7 mm/sec
+	uint32_t total = 0;
+	bool wrapped = false;
+	for (int move = 0; move < 8000; ++move)
+	{
+		planned.Add(600000000, longMove);
+		if (move != 0)
+		{
+			CHECK_NEAR(planned.Rate(0, 100.0), 50.0, 1.0e-3);
+			CHECK_NEAR(planned.Rate(1, 100.0), 1000000.0/6000000.0 * 100.0, 1.0e-3);
+			planned.Remove(600000000, longMove);
+		}
+		wrapped = wrapped || total + 600000000u < total;
+		total += 600000000u;
+	}
+	CHECK(wrapped);
+	CHECK_NEAR(planned.Rate(0, 100.0), 50.0, 1.0e-3);
+}
+
+// A hot end that behaves as the given thermal model says
+class SimulatedHotEnd
+{
+  public:
+	SimulatedHotEnd(const ThermalModel& m, float t) : model(m), temperature(t) {}
+
+	void Run(float pwm, float fan, float filamentRate, float seconds)
+	{
+		const float step = 0.01;
+		for (float t = 0.0; t < seconds - step/2; t += step)
+		{
+			temperature += step * (model.heatingRate * pwm
+									- model.coolingRate * (temperature - 25.0) * (1.0 + model.fanFactor * fan)
+									- model.extrusionFactor * filamentRate);
+		}
+	}
+
+	float Temperature() const { return temperature; }
+
+  private:
+	ThermalModel model;
+	float temperature;
+};
+
+static void MakeModel(ThermalModel& model)
+{
+	model.Init();
+	model.heatingRate = 2.0;
+	model.coolingRate = 1.0/150.0;
+	model.fanFactor = 0.4;
+	model.extrusionFactor = 0.1;
+	model.enabled = true;
+}
+
+static void TestSteadyState()
+{
+	ThermalModel model;
+	MakeModel(model);
+	CHECK(model.IsValid());
+	CHECK(model.FeedForwardPwm(25.0, 0.0, 0.0) == 0.0);
+	CHECK(model.FeedForwardPwm(1000.0, 1.0, 50.0) == 1.0);
+
+	const float conditions[][2] = { { 0.0, 0.0 }, { 1.0, 0.0 }, { 0.5, 4.0 } };		// fan, filament rate
+	for (size_t i = 0; i < sizeof(conditions)/sizeof(conditions[0]); ++i)
+	{
+		SimulatedHotEnd hotEnd(model, 210.0);
+		hotEnd.Run(model.FeedForwardPwm(210.0, conditions[i][0], conditions[i][1]), conditions[i][0], conditions[i][1], 300.0);
+		CHECK_NEAR(hotEnd.Temperature(), 210.0, 0.05);
+	}
+}
+
+// Settle at the target, step the fan or the filament rate up, and return the largest drop below the target afterwards.
+// The real hot end loses 25% more to the fan and the filament than the model says, so the I term still has work to do.
+static float Sag(bool useModel, float fanStep, float filamentStep)
+{
+	ThermalModel model, actual;
+	MakeModel(model);
+	MakeModel(actual);
+	actual.fanFactor *= 1.25;
+	actual.extrusionFactor *= 1.25;
+	PidControlBlock control;
+	control.SetGains(12.0, 0.2, 100.0, 0.4, 1.0, 20.0, 0.0, 255.0, HEAT_SAMPLE_TIME);
+
+	const float target = 210.0;
+	SimulatedHotEnd hotEnd(actual, target);
+	float lastTemperature = target, iState = 0.0, worst = 0.0;
+	for (int sample = 0; sample < 2400; ++sample)
+	{
+		const bool stepped = (sample >= 1200);
+		const float fan = (stepped) ? fanStep : 0.0;
+		const float filamentRate = (stepped) ? filamentStep : 0.0;
+		const float temperature = hotEnd.Temperature();
+		const float feedForward = (useModel) ? model.FeedForwardPwm(target, fan, filamentRate) : 0.0;
+		const float pwm = control.Calculate(target, temperature, lastTemperature, useModel, feedForward, iState);
+		lastTemperature = temperature;
+		if (stepped && target - temperature > worst)
+		{
+			worst = target - temperature;
+		}
+		hotEnd.Run(pwm, fan, filamentRate, HEAT_SAMPLE_TIME);
+	}
+	CHECK_NEAR(hotEnd.Temperature(), target, 0.2);		// the I term recovers either way
+	return worst;
+}
+
+static void TestSag()
+{
+	const float fanWithout = Sag(false, 1.0, 0.0), fanWith = Sag(true, 1.0, 0.0);
+	const float feedWithout = Sag(false, 0.0, 5.0), feedWith = Sag(true, 0.0, 5.0);
+	printf("  sag on fan step: %.2fC without model, %.2fC with\n", fanWithout, fanWith);
+	printf("  sag on extrusion step: %.2fC without model, %.2fC with\n", feedWithout, feedWith);
+	CHECK(fanWithout > 1.0);
+	CHECK(fanWith < 0.5 * fanWithout);
+	CHECK(feedWithout > 1.0);
+	CHECK(feedWith < 0.5 * feedWithout);
+}
+
+int main()
+{
+	TestPlannedExtrusion();
+	TestSteadyState();
+	TestSag();
+	return CheckResult("FeedForwardTest");
+}
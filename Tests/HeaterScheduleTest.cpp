@@ -0,0 +1,129 @@
+// Host test for heater scheduling (HeaterSchedule.h). Simulates a machine with a bed and a bed zone controlled every
+// second sample, a chamber every fourth and hot ends every sample, checks that each heater is controlled once per
+// sample period and that the zone and its bed take turns, and that slow heaters switched on together are staggered.
+
+#include "Check.h"
+#include "../Configuration.h"
+#include "../HeaterSchedule.h"
+
+const size_t heaters = 6;
+const float sampleTime = HEAT_SAMPLE_TIME;
+const float staggerTime = HEATER_STAGGER_TIME;
+
+// Heater 0 is the bed and heater 3 a zone of it, heater 5 the chamber
+static const uint8_t multiples[heaters] = { BED_SAMPLE_MULTIPLE, 1, 1, BED_SAMPLE_MULTIPLE, 1, 4 };
+
+static void TestDue()
+{
+	HeaterSchedule<heaters> schedule;
+	schedule.Init(0.0);
+	schedule.Update(multiples);
+	CHECK(schedule.Slot(0) != schedule.Slot(3));
+
+	unsigned int controlled[heaters] = { 0 };
+	const unsigned int samples = 400;
+	for (unsigned int sample = 0; sample < samples; ++sample)
+	{
+		schedule.NextSample();
+		for (size_t heater = 0; heater < heaters; ++heater)
+		{
+			if (schedule.Due(heater, multiples[heater]))
+			{
+				++controlled[heater];
+			}
+		}
+		CHECK(!(schedule.Due(0, multiples[0]) && schedule.Due(3, multiples[3])));	// the bed and its zone take turns
+	}
+	for (size_t heater = 0; heater < heaters; ++heater)
+	{
+		CHECK(controlled[heater] == samples/multiples[heater]);
+	}
+
+	// More heaters sharing a multiple than there are slots still get controlled at the right rate
+	const uint8_t crowded[heaters] = { 2, 2, 2, 2, 2, 1 };
+	schedule.Update(crowded);
+	unsigned int counts[heaters] = { 0 };
+	for (unsigned int sample = 0; sample < samples; ++sample)
+	{
+		schedule.NextSample();
+		for (size_t heater = 0; heater < heaters; ++heater)
+		{
+			counts[heater] += (schedule.Due(heater, crowded[heater])) ? 1 : 0;
+		}
+	}
+	for (size_t heater = 0; heater < heaters; ++heater)
+	{
+		CHECK(counts[heater] == samples/crowded[heater]);
+	}
+}
+
+// Run the schedule the way Heat::Spin does with the given heaters switched on, and record when any that are held off may start
+static void Simulate(HeaterSchedule<heaters>& schedule, float& now, unsigned int samples, const bool on[], float holdOff[])
+{
+	for (unsigned int sample = 0; sample < samples; ++sample)
+	{
+		now += sampleTime;
+		schedule.NextSample();
+		for (size_t heater = 0; heater < heaters; ++heater)
+		{
+			float start;
+			if (schedule.Due(heater, multiples[heater]) && schedule.Stagger(heater, multiples[heater], on[heater], now, staggerTime, start))
+			{
+				CHECK(holdOff[heater] < 0.0);				// only once per switch on
+				holdOff[heater] = start;
+			}
+		}
+	}
+}
+
+static void TestStagger()
+{
+	HeaterSchedule<heaters> schedule;
+	float now = 0.0;
+	schedule.Init(now);
+	schedule.Update(multiples);
+
+	// Switch everything on together: the hot ends are never held off, and the slow heaters start staggerTime apart
+	const bool allOn[heaters] = { true, true, true, true, true, true };
+	float holdOff[heaters] = { -1.0, -1.0, -1.0, -1.0, -1.0, -1.0 };
+	Simulate(schedule, now, 20, allOn, holdOff);
+	CHECK(holdOff[1] < 0.0 && holdOff[2] < 0.0 && holdOff[4] < 0.0);
+	const size_t slow[] = { 0, 3, 5 };
+	for (size_t i = 0; i < 3; ++i)
+	{
+		CHECK(holdOff[slow[i]] >= 0.0);
+		for (size_t j = 0; j < i; ++j)
+		{
+			CHECK(fabs(holdOff[slow[i]] - holdOff[slow[j]]) >= staggerTime - 0.001);
+		}
+	}
+	printf("  bed starts at %.1fs, bed zone at %.1fs, chamber at %.1fs\n", holdOff[0], holdOff[3], holdOff[5]);
+
+	// Staying on doesn't restart the stagger
+	float again[heaters] = { -1.0, -1.0, -1.0, -1.0, -1.0, -1.0 };
+	Simulate(schedule, now, 20, allOn, again);
+	for (size_t heater = 0; heater < heaters; ++heater)
+	{
+		CHECK(again[heater] < 0.0);
+	}
+
+	// Long after they were last switched on, switching the bed and its zone off and on again needs no wait beyond 'now'
+	// for the first of them, and staggers the second
+	const bool bedOff[heaters] = { false, true, true, false, true, true };
+	float off[heaters] = { -1.0, -1.0, -1.0, -1.0, -1.0, -1.0 };
+	Simulate(schedule, now, 4, bedOff, off);
+	float restart[heaters] = { -1.0, -1.0, -1.0, -1.0, -1.0, -1.0 };
+	const float switchOnTime = now;
+	Simulate(schedule, now, 4, allOn, restart);
+	const float first = (restart[0] < restart[3]) ? restart[0] : restart[3];
+	CHECK(first <= switchOnTime + BED_SAMPLE_MULTIPLE * sampleTime + 0.001);
+	CHECK_NEAR(fabs(restart[0] - restart[3]), staggerTime, 0.001);
+	CHECK(restart[5] < 0.0);
+}
+
+int main()
+{
+	TestDue();
+	TestStagger();
+	return CheckResult("HeaterScheduleTest");
+}
@@ -0,0 +1,179 @@
+// Host test for the cached PID control block (PidControl.cpp). Checks that the precalculated gains give the same heater
+// PWM as the calculation PID::Spin used to do from the PidParameters on every sample, and compares the host time per
+// heater per sample of the two.
+
+#include <stdlib.h>
+#include <stddef.h>
+#include "Check.h"
+#include "../Configuration.h"
+#include "../PidControl.h"
+
+const size_t numHeaters = 4;
+
+// The parameters as PidParameters holds them, fetched from Platform on every sample by the old code
+struct Parameters
+{
+	float kI, kD, kP, kT, kS;
+	float fullBand, pidMin, pidMax;
+};
+
+static Parameters parameters[numHeaters] =
+{
+	{ 0.5, 500.0, 10.0, 0.12, 1.0, 5.0, 0.0, 255.0 },		// bed
+	{ 0.2, 100.0, 12.0, 0.4, 1.0, 20.0, 0.0, 255.0 },		// hot end
+	{ 0.2, 100.0, 12.0, 0.4, 0.8, 20.0, 0.0, 255.0 },		// hot end with kS < 1
+	{ 0.35, 60.0, 20.0, 0.5, 1.0, 15.0, 10.0, 200.0 }		// hot end with a restricted output range
+};
+static float heatSampleTime = HEAT_SAMPLE_TIME;
+
+// Out of line, as the Platform accessors are to PID::Spin
+__attribute__((noinline)) static const Parameters& GetPidParameters(size_t heater) { return parameters[heater]; }
+__attribute__((noinline)) static float HeatSampleTime() { return heatSampleTime; }
+
+// The in-band and full-band part of PID::Spin before the control block was introduced. Returns the heater PWM.
+static float OldCalculate(size_t heater, float target, float temperature, float& lastTemperature, bool useModel, float feedForward, float& iState)
+{
+	const Parameters& pp = GetPidParameters(heater);
+	const float error = target - temperature;
+	const float feedForwardResult = (useModel) ? 255.0 * feedForward / pp.kS : 0.0;
+	if (error < -pp.fullBand)
+	{
+		iState = (useModel) ? 0.0 : (target + pp.fullBand - 25.0) * pp.kT;
+		lastTemperature = temperature;
+		return 0.0;
+	}
+	if (error > pp.fullBand)
+	{
+		iState = (useModel) ? 0.0 : (target - pp.fullBand - 25.0) * pp.kT;
+		lastTemperature = temperature;
+		return pp.kS;
+	}
+
+	const float sampleInterval = HeatSampleTime();
+	iState += error * pp.kI * sampleInterval;
+	if (iState < pp.pidMin - feedForwardResult)
+	{
+		iState = pp.pidMin - feedForwardResult;
+	}
+	else if (iState > pp.pidMax - feedForwardResult)
+	{
+		iState = pp.pidMax - feedForwardResult;
+	}
+
+	const float dState = pp.kD * (temperature - lastTemperature) / sampleInterval;
+	float result = feedForwardResult + pp.kP * error + iState - dState;
+	lastTemperature = temperature;
+	if (result < 0.0)
+	{
+		result = 0.0;
+	}
+	else if (result > 255.0)
+	{
+		result = 255.0;
+	}
+	result = result / 255.0;
+	return result * pp.kS;
+}
+
+static void SetUp(PidControlBlock blocks[])
+{
+	for (size_t heater = 0; heater < numHeaters; ++heater)
+	{
+		const Parameters& pp = parameters[heater];
+		blocks[heater].SetGains(pp.kP, pp.kI, pp.kD, pp.kT, pp.kS, pp.fullBand, pp.pidMin, pp.pidMax, heatSampleTime);
+	}
+}
+
+// Drive a simple simulated heater with the new controller and check that the old calculation agrees at every sample
+static void TestSameOutput(bool useModel)
+{
+	PidControlBlock blocks[numHeaters];
+	SetUp(blocks);
+	for (size_t heater = 0; heater < numHeaters; ++heater)
+	{
+		const float target = (heater == 0) ? 60.0 : 210.0;
+		const float feedForward = (useModel) ? 0.3 : 0.0;
+		float temperature = 25.0, newLast = temperature, oldLast = temperature, newI = 0.0, oldI = 0.0;
+		double worst = 0.0;
+		for (int sample = 0; sample < 2000; ++sample)
+		{
+			const float newPwm = blocks[heater].Calculate(target, temperature, newLast, useModel, feedForward, newI);
+			newLast = temperature;
+			const float oldPwm = OldCalculate(heater, target, temperature, oldLast, useModel, feedForward, oldI);
+			CHECK_NEAR(newPwm, oldPwm, 1.0e-4);
+			CHECK_NEAR(newI, oldI, 1.0e-3);
+			worst = fmax(worst, fabs(newPwm - oldPwm));
+
+			// First-order heater plus some measurement noise, and a disturbance halfway through
+			const float loss = (sample > 1000) ? 0.012 : 0.008;
+			temperature += heatSampleTime * (2.5 * newPwm - loss * (temperature - 25.0)) + 0.05 * ((rand() % 21) - 10) * 0.1;
+		}
+		CHECK(newI >= parameters[heater].pidMin - 255.0 && newI <= parameters[heater].pidMax);
+		printf("  heater %u%s: worst PWM difference %.2g\n", (unsigned int)heater, (useModel) ? " with model" : "", worst);
+	}
+}
+
+static void TestGains()
+{
+	PidControlBlock block;
+	block.SetGains(12.0, 0.2, 100.0, 0.4, 0.8, 20.0, 0.0, 255.0, 1.5);
+	CHECK_NEAR(block.kISample, 0.2 * 1.5, 1.0e-6);
+	CHECK_NEAR(block.kDSample, 100.0/1.5, 1.0e-4);
+	CHECK_NEAR(block.pwmToResult * block.resultToPwm, 1.0, 1.0e-6);
+	CHECK_NEAR(block.pwmAverageFactor + block.pwmAverageDecay, 1.0, 1.0e-6);
+	CHECK_NEAR(block.pwmAverageFactor, 1.5/HEAT_PWM_AVERAGE_TIME, 1.0e-6);
+}
+
+static void TestTiming()
+{
+	const int samples = 2000000;
+	const size_t numTemperatures = 1024;
+	float temperatures[numTemperatures];
+	for (size_t i = 0; i < numTemperatures; ++i)
+	{
+		temperatures[i] = 200.0 + 0.01 * (float)(rand() % 2000);		// within the full band of the hot ends
+	}
+	PidControlBlock blocks[numHeaters];
+	SetUp(blocks);
+	volatile float sink = 0.0;
+
+	float last[numHeaters], iStates[numHeaters];
+	for (size_t heater = 0; heater < numHeaters; ++heater)
+	{
+		last[heater] = 210.0;
+		iStates[heater] = 50.0;
+	}
+	double start = NanoTime();
+	for (int sample = 0; sample < samples; ++sample)
+	{
+		const size_t heater = 1 + sample % (numHeaters - 1);
+		sink = sink + OldCalculate(heater, 210.0, temperatures[sample % numTemperatures], last[heater], false, 0.0, iStates[heater]);
+	}
+	const double oldTime = NanoTime() - start;
+
+	for (size_t heater = 0; heater < numHeaters; ++heater)
+	{
+		last[heater] = 210.0;
+		iStates[heater] = 50.0;
+	}
+	start = NanoTime();
+	for (int sample = 0; sample < samples; ++sample)
+	{
+		const size_t heater = 1 + sample % (numHeaters - 1);
+		const float temperature = temperatures[sample % numTemperatures];
+		sink = sink + blocks[heater].Calculate(210.0, temperature, last[heater], false, 0.0, iStates[heater]);
+		last[heater] = temperature;
+	}
+	const double newTime = NanoTime() - start;
+
+	printf("  host time per heater per sample: before %.1fns, after %.1fns\n", oldTime/samples, newTime/samples);
+}
+
+int main()
+{
+	TestGains();
+	TestSameOutput(false);
+	TestSameOutput(true);
+	TestTiming();
+	return CheckResult("PidControlTest");
+}
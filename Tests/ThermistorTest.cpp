@@ -0,0 +1,111 @@
+// Host test for the thermistor interpolation tables (Thermistor.cpp). Checks the table against the beta formula that
+// it replaced over -20C to 300C for the default thermistors and some common alternatives, and compares the time each
+// conversion takes on the host.
+
+#include "Check.h"
+#include "../Configuration.h"
+#include "../Thermistor.h"
+
+const unsigned int adcRange = 8192;				// adRangeVirtual + 1 with 1 bit of oversampling
+const double maxError = 0.25;					// degrees C
+
+struct Thermistor
+{
+	const char *name;
+	float beta, r25, seriesR, lowOffset, highOffset;
+	float RInf() const { return r25 * exp(-beta / (25.0 - ABS_ZERO)); }
+};
+
+static const Thermistor thermistors[] =
+{
+	{ "default bed 10K", 3988.0, 10000.0, 1000.0, 0.0, 0.0 },
+	{ "default hot end 100K", 4138.0, 100000.0, 1000.0, 0.0, 0.0 },
+	{ "100K with 4K7 series", 4267.0, 100000.0, 4700.0, 0.0, 0.0 },
+	{ "10K with 4K7 series", 3950.0, 10000.0, 4700.0, 0.0, 0.0 },
+	{ "100K with ADC offsets", 4138.0, 100000.0, 1000.0, 12.0, -30.0 }
+};
+
+// The beta formula as used by Platform::CalcTemperature
+static float FormulaTemperature(const Thermistor& th, int rawTemp)
+{
+	float reading = (float)rawTemp + 0.5;
+	reading = (reading - th.lowOffset) * adcRange / (adcRange + th.highOffset - th.lowOffset);
+	const float resistance = reading * th.seriesR / (adcRange - reading);
+	return (resistance <= th.RInf()) ? 2000.0 : ABS_ZERO + th.beta / log(resistance / th.RInf());
+}
+
+static void TestAccuracy(const Thermistor& th, const ThermistorTable& table)
+{
+	double worst = 0.0;
+	unsigned int readingsChecked = 0;
+	for (int raw = 0; raw < (int)adcRange; ++raw)
+	{
+		const float expected = FormulaTemperature(th, raw);
+		if (expected < -20.0 || expected > 300.0)
+		{
+			continue;
+		}
+		float t;
+		CHECK(table.GetTemperature(raw, t));
+		CHECK_NEAR(t, expected, maxError);
+		worst = fmax(worst, fabs(t - expected));
+		++readingsChecked;
+	}
+	CHECK(readingsChecked > 100);
+	printf("  %s: %u readings, worst error %.3fC\n", th.name, readingsChecked, worst);
+}
+
+static void TestOutsideTable(const Thermistor& th, const ThermistorTable& table)
+{
+	float t;
+	CHECK(!table.GetTemperature(adcRange - 1, t));		// colder than -40C
+	CHECK(!table.GetTemperature(0, t));					// short circuit
+	CHECK(!table.GetTemperature(-1, t));
+}
+
+static void TestTiming(const Thermistor& th, const ThermistorTable& table)
+{
+	const int iterations = 200;
+	volatile float sink = 0.0;
+
+	double start = NanoTime();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (int raw = 1; raw < (int)adcRange; raw += 3)
+		{
+			sink = sink + FormulaTemperature(th, raw);
+		}
+	}
+	const double formulaTime = NanoTime() - start;
+
+	start = NanoTime();
+	for (int i = 0; i < iterations; ++i)
+	{
+		for (int raw = 1; raw < (int)adcRange; raw += 3)
+		{
+			float t;
+			sink = sink + ((table.GetTemperature(raw, t)) ? t : 0.0);
+		}
+	}
+	const double tableTime = NanoTime() - start;
+
+	const double conversions = iterations * (double)((adcRange + 1)/3);
+	printf("  host time per conversion: formula %.1fns, table %.1fns\n", formulaTime/conversions, tableTime/conversions);
+}
+
+int main()
+{
+	for (size_t i = 0; i < sizeof(thermistors)/sizeof(thermistors[0]); ++i)
+	{
+		const Thermistor& th = thermistors[i];
+		ThermistorTable table;
+		table.Build(th.beta, th.RInf(), th.seriesR, th.lowOffset, th.highOffset, adcRange);
+		TestAccuracy(th, table);
+		TestOutsideTable(th, table);
+		if (i == 1)
+		{
+			TestTiming(th, table);
+		}
+	}
+	return CheckResult("ThermistorTest");
+}
@@ -0,0 +1,64 @@
+/****************************************************************************************************
+
+RepRapFirmware - Thermistor
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#include <math.h>
+#include "Configuration.h"
+#include "Thermistor.h"
+
+// Each table entry is the averaged raw reading that the beta formula (see Platform::CalcTemperature) would convert to the entry's temperature.
+void ThermistorTable::Build(float beta, float rInf, float seriesR, float adcLowOffset, float adcHighOffset, unsigned int adcRange)
+{
+	for (size_t i = 0; i < thermistorTableEntries; ++i)
+	{
+		// Invert the beta formula: resistance, then corrected reading, then raw reading
+		const float temperature = (float)(thermistorTableMinTemperature + (int)i * thermistorTableStep);
+		const float resistance = rInf * exp(beta / (temperature - ABS_ZERO));
+		float reading = adcRange * resistance / (resistance + seriesR);
+		reading = reading * (adcRange + adcHighOffset - adcLowOffset) / adcRange + adcLowOffset - 0.5;
+		const float scaled = reading * (1u << thermistorTableFractionBits) + 0.5;
+		readings[i] = (scaled <= 0.0) ? 0
+						: (scaled >= 65535.0) ? 65535
+							: (uint16_t)scaled;
+	}
+}
+
+// Find the pair of table entries that bracket the reading and interpolate between them.
+// Readings outside the table (below -40C, above 400C or a short circuit) are left to the full calculation.
+bool ThermistorTable::GetTemperature(int rawTemp, float& temperature) const
+{
+	const uint32_t reading = (uint32_t)rawTemp << thermistorTableFractionBits;
+	if (rawTemp < 0 || reading > readings[0] || reading < readings[thermistorTableEntries - 1])
+	{
+		return false;
+	}
+
+	size_t low = 0, high = thermistorTableEntries - 1;		// invariant: readings[low] >= reading >= readings[high]
+	while (high - low > 1)
+	{
+		const size_t mid = (low + high)/2;
+		if (readings[mid] >= reading)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	// Work in 1/16ths of a degree so that the interpolation needs only integer arithmetic
+	const uint32_t span = readings[low] - readings[high];
+	const int32_t sixteenths = (int32_t)(low * thermistorTableStep * 16)
+			+ ((span == 0) ? 0 : (int32_t)(((readings[low] - reading) * (thermistorTableStep * 16) + span/2)/span));
+	temperature = (float)thermistorTableMinTemperature + (float)sixteenths * 0.0625;
+	return true;
+}
+
+// End
@@ -0,0 +1,40 @@
+/****************************************************************************************************
+
+RepRapFirmware - Thermistor
+
+Conversion of thermistor ADC readings to temperatures using an interpolation table. Nothing in here
+depends on the hardware, so that it can also be built and tested on the host (see Tests).
+
+-----------------------------------------------------------------------------------------------------
+
+Licence: GPL
+
+****************************************************************************************************/
+
+#ifndef THERMISTOR_H
+#define THERMISTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Each heater has a table of the ADC readings expected at regularly-spaced temperatures, rebuilt whenever its thermistor parameters change,
+// so that GetTemperature can interpolate instead of evaluating the beta formula. Readings are held in units of 1/(2 ** thermistorTableFractionBits).
+const int thermistorTableMinTemperature = -40;				// temperature of the first table entry in degrees C
+const int thermistorTableStep = 5;							// temperature difference between table entries in degrees C
+const size_t thermistorTableEntries = 89;					// covers -40C to +400C
+const unsigned int thermistorTableFractionBits = 3;			// fractional bits held in each reading
+
+class ThermistorTable
+{
+  public:
+	// Fill the table for a thermistor. adcRange is one more than the highest averaged reading.
+	void Build(float beta, float rInf, float seriesR, float adcLowOffset, float adcHighOffset, unsigned int adcRange);
+
+	// Convert an averaged ADC reading. Returns false if the reading is outside the table.
+	bool GetTemperature(int rawTemp, float& temperature) const;
+
+  private:
+	uint16_t readings[thermistorTableEntries];				// raw readings in decreasing order for increasing temperatures
+};
+
+#endif
@@ -27,7 +27,10 @@
 
  The supported requests are GET requests for files (for which the root is the www directory on the
  SD card), and the following. These all start with "/rr_". Ordinary files used for the web interface
- must not have names starting "/rr_" or they will not be found.
+ must not have names starting "/rr_" or they will not be found. If the browser accepts gzip encoding
+ and a file has a sibling with ".gz" appended to its name, the compressed copy is sent instead. Files are
+ sent with an ETag made from their date and length, so browsers can revalidate them with If-None-Match
+ and get a 304 response if they haven't changed.
 
  rr_connect?password=xxx
              Sent by the web interface software to establish an initial connection, indicating that
@@ -49,7 +52,8 @@
  rr_files?dir=xxx
  	 	 	 Returns a listing of the filenames in the /gcode directory of the SD card. 'dir' is a
  	 	 	 directory path relative to the root of the SD card. If the 'dir' variable is not present,
- 	 	 	 it defaults to the /gcode directory.
+ 	 	 	 it defaults to the /gcode directory. The response is sent with chunked transfer encoding
+ 	 	 	 and has no length limit.
 
  rr_reply    Returns the last-known G-code reply as plain text (not encapsulated as JSON).
 
@@ -86,6 +90,34 @@ rr_mkdir?dir=xxx
 rr_move?old=xxx&new=yyy
 			 Rename an old file xxx to yyy. May also be used to move a file to another directory.
 
+rr_statusdelta?seq=nnn
+			 Compact status response for clients that poll frequently. The status is kept as a fixed block
+			 of scaled integers, and only those that have changed since status sequence number nnn are
+			 returned, as "d":[index,value,index,value...]. "seq" is the value of nnn to ask for next time.
+			 Sequence numbers start from a random value on each boot. If nnn is 0, missing or from before
+			 the last reset, all values are returned along with "layout":[axes,extruders,heaters].
+			 The block holds the status character, homed axes bitmap, current tool, ATX power, fan percent
+			 and speed factor (hundredths), Z probe value, fan RPM and G-code reply sequence, followed by
+			 the axis positions (hundredths of a mm), extruder positions (tenths of a mm) and extrusion
+			 factors (hundredths of a percent), then the current, active and standby temperatures (tenths
+			 of a degree) and states of every heater. Messages and beeps are only sent by rr_status.
+
+rr_stream?interval=nnn
+			 Keeps the connection open as a server-sent event stream instead of returning a response. At most
+			 once every nnn milliseconds (default 1000), the server pushes a "status" event holding the
+			 rr_statusdelta response for the changes since the last event, a "reply" event when there is a new
+			 G-code reply, and a "message" event when a new message has been set. Nothing is sent if nothing
+			 has changed. Up to four clients may have a stream open at once.
+
+rr_history?seq=nnn
+			 Returns the temperature and PWM history of all heaters from sample number nnn, sampled once a
+			 second for the last 10 minutes. "seq" is the first sample returned, which is the oldest one
+			 kept if nnn is too old or missing, and "next" is the value of nnn to ask for next time.
+			 "base" holds the temperature of each heater before the first sample. "temps" holds two hex
+			 digits per heater for each sample, giving the signed change in temperature in quarter degrees,
+			 and "pwm" holds two hex digits per heater for each sample, giving the PWM with 255 = full power.
+			 A long history may need several requests.
+
  ****************************************************************************************************/
 
 #include "RepRapFirmware.h"
@@ -111,7 +143,10 @@ Webserver::Webserver(Platform* p, Network *n) : platform(p), network(n),
 		webserverActive(false), readingConnection(NULL)
 {
 	httpInterpreter = new HttpInterpreter(p, this, n);
-	ftpInterpreter = new FtpInterpreter(p, this, n);
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		ftpInterpreters[i] = new FtpInterpreter(p, this, n, i);
+	}
 	telnetInterpreter = new TelnetInterpreter(p, this, n);
 }
 
@@ -122,11 +157,16 @@ void Webserver::Init()
 	lastTime = platform->Time();
 	longWait = lastTime;
 	webserverActive = true;
+	lastUploadBytes = 0;
+	lastUploadTime = 0.0;
 
 	// initialise all protocol handlers
 	httpInterpreter->ResetState();
 	httpInterpreter->ResetSessions();
-	ftpInterpreter->ResetState();
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		ftpInterpreters[i]->ResetState();
+	}
 	telnetInterpreter->ResetState();
 }
 
@@ -137,7 +177,13 @@ void Webserver::Spin()
 	// Before we process an incoming Request, we must ensure that the webserver
 	// is active and that all upload buffers are empty.
 
-	if (webserverActive && httpInterpreter->FlushUploadData() && ftpInterpreter->FlushUploadData())
+	bool ready = webserverActive && httpInterpreter->FlushUploadData();
+	for (size_t i = 0; ready && i < numFtpSessions; i++)
+	{
+		ready = ftpInterpreters[i]->FlushUploadData();
+	}
+
+	if (ready)
 	{
 		// Check if we can purge any HTTP sessions
 		httpInterpreter->CheckSessions();
@@ -157,11 +203,12 @@ void Webserver::Spin()
 			{
 				// Take care of different protocol types here
 				ProtocolInterpreter *interpreter;
+				TransactionStatus status = req->GetStatus();
 				uint16_t localPort = req->GetLocalPort();
 				switch (localPort)
 				{
 					case ftpPort:		/* FTP */
-						interpreter = ftpInterpreter;
+						interpreter = GetFtpInterpreter(req->GetConnection(), status == connected);
 						break;
 
 					case telnetPort:	/* Telnet */
@@ -175,14 +222,26 @@ void Webserver::Spin()
 						}
 						else
 						{
-							interpreter = ftpInterpreter;
+							interpreter = GetFtpInterpreter(req->GetConnection(), false);
 						}
 						break;
 				}
 
+				if (interpreter == NULL)
+				{
+					// All FTP sessions are in use, or this connection belongs to one that has finished
+					if (status == connected && localPort == ftpPort)
+					{
+						req->Write("421 Too many users, try again later.\r\n");
+						network->SendAndClose(NULL);
+					}
+					else
+					{
+						network->CloseTransaction();
+					}
+				}
 				// For protocols other than HTTP it is important to send a HELO message
-				TransactionStatus status = req->GetStatus();
-				if (status == connected)
+				else if (status == connected)
 				{
 					interpreter->ConnectionEstablished();
 
@@ -248,6 +307,16 @@ void Webserver::Spin()
 				network->CloseTransaction();
 			}
 		}
+		else
+		{
+			// Nothing has come in, so see if any clients are waiting for status updates or more of a file list
+			httpInterpreter->PushStatus();
+			httpInterpreter->ContinueFileList();
+			for (size_t i = 0; i < numFtpSessions; i++)
+			{
+				ftpInterpreters[i]->ContinueFileList();
+			}
+		}
 
 		network->Unlock();
 		platform->ClassReport(longWait);
@@ -257,7 +326,10 @@ void Webserver::Spin()
 void Webserver::Exit()
 {
 	httpInterpreter->CancelUpload();
-	ftpInterpreter->CancelUpload();
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		ftpInterpreters[i]->CancelUpload();
+	}
 
 	platform->Message(BOTH_MESSAGE, "Webserver class exited.\n");
 	webserverActive = false;
@@ -266,6 +338,21 @@ void Webserver::Exit()
 void Webserver::Diagnostics()
 {
 	platform->AppendMessage(BOTH_MESSAGE, "Webserver Diagnostics:\n");
+	if (lastUploadTime > 0.0)
+	{
+		platform->AppendMessage(BOTH_MESSAGE, "Last upload: %uKB at %.2fMB/s\n", (unsigned int)(lastUploadBytes/1024), (float)lastUploadBytes/(1048576.0 * lastUploadTime));
+	}
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		ftpInterpreters[i]->Diagnostics();
+	}
+}
+
+// Record the size and duration of a completed upload for the diagnostics
+void Webserver::UploadFinished(uint32_t bytes, float time)
+{
+	lastUploadBytes = bytes;
+	lastUploadTime = time;
 }
 
 // Process a null-terminated gcode
@@ -420,7 +507,12 @@ void Webserver::ConnectionLost(const ConnectionState *cs)
 	switch (localPort)
 	{
 		case ftpPort:		/* FTP */
-			interpreter = ftpInterpreter;
+			interpreter = GetFtpInterpreter(cs, false);
+			if (interpreter == NULL)
+			{
+				// This client has already been logged out or was turned away
+				return;
+			}
 			break;
 
 		case telnetPort:	/* Telnet */
@@ -433,9 +525,10 @@ void Webserver::ConnectionLost(const ConnectionState *cs)
 				interpreter = httpInterpreter;
 				break;
 			}
-			else if (localPort == network->GetDataPort())
+
+			interpreter = GetFtpInterpreter(cs, false);
+			if (interpreter != NULL)
 			{
-				interpreter = ftpInterpreter;
 				break;
 			}
 
@@ -456,6 +549,35 @@ void Webserver::ConnectionLost(const ConnectionState *cs)
 	}
 }
 
+// Find the FTP session a connection belongs to. A new connection to the FTP port is given a free session if there is one.
+Webserver::FtpInterpreter *Webserver::GetFtpInterpreter(const ConnectionState *cs, bool newConnection)
+{
+	const uint16_t localPort = cs->GetLocalPort();
+	FtpInterpreter *freeInterpreter = NULL;
+	for (size_t i = 0; i < numFtpSessions; i++)
+	{
+		FtpInterpreter *interpreter = ftpInterpreters[i];
+		if (interpreter->UsesConnection(cs))
+		{
+			return interpreter;
+		}
+
+		if (localPort == ftpPort)
+		{
+			if (freeInterpreter == NULL && interpreter->IsFree())
+			{
+				freeInterpreter = interpreter;
+			}
+		}
+		else if (localPort == network->GetDataPort(i))
+		{
+			// New connection to the PASV port of this session
+			return interpreter;
+		}
+	}
+	return (newConnection) ? freeInterpreter : NULL;
+}
+
 void Webserver::ResponseToWebInterface(const char *s, bool error)
 {
 	if (!webserverActive)
@@ -509,18 +631,38 @@ ProtocolInterpreter::ProtocolInterpreter(Platform *p, Webserver *ws, Network *n)
 	uploadState = notUploading;
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBuffer = NULL;
+	uploadBufferLength = 0;
 	filenameBeingUploaded[0] = 0;
+	uploadScanner = new GcodeFileScanner();
 }
 
-// Start writing to a new file
-bool ProtocolInterpreter::StartUpload(FileStore *file)
+// Start writing to a new file. The file name is relative to 0:/
+bool ProtocolInterpreter::StartUpload(FileStore *file, const char *fileName)
 {
+	// fileName may point into MassStorage's combined name buffer, which deleting a cancelled upload overwrites
+	char newFilename[FILENAME_LENGTH];
+	strncpy(newFilename, fileName, ARRAY_SIZE(newFilename));
+	newFilename[ARRAY_UPB(newFilename)] = 0;
+
 	CancelUpload();
 
 	if (file != NULL)
 	{
+		// Only interpreters that are actually used for uploads need the buffer
+		if (uploadBuffer == NULL)
+		{
+			uploadBuffer = new char[uploadBufferSize];
+		}
+		uploadBufferLength = 0;
+		uploadStartTime = platform->Time();
+
 		fileBeingUploaded.Set(file);
 		uploadState = uploadOK;
+
+		strcpy(filenameBeingUploaded, newFilename);
+		reprap.GetPrintMonitor()->ForgetFileInfo("0:/", filenameBeingUploaded);
+		uploadScanner->Start(filenameBeingUploaded);
 		return true;
 	}
 
@@ -536,6 +678,7 @@ bool ProtocolInterpreter::StoreUploadData(const char* data, unsigned int len)
 	{
 		uploadPointer = data;
 		uploadLength = len;
+		uploadScanner->Scan(data, len);
 		return true;
 	}
 	return false;
@@ -546,23 +689,41 @@ bool ProtocolInterpreter::FlushUploadData()
 {
 	if (uploadState == uploadOK && uploadLength != 0)
 	{
-		// Write some uploaded data to file (never write more than 256 bytes at once)
-		unsigned int len = min<unsigned int>(uploadLength, 256);
-		if (!fileBeingUploaded.Write(uploadPointer, len))
-		{
-			platform->Message(HOST_MESSAGE, "Could not flush upload data!\n");
-			uploadState = uploadError;
-		}
-
+		// Collect the data in the upload buffer. Writing it in blocks of whole sectors keeps the file position
+		// sector-aligned, so FatFs can write straight to the card instead of reading and rewriting partial sectors.
+		unsigned int len = min<unsigned int>(uploadLength, uploadBufferSize - uploadBufferLength);
+		memcpy(uploadBuffer + uploadBufferLength, uploadPointer, len);
+		uploadBufferLength += len;
 		uploadPointer += len;
 		uploadLength -= len;
 
+		// Never write more than one block at once, so that we don't hold up the main loop for too long
+		if (uploadBufferLength == uploadBufferSize)
+		{
+			WriteUploadBuffer();
+		}
+
 		return (uploadLength == 0);
 	}
 
 	return true;
 }
 
+// Write the data collected in the upload buffer to the file
+bool ProtocolInterpreter::WriteUploadBuffer()
+{
+	if (uploadBufferLength != 0)
+	{
+		if (!fileBeingUploaded.Write(uploadBuffer, uploadBufferLength))
+		{
+			platform->Message(HOST_MESSAGE, "Could not flush upload data!\n");
+			uploadState = uploadError;
+		}
+		uploadBufferLength = 0;
+	}
+	return uploadState == uploadOK;
+}
+
 void ProtocolInterpreter::CancelUpload()
 {
 	if (fileBeingUploaded.IsLive())
@@ -576,6 +737,7 @@ void ProtocolInterpreter::CancelUpload()
 	filenameBeingUploaded[0] = 0;
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBufferLength = 0;
 	uploadState = notUploading;
 }
 
@@ -608,25 +770,18 @@ bool ProtocolInterpreter::DoFastUpload()
 void ProtocolInterpreter::FinishUpload(uint32_t fileLength)
 {
 	// Write the remaining data
-	if (uploadState == uploadOK)
+	while (uploadState == uploadOK && uploadLength != 0)
 	{
-		while (uploadLength > 0)
-		{
-			unsigned int len = min<unsigned int>(uploadLength, 256);
-			if (!fileBeingUploaded.Write(uploadPointer, len))
-			{
-				uploadState = uploadError;
-				platform->Message(HOST_MESSAGE, "Could not write remaining data while finishing upload!\n");
-				break;
-			}
-
-			uploadLength -= len;
-			uploadPointer += len;
-		}
+		FlushUploadData();
+	}
+	if (uploadState == uploadOK && !WriteUploadBuffer())
+	{
+		platform->Message(HOST_MESSAGE, "Could not write remaining data while finishing upload!\n");
 	}
 
 	uploadPointer = NULL;
 	uploadLength = 0;
+	uploadBufferLength = 0;
 
 	if (uploadState == uploadOK && !fileBeingUploaded.Flush())
 	{
@@ -642,11 +797,22 @@ void ProtocolInterpreter::FinishUpload(uint32_t fileLength)
 	}
 
 	// Close the file
+	unsigned long uploadedFileLength = fileBeingUploaded.Length();
 	if (!fileBeingUploaded.Close())
 	{
 		uploadState = uploadError;
 		platform->Message(HOST_MESSAGE, "Could not close the upload file while finishing upload!\n");
 	}
+	else if (uploadState == uploadOK)
+	{
+		webserver->UploadFinished(uploadedFileLength, platform->Time() - uploadStartTime);
+	}
+
+	// Store the G-code file info we collected, so that the file need not be scanned again
+	if (uploadScanner->Finish(uploadedFileLength) && uploadState == uploadOK)
+	{
+		reprap.GetPrintMonitor()->StoreFileInfo(platform->GetMassStorage()->CombineName("0:/", filenameBeingUploaded), uploadScanner->GetFileInfo());
+	}
 
 	// Delete file if an error has occurred
 	if (uploadState == uploadError && strlen(filenameBeingUploaded) != 0)
@@ -671,6 +837,8 @@ Webserver::HttpInterpreter::HttpInterpreter(Platform *p, Webserver *ws, Network
 {
 	uploadingTextData = false;
 	numContinuationBytes = 0;
+	numStatusStreams = 0;
+	fileListing.cs = NULL;
 }
 
 // File Uploads
@@ -723,10 +891,10 @@ bool Webserver::HttpInterpreter::DoingFastUpload() const
 	return false;
 }
 
-bool Webserver::HttpInterpreter::StartUpload(FileStore *file)
+bool Webserver::HttpInterpreter::StartUpload(FileStore *file, const char *fileName)
 {
 	numContinuationBytes = 0;
-	return ProtocolInterpreter::StartUpload(file);
+	return ProtocolInterpreter::StartUpload(file, fileName);
 }
 
 bool Webserver::HttpInterpreter::StoreUploadData(const char* data, unsigned int len)
@@ -735,6 +903,7 @@ bool Webserver::HttpInterpreter::StoreUploadData(const char* data, unsigned int
 	{
 		uploadPointer = data;
 		uploadLength = len;
+		uploadScanner->Scan(data, len);
 
 		// Count the number of UTF8 continuation bytes. We may need it to adjust the expected file length.
 		if (uploadingTextData)
@@ -784,23 +953,69 @@ void Webserver::HttpInterpreter::SendFile(const char* nameOfFileToSend)
 	{
 		nameOfFileToSend = INDEX_PAGE;
 	}
-	FileStore *fileToSend = platform->GetFileStore(platform->GetWebDir(), nameOfFileToSend, false);
-	if (fileToSend == NULL)
+
+	// If the client accepts gzip encoding, send a compressed copy of the file if there is one.
+	// The content type is still taken from the name that was asked for.
+	MassStorage *massStorage = platform->GetMassStorage();
+	const char *fileName = nameOfFileToSend;
+	char gzipFileName[FILENAME_LENGTH];
+	bool gzip = false;
+	uint32_t fileLength, fileTimestamp;
+	const char *acceptEncoding = GetHeaderValue("Accept-Encoding");
+	if (acceptEncoding != NULL && StringContains(acceptEncoding, "gzip") >= 0 && !StringEndsWith(nameOfFileToSend, ".gz"))
 	{
-		nameOfFileToSend = FOUR04_FILE;
-		fileToSend = platform->GetFileStore(platform->GetWebDir(), nameOfFileToSend, false);
-		if (fileToSend == NULL)
+		snprintf(gzipFileName, ARRAY_SIZE(gzipFileName), "%s.gz", nameOfFileToSend);
+		gzipFileName[ARRAY_UPB(gzipFileName)] = 0;
+		if (massStorage->GetFileStats(platform->GetWebDir(), gzipFileName, fileLength, fileTimestamp))
+		{
+			fileName = gzipFileName;
+			gzip = true;
+		}
+	}
+
+	bool cacheable = true;
+	if (!gzip && !massStorage->GetFileStats(platform->GetWebDir(), fileName, fileLength, fileTimestamp))
+	{
+		nameOfFileToSend = fileName = FOUR04_FILE;
+		cacheable = false;
+		if (!massStorage->GetFileStats(platform->GetWebDir(), fileName, fileLength, fileTimestamp))
 		{
 			RejectMessage("not found", 404);
 			return;
 		}
 	}
 
+	// The entity tag is made from the FAT date/time and the length of the file, so it changes whenever the file is replaced
+	char eTag[24];
+	snprintf(eTag, ARRAY_SIZE(eTag), "\"%08lx-%lx%s\"", fileTimestamp, fileLength, gzip ? "z" : "");
+
 	NetworkTransaction *req = network->GetTransaction();
+	if (cacheable)
+	{
+		const char *ifNoneMatch = GetHeaderValue("If-None-Match");
+		if (ifNoneMatch != NULL && StringContains(ifNoneMatch, eTag) >= 0)
+		{
+			// The browser already has this version of the file
+			const bool keepOpen = WantsKeepAlive();
+			req->Write("HTTP/1.1 304 Not Modified\n");
+			req->Printf("ETag: %s\n", eTag);
+			req->Write("Cache-Control: no-cache\n");
+			req->Printf("Connection: %s\n\n", keepOpen ? "keep-alive" : "close");
+			network->SendAndClose(NULL, keepOpen);
+			return;
+		}
+	}
+
+	FileStore *fileToSend = platform->GetFileStore(platform->GetWebDir(), fileName, false);
+	if (fileToSend == NULL)
+	{
+		RejectMessage("not found", 404);
+		return;
+	}
+
 	req->Write("HTTP/1.1 200 OK\n");
 
 	const char* contentType;
-	bool zip = false;
 	if (StringEndsWith(nameOfFileToSend, ".png"))
 	{
 		contentType = "image/png";
@@ -824,7 +1039,7 @@ void Webserver::HttpInterpreter::SendFile(const char* nameOfFileToSend)
 	else if (StringEndsWith(nameOfFileToSend, ".zip"))
 	{
 		contentType = "application/zip";
-		zip = true;
+		gzip = true;
 	}
 	else
 	{
@@ -832,14 +1047,24 @@ void Webserver::HttpInterpreter::SendFile(const char* nameOfFileToSend)
 	}
 	req->Printf("Content-Type: %s\n", contentType);
 
-	if (zip && fileToSend != NULL)
+	if (gzip)
 	{
 		req->Write("Content-Encoding: gzip\n");
-		req->Printf("Content-Length: %lu", fileToSend->Length());
+	}
+	req->Printf("Content-Length: %lu\n", fileToSend->Length());
+
+	if (cacheable)
+	{
+		// Let the browser keep the file, but make it check with us before using it again
+		req->Printf("ETag: %s\n", eTag);
+		req->Write("Cache-Control: no-cache\n");
+		req->Write("Vary: Accept-Encoding\n");
 	}
 
-	req->Write("Connection: close\n\n");
-	network->SendAndClose(fileToSend);
+	// We always send the length, so the connection can stay open for the next request
+	const bool keepOpen = WantsKeepAlive();
+	req->Printf("Connection: %s\n\n", keepOpen ? "keep-alive" : "close");
+	network->SendAndClose(fileToSend, keepOpen);
 }
 
 void Webserver::HttpInterpreter::SendGCodeReply()
@@ -848,9 +1073,198 @@ void Webserver::HttpInterpreter::SendGCodeReply()
 	req->Write("HTTP/1.1 200 OK\n");
 	req->Write("Content-Type: text/plain\n");
 	req->Printf("Content-Length: %u\n", reprap.GetGcodeReply().strlen());
-	req->Write("Connection: close\n\n");
+	const bool keepOpen = WantsKeepAlive();
+	req->Printf("Connection: %s\n\n", keepOpen ? "keep-alive" : "close");
 	req->Write(reprap.GetGcodeReply());
-	network->SendAndClose(NULL);
+	network->SendAndClose(NULL, keepOpen);
+}
+
+// Turn the current connection into a status stream. We send the headers of a server-sent event stream
+// and keep the connection open, then PushStatus sends an event whenever something has changed.
+void Webserver::HttpInterpreter::StartStatusStream()
+{
+	if (numStatusStreams == maxStatusStreams)
+	{
+		RejectMessage("too many status streams", 503);
+		return;
+	}
+
+	float interval = defaultStreamInterval;
+	if (numQualKeys != 0 && StringEquals(qualifiers[0].key, "interval"))
+	{
+		interval = max<float>(atoi(qualifiers[0].value) / 1000.0, minStreamInterval);
+	}
+
+	NetworkTransaction *req = network->GetTransaction();
+	StatusStream& stream = statusStreams[numStatusStreams++];
+	stream.cs = req->GetConnection();
+	stream.ip = req->GetRemoteIP();
+	stream.port = req->GetRemotePort();
+	stream.statusSeq = 0;
+	stream.replySeq = reprap.GetReplySeq();
+	stream.messageSeq = reprap.GetMessageSeq();
+	stream.interval = interval;
+	stream.lastPushTime = platform->Time() - interval;
+
+	req->Write("HTTP/1.1 200 OK\n");
+	req->Write("Content-Type: text/event-stream\n");
+	req->Write("Cache-Control: no-cache\n");
+	req->Write("Connection: keep-alive\n\n");
+	network->SendAndClose(NULL, true);
+}
+
+// Send status events to the clients that have opened status streams. Each client gets at most one event every
+// stream interval, and only if something has changed. If the last event hasn't been sent yet because the client
+// or the network is slow, we skip this one, so the next event carries all the changes since the last one.
+void Webserver::HttpInterpreter::PushStatus()
+{
+	const float now = platform->Time();
+	for (size_t i = 0; i < numStatusStreams; i++)
+	{
+		StatusStream& stream = statusStreams[i];
+		if (now - stream.lastPushTime < stream.interval || stream.cs->sendingTransaction != NULL || !network->CanAcquireTransaction())
+		{
+			continue;
+		}
+		stream.lastPushTime = now;
+
+		char statusBuffer[jsonReplyLength];
+		StringRef status(statusBuffer, ARRAY_SIZE(statusBuffer));
+		const uint32_t statusSeq = reprap.GetCompactStatusResponse(status, stream.statusSeq);
+		const bool sendStatus = (statusSeq != stream.statusSeq);
+		const bool sendReply = (reprap.GetReplySeq() != stream.replySeq);
+		const bool sendMessage = (reprap.GetMessageSeq() != stream.messageSeq && reprap.GetMessage()[0] != 0);
+		if (!(sendStatus || sendReply || sendMessage) || !network->AcquireStreamTransaction(stream.cs))
+		{
+			continue;
+		}
+
+		NetworkTransaction *req = network->GetTransaction();
+		if (sendStatus)
+		{
+			req->Write("event: status\ndata: ");
+			req->Write(status);
+			req->Write("\n\n");
+			stream.statusSeq = statusSeq;
+		}
+
+		if (sendReply)
+		{
+			// Each line of the reply needs its own data field
+			req->Write("event: reply\ndata: ");
+			for (const char *p = reprap.GetGcodeReply().Pointer(); *p != 0; p++)
+			{
+				if (*p == '\n')
+				{
+					if (p[1] != 0)
+					{
+						req->Write("\ndata: ");
+					}
+				}
+				else
+				{
+					req->Write(*p);
+				}
+			}
+			req->Write("\n\n");
+			stream.replySeq = reprap.GetReplySeq();
+		}
+
+		if (sendMessage)
+		{
+			req->Printf("event: message\ndata: %s\n\n", reprap.GetMessage());
+		}
+		stream.messageSeq = reprap.GetMessageSeq();
+
+		network->SendAndClose(NULL, true);
+	}
+}
+
+// Send the list of files in a directory using chunked transfer encoding, so that there is no limit on its length
+void Webserver::HttpInterpreter::StartFileList(const char* dir)
+{
+	if (fileListing.cs != NULL)
+	{
+		RejectMessage("file list busy", 503);
+		return;
+	}
+
+	NetworkTransaction *req = network->GetTransaction();
+	fileListing.cs = req->GetConnection();
+	fileListing.ip = req->GetRemoteIP();
+	fileListing.port = req->GetRemotePort();
+	fileListing.keepOpen = WantsKeepAlive();
+	fileListing.filesSent = 0;
+	strncpy(fileListing.dir, dir, ARRAY_SIZE(fileListing.dir));
+	fileListing.dir[ARRAY_UPB(fileListing.dir)] = 0;
+
+	req->Write("HTTP/1.1 200 OK\n");
+	req->Write("Content-Type: application/json\n");
+	req->Write("Transfer-Encoding: chunked\n");
+	req->Printf("Connection: %s\n\n", fileListing.keepOpen ? "keep-alive" : "close");
+	WriteFileList();
+}
+
+// Write as much of the file list as the free SendBuffers can hold to the current transaction. If they run out,
+// this part is sent and ContinueFileList carries on from the next file once it has gone.
+void Webserver::HttpInterpreter::WriteFileList()
+{
+	NetworkTransaction *req = network->GetTransaction();
+	ChunkedWriter writer(req);
+	if (fileListing.filesSent == 0)
+	{
+		writer.cat("{\"dir\":");
+		writer.catEncoded(fileListing.dir);
+		writer.cat(",\"files\":[");
+	}
+
+	// The directory may have been read by someone else since the last part, so carry on from the position we saved
+	MassStorage *massStorage = platform->GetMassStorage();
+	FileInfo fileInfo;
+	bool gotFile;
+	if (fileListing.filesSent == 0)
+	{
+		gotFile = massStorage->FindFirst(fileListing.dir, fileInfo);
+	}
+	else
+	{
+		massStorage->SetFindPosition(fileListing.position);
+		gotFile = massStorage->FindNext(fileInfo);
+	}
+
+	while (gotFile)
+	{
+		if (!writer.HasSpace(2 * strlen(fileInfo.fileName) + 8))
+		{
+			writer.Flush();
+			network->SendAndClose(NULL, true, true);
+			return;
+		}
+
+		if (fileListing.filesSent != 0)
+		{
+			writer.cat(",");
+		}
+		writer.catEncoded(fileInfo.fileName);
+		fileListing.filesSent++;
+		massStorage->GetFindPosition(fileListing.position);
+		gotFile = massStorage->FindNext(fileInfo);
+	}
+
+	writer.cat("]}");
+	writer.Finish();
+	network->SendAndClose(NULL, fileListing.keepOpen);
+	fileListing.cs = NULL;
+}
+
+// Send the next part of a long file list when the last one has gone
+void Webserver::HttpInterpreter::ContinueFileList()
+{
+	if (fileListing.cs != NULL && fileListing.cs->sendingTransaction == NULL && network->CanAcquireTransaction()
+		&& network->AcquireStreamTransaction(fileListing.cs))
+	{
+		WriteFileList();
+	}
 }
 
 void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
@@ -862,6 +1276,21 @@ void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
 		return;
 	}
 
+	// So is rr_stream, because it keeps the connection open to send status updates
+	if (IsAuthenticated() && StringEquals(command, "stream"))
+	{
+		StartStatusStream();
+		return;
+	}
+
+	// File lists may be too long for the JSON buffer, so they are written straight to the network
+	if (StringEquals(command, "files") && (IsAuthenticated() || (reprap.NoPasswordSet() && Authenticate())))
+	{
+		UpdateAuthentication();
+		StartFileList((numQualKeys != 0 && StringEquals(qualifiers[0].key, "dir")) ? qualifiers[0].value : platform->GetGCodeDir());
+		return;
+	}
+
 	// See if we can find a suitable JSON response
 	NetworkTransaction *req = network->GetTransaction();
 	bool keepOpen = false;
@@ -895,15 +1324,7 @@ void Webserver::HttpInterpreter::SendJsonResponse(const char* command)
 	if (mayKeepOpen)
 	{
 		// Check that the browser wants to persist the connection too
-		for (size_t i = 0; i < numHeaderKeys; ++i)
-		{
-			if (StringEquals(headers[i].key, "Connection"))
-			{
-// Comment out the following line to disable persistent connections
-				keepOpen = StringEquals(headers[i].value, "keep-alive");
-				break;
-			}
-		}
+		keepOpen = WantsKeepAlive();
 	}
 	req->Write("HTTP/1.1 200 OK\n");
 	req->Write("Content-Type: application/json\n");
@@ -1004,10 +1425,8 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 		else if (StringEquals(request, "upload_begin") && StringEquals(key, "name"))
 		{
 			FileStore *file = platform->GetFileStore("0:/", value, true);
-			if (StartUpload(file))
+			if (StartUpload(file, value))
 			{
-				strncpy(filenameBeingUploaded, value, ARRAY_SIZE(filenameBeingUploaded));
-				filenameBeingUploaded[ARRAY_UPB(filenameBeingUploaded)] = 0;
 				uploadingTextData = (numQualKeys < 2 || !StringEquals(qualifiers[1].key, "type") ||
 										!StringEquals(qualifiers[1].value, "binary"));
 			}
@@ -1039,12 +1458,6 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 			bool ok = platform->GetMassStorage()->Delete("0:/", value);
 			response.printf("{\"err\":%d}", (ok) ? 0 : 1);
 		}
-		else if (StringEquals(request, "files"))
-		{
-			// TODO: get rid of GetFilesResponse and write directly to NetworkTransaction!
-			const char* dir = (StringEquals(key, "dir")) ? value : platform->GetGCodeDir();
-			reprap.GetFilesResponse(response, dir, false);
-		}
 		else if (StringEquals(request, "fileinfo"))
 		{
 			reprap.GetPrintMonitor()->GetFileInfoResponse(response, (StringEquals(key, "name")) ? value : NULL);
@@ -1076,6 +1489,16 @@ bool Webserver::HttpInterpreter::GetJsonResponse(const char* request, StringRef&
 		{
 			reprap.GetConfigResponse(response);
 		}
+		else if (StringEquals(request, "statusdelta"))
+		{
+			const uint32_t from = (StringEquals(key, "seq")) ? strtoul(value, NULL, 10) : 0;
+			reprap.GetCompactStatusResponse(response, from);
+		}
+		else if (StringEquals(request, "history"))
+		{
+			const uint32_t from = (StringEquals(key, "seq")) ? strtoul(value, NULL, 10) : 0;
+			reprap.GetHeat()->GetHistoryResponse(response, from);
+		}
 		else
 		{
 			found = false;
@@ -1125,6 +1548,23 @@ void Webserver::HttpInterpreter::ResetSessions()
 
 void Webserver::HttpInterpreter::ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort)
 {
+	// Stop sending a file list to this client
+	if (fileListing.cs != NULL && fileListing.ip == remoteIP && fileListing.port == remotePort)
+	{
+		fileListing.cs = NULL;
+	}
+
+	// Stop pushing status updates to this client
+	for (size_t i = 0; i < numStatusStreams; i++)
+	{
+		if (statusStreams[i].ip == remoteIP && statusStreams[i].port == remotePort)
+		{
+			numStatusStreams--;
+			statusStreams[i] = statusStreams[numStatusStreams];
+			break;
+		}
+	}
+
 	// Deal with aborted POST uploads. Note that we also check the remote port here,
 	// because the client *might* have two instances of the web interface running.
 	if (uploadState == uploadOK)
@@ -1545,18 +1985,21 @@ bool Webserver::HttpInterpreter::ProcessMessage()
 				if (contentLengthFound)
 				{
 					FileStore *file = platform->GetFileStore("0:/", qualifiers[0].value, true);
-					if (StartUpload(file))
+					if (StartUpload(file, qualifiers[0].value))
 					{
 						// Start new file upload
 						uploadingTextData = false;
 						uploadedBytes = numContinuationBytes = 0;
 
-						strncpy(filenameBeingUploaded, qualifiers[0].value, ARRAY_SIZE(filenameBeingUploaded));
-						filenameBeingUploaded[ARRAY_UPB(filenameBeingUploaded)] = 0;
-
 						// Set POST variables only if we actually need to store data
 						if (postFileLength > 0)
 						{
+							// Allocate the space for the whole file now rather than as it arrives
+							if (!fileBeingUploaded.Preallocate(postFileLength))
+							{
+								platform->Message(HOST_MESSAGE, "Could not preallocate %u bytes for upload\n", (unsigned int)postFileLength);
+							}
+
 							uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
 							uint16_t remotePort = network->GetTransaction()->GetRemotePort();
 							for(size_t i=0; i<numActiveSessions; i++)
@@ -1619,6 +2062,27 @@ bool Webserver::HttpInterpreter::Authenticate()
 	return false;
 }
 
+// Return the value of the specified request header, or NULL if it wasn't sent
+const char* Webserver::HttpInterpreter::GetHeaderValue(const char* key) const
+{
+	for (size_t i = 0; i < numHeaderKeys; i++)
+	{
+		if (StringEquals(headers[i].key, key))
+		{
+			return headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+// Return true if the client asked for the connection to be kept open after this request
+bool Webserver::HttpInterpreter::WantsKeepAlive() const
+{
+	const char *connection = GetHeaderValue("Connection");
+// Return false here to disable persistent connections
+	return connection != NULL && StringEquals(connection, "keep-alive");
+}
+
 bool Webserver::HttpInterpreter::IsAuthenticated() const
 {
 	uint32_t remoteIP = network->GetTransaction()->GetRemoteIP();
@@ -1685,8 +2149,9 @@ void Webserver::HttpInterpreter::CheckSessions()
 //
 //********************************************************************************************
 
-Webserver::FtpInterpreter::FtpInterpreter(Platform *p, Webserver *ws, Network *n)
-	: ProtocolInterpreter(p, ws, n), state(authenticating), clientPointer(0)
+Webserver::FtpInterpreter::FtpInterpreter(Platform *p, Webserver *ws, Network *n, uint8_t s)
+	: ProtocolInterpreter(p, ws, n), state(authenticating), session(s), controlConnection(NULL), dataConnection(NULL),
+	  clientPointer(0), allocationSize(0), listing(false), filesListed(0)
 {
 	strcpy(currentDir, "/");
 }
@@ -1700,48 +2165,48 @@ void Webserver::FtpInterpreter::ConnectionEstablished()
 
 	NetworkTransaction *req = network->GetTransaction();
 
-	switch (state)
+	if (req->GetLocalPort() == ftpPort)
 	{
-		case waitingForPasvPort:
-			if (req->GetLocalPort() == ftpPort)
-			{
-				network->SendAndClose(NULL);
-				return;
-			}
-
-			network->SaveDataConnection();
-			state = pasvPortConnected;
-
-			break;
-
-		default:
-			// I (zpl) wanted to allow only one active FTP session, but some FTP programs
-			// like FileZilla open a second connection for transfers for some reason.
-			if (req->GetLocalPort() == ftpPort)
-			{
-				req->Write("220 RepRapPro Ormerod\r\n");
-				network->SendAndClose(NULL, true);
-
-				ResetState();
-			}
+		// A new client has been given this session. Some FTP programs like FileZilla
+		// open a second connection for transfers, which gets a session of its own.
+		ResetState();
+		controlConnection = req->GetConnection();
+		network->SaveFTPConnection(session);
 
-			break;
+		req->Write("220 RepRapPro Ormerod\r\n");
+		network->SendAndClose(NULL, true);
+	}
+	else if (state == waitingForPasvPort)
+	{
+		dataConnection = req->GetConnection();
+		network->SaveDataConnection(session);
+		state = pasvPortConnected;
 	}
 }
 
 void Webserver::FtpInterpreter::ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort)
 {
-	if (localPort != ftpPort)
+	if (localPort == ftpPort)
+	{
+		// The client has gone, so make this session available to someone else
+		ResetState();
+	}
+	else
 	{
 		// Close the data port
-		network->CloseDataPort();
+		dataConnection = NULL;
+		network->CloseDataPort(session);
 
 		// Send response
-		if (network->AcquireFTPTransaction())
+		if (network->AcquireFTPTransaction(session))
 		{
 			if (state == doingPasvIO)
 			{
-				if (uploadState != uploadError)
+				if (listing)
+				{
+					SendReply(426, "Connection closed; transfer aborted.");
+				}
+				else if (uploadState != uploadError)
 				{
 					SendReply(226, "Transfer complete.");
 				}
@@ -1762,6 +2227,7 @@ void Webserver::FtpInterpreter::ConnectionLost(uint32_t remoteIP, uint16_t remot
 			FinishUpload(0);
 			uploadState = notUploading;
 		}
+		listing = false;
 		state = authenticated;
 	}
 }
@@ -1816,16 +2282,36 @@ void Webserver::FtpInterpreter::ResetState()
 {
 	clientPointer = 0;
 	strcpy(currentDir, "/");
+	allocationSize = 0;
+	listing = false;
 
-	network->CloseDataPort();
+	network->CloseDataPort(session);
 	CancelUpload();
 
+	controlConnection = dataConnection = NULL;
 	state = authenticating;
 }
 
 bool Webserver::FtpInterpreter::DoingFastUpload() const
 {
-	return (IsUploading() && network->GetTransaction()->GetLocalPort() == network->GetDataPort());
+	return (IsUploading() && network->GetTransaction()->GetConnection() == dataConnection);
+}
+
+// Send the next part of a long directory listing when the last one has gone
+void Webserver::FtpInterpreter::ContinueFileList()
+{
+	if (listing && dataConnection != NULL && dataConnection->sendingTransaction == NULL && network->CanAcquireTransaction()
+		&& network->AcquireDataTransaction(session))
+	{
+		WriteFileList();
+	}
+}
+
+// Report the state of this session and how much memory it uses, including its upload buffer once it has been allocated
+void Webserver::FtpInterpreter::Diagnostics() const
+{
+	const unsigned int memoryUsed = sizeof(FtpInterpreter) + sizeof(GcodeFileScanner) + ((uploadBuffer != NULL) ? uploadBufferSize : 0);
+	platform->AppendMessage(BOTH_MESSAGE, "FTP session %u: %s, state %d, %u bytes\n", session, (IsFree()) ? "free" : "in use", state, memoryUsed);
 }
 
 // return true if an error has occurred, false otherwise
@@ -1930,15 +2416,21 @@ void Webserver::FtpInterpreter::ProcessLine()
 				/* open random port > 1023 */
 				rand();
 				uint16_t pasv_port = random(1024, 65535);
-				network->OpenDataPort(pasv_port);
-				portOpenTime = platform->Time();
-				state = waitingForPasvPort;
-
-				/* send FTP response */
-				snprintf(ftpResponse, ftpResponseLength, "Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
-						*ip_address++, *ip_address++, *ip_address++, *ip_address++,
-						pasv_port / 256, pasv_port % 256);
-				SendReply(227, ftpResponse);
+				if (network->OpenDataPort(session, pasv_port))
+				{
+					portOpenTime = platform->Time();
+					state = waitingForPasvPort;
+
+					/* send FTP response */
+					snprintf(ftpResponse, ftpResponseLength, "Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
+							*ip_address++, *ip_address++, *ip_address++, *ip_address++,
+							pasv_port / 256, pasv_port % 256);
+					SendReply(227, ftpResponse);
+				}
+				else
+				{
+					SendReply(425, "Can't open data connection.");
+				}
 			}
 			// PASV commands are not supported in this state
 			else if (StringEquals(clientMessage, "LIST") || StringStartsWith(clientMessage, "RETR") || StringStartsWith(clientMessage, "STOR"))
@@ -2064,6 +2556,12 @@ void Webserver::FtpInterpreter::ProcessLine()
 					}
 				}
 			}
+			// reserve space for the next file to be stored
+			else if (StringStartsWith(clientMessage, "ALLO"))
+			{
+				allocationSize = strtoul(&clientMessage[4], NULL, 10);
+				SendReply(200, "ALLO okay.");
+			}
 			// no op
 			else if (StringEquals(clientMessage, "NOOP"))
 			{
@@ -2088,7 +2586,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 			{
 				SendReply(425, "Failed to establish connection.");
 
-				network->CloseDataPort();
+				network->CloseDataPort(session);
 				state = authenticated;
 			}
 			else
@@ -2099,9 +2597,6 @@ void Webserver::FtpInterpreter::ProcessLine()
 			break;
 
 		case pasvPortConnected:
-			// save current connection state so we can send '226 Transfer complete.' when ConnectionLost() is called
-			network->SaveFTPConnection();
-
 			// list directory entries
 			if (StringEquals(clientMessage, "LIST"))
 			{
@@ -2111,35 +2606,18 @@ void Webserver::FtpInterpreter::ProcessLine()
 				ftp_req->Write(ftpResponse);
 				network->SendAndClose(NULL, true);
 
-				// send file list via data port
-				if (network->AcquireDataTransaction())
+				// send file list via data port as the directory is read
+				if (network->AcquireDataTransaction(session))
 				{
-					FileInfo file_info;
-					if (platform->GetMassStorage()->FindFirst(currentDir, file_info))
-					{
-						NetworkTransaction *data_req = network->GetTransaction();
-						char line[300];
-
-						do {
-							// Example for a typical UNIX-like file list:
-							// "drwxr-xr-x    2 ftp      ftp             0 Apr 11 2013 bin\r\n"
-							char dirChar = (file_info.isDirectory) ? 'd' : '-';
-							snprintf(line, ARRAY_SIZE(line), "%crw-rw-rw- 1 ftp ftp %13d %s %02d %04d %s\r\n",
-									dirChar, file_info.size, platform->GetMassStorage()->GetMonthName(file_info.month),
-									file_info.day, file_info.year, file_info.fileName);
-
-							// Fortunately we don't need to bother with output buffer chunks any more...
-							data_req->Write(line);
-						} while (platform->GetMassStorage()->FindNext(file_info));
-					}
-
-					network->SendAndClose(NULL);
+					listing = true;
+					filesListed = 0;
 					state = doingPasvIO;
+					WriteFileList();
 				}
 				else
 				{
 					SendReply(500, "Unknown error.");
-					network->CloseDataPort();
+					network->CloseDataPort(session);
 					state = authenticated;
 				}
 			}
@@ -2158,18 +2636,27 @@ void Webserver::FtpInterpreter::ProcessLine()
 					file = platform->GetFileStore(currentDir, filename, true);
 				}
 
-				if (StartUpload(file))
+				if (StartUpload(file, (filename[0] == '/') ? filename : platform->GetMassStorage()->CombineName(currentDir, filename)))
 				{
-					strncpy(filenameBeingUploaded, filename, ARRAY_SIZE(filenameBeingUploaded));
-					filenameBeingUploaded[ARRAY_UPB(filenameBeingUploaded)] = 0;
+					// Allocate the space announced by ALLO, or grow the file in chunks if we don't know its size
+					if (allocationSize != 0)
+					{
+						(void)fileBeingUploaded.Preallocate(allocationSize);
+					}
+					else
+					{
+						(void)fileBeingUploaded.Preallocate(FILE_ALLOCATION_CHUNK, FILE_ALLOCATION_CHUNK);
+					}
+					allocationSize = 0;
 
 					SendReply(150, "OK to send data.");
 					state = doingPasvIO;
 				}
 				else
 				{
+					allocationSize = 0;
 					SendReply(550, "Failed to open file.");
-					network->CloseDataPort();
+					network->CloseDataPort(session);
 					state = authenticated;
 				}
 			}
@@ -2197,7 +2684,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 					snprintf(ftpResponse, ftpResponseLength, "Opening data connection for %s (%lu bytes).", filename, fs->Length());
 					SendReply(150, ftpResponse);
 
-					if (network->AcquireDataTransaction())
+					if (network->AcquireDataTransaction(session))
 					{
 						// send the file via data port
 						network->SendAndClose(fs, false);
@@ -2206,7 +2693,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 					else
 					{
 						SendReply(500, "Unknown error.");
-						network->CloseDataPort();
+						network->CloseDataPort(session);
 						state = authenticated;
 					}
 				}
@@ -2215,7 +2702,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 			else
 			{
 				SendReply(500, "Unknown command.");
-				network->CloseDataPort();
+				network->CloseDataPort(session);
 				state = authenticated;
 			}
 
@@ -2232,7 +2719,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 				}
 				else
 				{
-					network->CloseDataPort();
+					network->CloseDataPort(session);
 					SendReply(226, "ABOR successful.");
 				}
 			}
@@ -2240,7 +2727,7 @@ void Webserver::FtpInterpreter::ProcessLine()
 			else
 			{
 				SendReply(500, "Unknown command.");
-				network->CloseDataPort();
+				network->CloseDataPort(session);
 				state = authenticated;
 			}
 
@@ -2248,6 +2735,53 @@ void Webserver::FtpInterpreter::ProcessLine()
 	}
 }
 
+// Write as many directory entries to the data connection as the free SendBuffers can hold. If they run out,
+// this part is sent and ContinueFileList carries on from the next entry once it has gone.
+void Webserver::FtpInterpreter::WriteFileList()
+{
+	NetworkTransaction *req = network->GetTransaction();
+
+	// The directory may have been read by someone else since the last part, so carry on from the position we saved
+	MassStorage *massStorage = platform->GetMassStorage();
+	FileInfo fileInfo;
+	bool gotFile;
+	if (filesListed == 0)
+	{
+		gotFile = massStorage->FindFirst(currentDir, fileInfo);
+	}
+	else
+	{
+		massStorage->SetFindPosition(listPosition);
+		gotFile = massStorage->FindNext(fileInfo);
+	}
+
+	while (gotFile)
+	{
+		// Example for a typical UNIX-like file list:
+		// "drwxr-xr-x    2 ftp      ftp             0 Apr 11 2013 bin\r\n"
+		char line[300];
+		char dirChar = (fileInfo.isDirectory) ? 'd' : '-';
+		snprintf(line, ARRAY_SIZE(line), "%crw-rw-rw- 1 ftp ftp %13d %s %02d %04d %s\r\n",
+				dirChar, fileInfo.size, massStorage->GetMonthName(fileInfo.month),
+				fileInfo.day, fileInfo.year, fileInfo.fileName);
+
+		if (strlen(line) > network->SendBufferSpace())
+		{
+			network->SendAndClose(NULL, true);
+			return;
+		}
+
+		req->Write(line);
+		filesListed++;
+		massStorage->GetFindPosition(listPosition);
+		gotFile = massStorage->FindNext(fileInfo);
+	}
+
+	// Closing the data connection tells the client that the listing is complete
+	listing = false;
+	network->SendAndClose(NULL);
+}
+
 void Webserver::FtpInterpreter::SendReply(int code, const char *message, bool keepConnection)
 {
 	NetworkTransaction *req = network->GetTransaction();
@@ -46,9 +46,15 @@ const unsigned int maxHeaders = 16;				// max number of key/value pairs in the h
 
 const unsigned int jsonReplyLength = 2048;		// size of buffer used to hold JSON reply
 
+const unsigned int uploadBufferSize = 2048;		// uploaded data is written to the SD card in blocks of this many bytes (whole sectors)
+
 const unsigned int maxSessions = 8;				// maximum number of simultaneous HTTP sessions
 const unsigned int httpSessionTimeout = 30;		// HTTP session timeout in seconds
 
+const unsigned int maxStatusStreams = 4;		// maximum number of clients receiving pushed status updates
+const float defaultStreamInterval = 1.0;		// default minimum time between status pushes to one client, in seconds
+const float minStreamInterval = 0.2;			// the shortest interval a client may ask for
+
 /* FTP */
 
 const unsigned int ftpResponseLength = 128;		// maximum FTP response length
@@ -60,6 +66,7 @@ const unsigned int telnetMessageLength = 256;	// maximum line length for incomin
 
 
 class Webserver;
+class GcodeFileScanner;
 
 // This is the abstract class for all supported protocols
 // Any inherited class should implement a state machine to increase performance and reduce memory usage.
@@ -100,11 +107,16 @@ class ProtocolInterpreter
 	    char filenameBeingUploaded[FILENAME_LENGTH];
 	    const char *uploadPointer;							// pointer to start of uploaded data not yet written to file
 	    unsigned int uploadLength;							// amount of data not yet written to file
+	    char *uploadBuffer;									// uploaded data waiting to be written in whole sectors
+	    unsigned int uploadBufferLength;					// amount of data in uploadBuffer
+	    float uploadStartTime;
+	    GcodeFileScanner *uploadScanner;					// collects G-code file info from the uploaded data
 
-	    virtual bool StartUpload(FileStore *file);
+	    virtual bool StartUpload(FileStore *file, const char *fileName);
 	    virtual bool StoreUploadData(const char* data, unsigned int len);
 		bool IsUploading() const;
 	    virtual void FinishUpload(uint32_t fileLength);
+	    bool WriteUploadBuffer();
 };
 
 class Webserver
@@ -123,6 +135,7 @@ class Webserver
 
     void ConnectionLost(const ConnectionState *cs);
     void ConnectionError();
+    void UploadFinished(uint32_t bytes, float time);
 
     friend class Platform;
 
@@ -149,6 +162,9 @@ class Webserver
 			void ResetSessions();
 			void CheckSessions();
 
+			void PushStatus();
+			void ContinueFileList();
+
 		private:
 
 			// HTTP server state enumeration. The order is important, in particular xxxEsc1 must follow xxx, and xxxEsc2 must follow xxxEsc1.
@@ -180,10 +196,15 @@ class Webserver
 			void SendFile(const char* nameOfFileToSend);
 			void SendGCodeReply();
 			void SendJsonResponse(const char* command);
+			void StartStatusStream();
+			void StartFileList(const char* dir);
+			void WriteFileList();
 			bool GetJsonResponse(const char* request, StringRef& response, const char* key, const char* value, size_t valueLength, bool& keepOpen);
 			void GetJsonUploadResponse(StringRef& response);
 			bool ProcessMessage();
 			bool RejectMessage(const char* s, unsigned int code = 500);
+			const char* GetHeaderValue(const char* key) const;
+			bool WantsKeepAlive() const;
 
 			bool Authenticate();
 			bool IsAuthenticated() const;
@@ -218,13 +239,45 @@ class Webserver
 			HttpSession sessions[maxSessions];
 		    unsigned int numActiveSessions;
 
+		    // Clients that have asked for status updates to be pushed to them
+
+		    struct StatusStream
+		    {
+		    	ConnectionState *cs;
+		    	uint32_t ip;
+		    	uint16_t port;
+		    	uint32_t statusSeq;			// last compact status sequence number sent
+		    	unsigned int replySeq;		// last G-code reply sequence number sent
+		    	unsigned int messageSeq;	// last message sequence number sent
+		    	float interval;				// minimum time between pushes
+		    	float lastPushTime;
+		    };
+
+		    StatusStream statusStreams[maxStatusStreams];
+		    unsigned int numStatusStreams;
+
+		    // File listing that is being sent in several parts
+
+		    struct FileListing
+		    {
+		    	ConnectionState *cs;		// NULL if no listing is being sent
+		    	uint32_t ip;
+		    	uint16_t port;
+		    	bool keepOpen;
+		    	unsigned int filesSent;
+		    	DIR position;				// where the directory read had got to before the first file not yet sent
+		    	char dir[FILENAME_LENGTH];
+		    };
+
+		    FileListing fileListing;
+
 		protected:
 		    bool uploadingTextData;							// do we need to count UTF-8 continuation bytes?
 		    uint32_t numContinuationBytes;					// number of UTF-8 continuation bytes we have received
 
 		    uint32_t postFileLength, uploadedBytes;			// how many POST bytes do we expect and how many have already been written?
 
-		    bool StartUpload(FileStore *file);
+		    bool StartUpload(FileStore *file, const char *fileName);
 			bool StoreUploadData(const char* data, unsigned int len);
 			void FinishUpload(uint32_t fileLength);
 	};
@@ -234,7 +287,7 @@ class Webserver
 	{
 		public:
 
-			FtpInterpreter(Platform *p, Webserver *ws, Network *n);
+			FtpInterpreter(Platform *p, Webserver *ws, Network *n, uint8_t s);
 			void ConnectionEstablished();
 			void ConnectionLost(uint32_t remoteIP, uint16_t remotePort, uint16_t localPort);
 			bool CharFromClient(const char c);
@@ -242,6 +295,11 @@ class Webserver
 
 			bool DoingFastUpload() const;
 
+			bool IsFree() const;
+			bool UsesConnection(const ConnectionState *cs) const;
+			void ContinueFileList();
+			void Diagnostics() const;
+
 		private:
 
 			enum FtpState
@@ -253,6 +311,9 @@ class Webserver
 				doingPasvIO				// client is connected and data is being transferred
 			};
 			FtpState state;
+			uint8_t session;				// which of the Network's FTP connections and PASV ports we use
+			ConnectionState *controlConnection;	// NULL if no client is using this session
+			ConnectionState *dataConnection;
 
 			char clientMessage[ftpMessageLength];
 			unsigned int clientPointer;
@@ -260,6 +321,10 @@ class Webserver
 
 			char filename[FILENAME_LENGTH];
 			char currentDir[FILENAME_LENGTH];
+			uint32_t allocationSize;		// size announced by ALLO for the next STOR, or 0 if unknown
+			bool listing;					// true while a directory listing is being sent
+			unsigned int filesListed;		// number of directory entries sent so far
+			DIR listPosition;				// where the directory read had got to before the first entry not yet sent
 
 			float portOpenTime;
 
@@ -269,8 +334,10 @@ class Webserver
 
 			void ReadFilename(int start);
 			void ChangeDirectory(const char *newDirectory);
+			void WriteFileList();
 	};
-	FtpInterpreter *ftpInterpreter;
+	FtpInterpreter *ftpInterpreters[numFtpSessions];
+	FtpInterpreter *GetFtpInterpreter(const ConnectionState *cs, bool newConnection);
 
 	class TelnetInterpreter : public ProtocolInterpreter
 	{
@@ -323,6 +390,9 @@ class Webserver
 
     float lastTime;
     float longWait;
+
+    uint32_t lastUploadBytes;						// length of the last file uploaded
+    float lastUploadTime;							// how long it took
 };
 
 inline bool ProtocolInterpreter::NeedMoreData()  { return true; }
@@ -331,6 +401,9 @@ inline bool ProtocolInterpreter::IsUploading() const { return uploadState != not
 
 inline void Webserver::HttpInterpreter::FinishUpload(uint32_t fileLength) { ProtocolInterpreter::FinishUpload(fileLength + numContinuationBytes); }
 
+inline bool Webserver::FtpInterpreter::IsFree() const { return controlConnection == NULL; }
+inline bool Webserver::FtpInterpreter::UsesConnection(const ConnectionState *cs) const { return cs == controlConnection || cs == dataConnection; }
+
 inline bool Webserver::TelnetInterpreter::NeedMoreData() { return false; }	// we don't want a Telnet connection to block everything else
 inline bool Webserver::TelnetInterpreter::HasRemainingData() const { return sendPending; }
 inline void Webserver::TelnetInterpreter::RemainingDataSent() { sendPending = false; }